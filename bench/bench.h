@@ -0,0 +1,78 @@
+#pragma once
+
+#include <file.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+
+namespace bench
+{
+
+using Clock = std::chrono::steady_clock;
+
+/// Command line options of the form "--name value".
+class Options
+{
+public:
+
+    Options (int argc, char** argv);
+
+    std::size_t get (const char* name, std::size_t fallback) const;
+
+    std::string get (const char* name, const char* fallback) const;
+
+private:
+
+    std::map<std::string, std::string> values;
+};
+
+/// A set of files served by one handler type.
+struct Fixture
+{
+    std::string name;
+    std::function<std::unique_ptr<kx::FileSystemHandler> ()> mount;
+    std::vector<std::string> paths;
+};
+
+struct FixtureOptions
+{
+    std::size_t files = 256;
+    std::size_t file_size = 64 << 10;
+    std::size_t path_length = 0; // pad paths to this length; 0 to leave them short
+};
+
+/// Return the i-th path of a fixture.
+std::string fixture_path (std::size_t i, std::size_t length);
+
+/// Return the contents of the i-th file: text-like data that compresses
+/// about as well as typical assets.
+std::string fixture_data (std::size_t i, std::size_t size);
+
+/// Write the same files as a directory, a stored and a deflated zip, a tar
+/// file and seekable zstd files under 'dir', and as a SquashFS image if
+/// mksquashfs is installed. Return a fixture for each.
+std::vector<Fixture> make_fixtures (const std::string& dir, const FixtureOptions&);
+
+/// Write a zip of the given files, stored or deflated.
+void write_zip (const std::string& file, const std::vector<std::string>& paths,
+                const std::vector<std::string>& data, bool deflate);
+
+/// Write a tar file of the given files.
+void write_tar (const std::string& file, const std::vector<std::string>& paths,
+                const std::vector<std::string>& data);
+
+/// Return the p-th percentile of the samples, which are sorted.
+double percentile (std::vector<double>& samples, double p);
+
+/// Return the microseconds elapsed between two points.
+double micros (Clock::time_point start, Clock::time_point end);
+
+int concurrency (const Options&);
+
+int scale (const Options&);
+
+} // namespace bench
@@ -0,0 +1,159 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+
+#include <cstdio>
+
+using namespace bench;
+using namespace kx;
+
+namespace
+{
+
+struct Result
+{
+    double ops; // opens and full reads per second
+    double mb; // megabytes read per second
+    double open_p50, open_p99; // microseconds
+    double read_p50, read_p99;
+};
+
+/// Open and read files from 'threads' threads for 'duration'. With 'same'
+/// every thread reads the first file; otherwise threads take turns over
+/// all the files.
+Result run (const FileSystem& fs, const std::vector<std::string>& paths, bool same,
+            unsigned threads, std::chrono::milliseconds duration)
+{
+    struct Samples
+    {
+        std::vector<double> open, read;
+        std::uint64_t bytes = 0;
+        std::string error;
+    };
+    std::vector<Samples> samples(threads);
+    std::atomic<bool> go(false), stop(false);
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]()
+        {
+            Samples& s = samples[t];
+            std::vector<char> buffer(64 << 10);
+            while (!go) std::this_thread::yield();
+            try
+            {
+                for (std::size_t k = t; !stop; k += threads)
+                {
+                    const std::string& path = same ? paths[0] : paths[k % paths.size()];
+                    Clock::time_point start = Clock::now();
+                    File file = fs.open(path.c_str());
+                    Clock::time_point opened = Clock::now();
+                    for (std::size_t n; (n = file.read(buffer.data(), buffer.size())) > 0; )
+                        s.bytes += n;
+                    Clock::time_point read = Clock::now();
+                    s.open.push_back(micros(start, opened));
+                    s.read.push_back(micros(opened, read));
+                }
+            }
+            catch (const std::exception& e)
+            {
+                s.error = e.what();
+            }
+        });
+
+    Clock::time_point start = Clock::now();
+    go = true;
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (std::thread& worker : workers) worker.join();
+    double seconds = micros(start, Clock::now()) / 1e6;
+
+    std::vector<double> open, read;
+    std::uint64_t bytes = 0;
+    for (Samples& s : samples)
+    {
+        if (!s.error.empty())
+            throw std::runtime_error(s.error);
+        open.insert(open.end(), s.open.begin(), s.open.end());
+        read.insert(read.end(), s.read.begin(), s.read.end());
+        bytes += s.bytes;
+    }
+    std::sort(open.begin(), open.end());
+    std::sort(read.begin(), read.end());
+
+    Result r;
+    r.ops = open.size() / seconds;
+    r.mb = bytes / seconds / (1 << 20);
+    r.open_p50 = percentile(open, 50);
+    r.open_p99 = percentile(open, 99);
+    r.read_p50 = percentile(read, 50);
+    r.read_p99 = percentile(read, 99);
+    return r;
+}
+
+} // namespace
+
+int bench::concurrency (const Options& options)
+{
+    unsigned max_threads = (unsigned) options.get("threads", (std::size_t) std::max(1u, std::thread::hardware_concurrency()));
+    std::chrono::milliseconds duration(options.get("ms", (std::size_t) 500));
+    FixtureOptions fixture;
+    fixture.files = std::max<std::size_t>(1, options.get("files", fixture.files));
+    fixture.file_size = options.get("size", fixture.file_size);
+
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < max_threads; n *= 2) counts.push_back(n);
+    counts.push_back(max_threads);
+
+    std::vector<Fixture> fixtures = make_fixtures(options.get("dir", "bench_fixtures"), fixture);
+    std::printf("%u file(s) of %zu bytes, %lld ms per run\n\n",
+                (unsigned) fixture.files, fixture.file_size, (long long) duration.count());
+    std::printf("%-14s %-5s %7s %10s %9s %7s %5s %9s %9s %9s %9s\n", "handler", "files", "threads",
+                "ops/s", "MB/s", "speedup", "eff", "open p50", "open p99", "read p50", "read p99");
+
+    // The phase whose tail latency grows most with threads points at the
+    // lock or shared resource that serialises it.
+    std::vector<std::string> hotspots;
+    for (const Fixture& f : fixtures)
+    {
+        FileSystem fs;
+        fs.addHandler(f.mount());
+        for (const std::string& path : f.paths) fs.open(path.c_str()).read_all();
+
+        for (int same = 1; same >= 0; --same)
+        {
+            Result first = {};
+            Result last = {};
+            for (unsigned threads : counts)
+            {
+                Result r = run(fs, f.paths, same != 0, threads, duration);
+                if (threads == 1) first = r;
+                last = r;
+                double speedup = first.ops > 0 ? r.ops / first.ops : 0;
+                std::printf("%-14s %-5s %7u %10.0f %9.1f %7.2f %5.2f %9.1f %9.1f %9.1f %9.1f\n",
+                            f.name.c_str(), same ? "same" : "diff", threads, r.ops, r.mb,
+                            speedup, speedup / threads, r.open_p50, r.open_p99, r.read_p50, r.read_p99);
+            }
+            if (counts.size() > 1)
+            {
+                double open = first.open_p99 > 0 ? last.open_p99 / first.open_p99 : 0;
+                double read = first.read_p99 > 0 ? last.read_p99 / first.read_p99 : 0;
+                char line[160];
+                std::snprintf(line, sizeof(line), "%-14s %-5s %s p99 x%.1f at %u threads",
+                              f.name.c_str(), same ? "same" : "diff", open >= read ? "open" : "read",
+                              std::max(open, read), counts.back());
+                hotspots.push_back(line);
+            }
+        }
+    }
+
+    if (!hotspots.empty())
+    {
+        std::printf("\nslowest-scaling phase per run:\n");
+        for (const std::string& line : hotspots) std::printf("  %s\n", line.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,339 @@
+#include "bench.h"
+#include <cpp/Exception.h>
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+#include <zlib.h>
+#endif
+#ifndef FILESYSTEM_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <fstream>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace kx;
+
+namespace
+{
+
+// Frames of the seekable zstd fixtures.
+const std::size_t ZSTD_FRAME = 32 << 10;
+
+void put (std::string& out, std::uint64_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i) out += (char) (value >> (8*i));
+}
+
+void write_file (const std::string& file, const std::string& data)
+{
+    std::ofstream out(file, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out)
+        throw EXCEPTION("Failed writing " + file);
+}
+
+/// Create the directory holding 'file' and its parents.
+void make_parents (const std::string& file)
+{
+    for (std::size_t slash = file.find('/', 1); slash != std::string::npos; slash = file.find('/', slash + 1))
+    {
+        std::string dir = file.substr(0, slash);
+#ifdef _WIN32
+        _mkdir(dir.c_str());
+#else
+        ::mkdir(dir.c_str(), 0755);
+#endif
+    }
+}
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+std::string deflate (const std::string& data)
+{
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw EXCEPTION("Failed initialising zlib");
+    std::string out(deflateBound(&z, (uLong) data.size()), '\0');
+    z.next_in = (Bytef*) data.data();
+    z.avail_in = (uInt) data.size();
+    z.next_out = (Bytef*) &out[0];
+    z.avail_out = (uInt) out.size();
+    int ret = ::deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    if (ret != Z_STREAM_END)
+        throw EXCEPTION("Failed deflating fixture data");
+    return out;
+}
+#endif
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+/// Compress in the zstd seekable format: independent frames followed by
+/// a seek table.
+std::string seekable_zstd (const std::string& data)
+{
+    std::string out, table;
+    std::uint32_t frames = 0;
+    for (std::size_t pos = 0; pos < data.size(); pos += ZSTD_FRAME, ++frames)
+    {
+        std::size_t n = std::min(ZSTD_FRAME, data.size() - pos);
+        std::string frame(ZSTD_compressBound(n), '\0');
+        std::size_t csize = ZSTD_compress(&frame[0], frame.size(), data.data() + pos, n, 3);
+        if (ZSTD_isError(csize))
+            throw EXCEPTION("Failed compressing fixture data");
+        out.append(frame.data(), csize);
+        put(table, csize, 4);
+        put(table, n, 4);
+    }
+    put(out, 0x184D2A5E, 4);
+    put(out, table.size() + 9, 4);
+    out += table;
+    put(out, frames, 4);
+    out += '\0';
+    put(out, 0x8F92EAB1, 4);
+    return out;
+}
+#endif
+
+} // namespace
+
+std::string bench::fixture_path (std::size_t i, std::size_t length)
+{
+    std::string path = "d" + std::to_string(i % 16) + "/file" + std::to_string(i);
+    if (path.size() < length) path.insert(path.find('/') + 1, std::string(length - path.size(), 'x'));
+    return path;
+}
+
+std::string bench::fixture_data (std::size_t i, std::size_t size)
+{
+    static const char* const words[] = {
+        "vertex", "normal", "texture", "index", "buffer", "shader", "material", "light",
+        "mesh", "scene", "frame", "camera", "node", "bone", "weight", "channel"
+    };
+    std::string data;
+    data.reserve(size + 16);
+    std::uint32_t state = (std::uint32_t) i * 2654435761u + 1;
+    while (data.size() < size)
+    {
+        state = state * 1664525u + 1013904223u;
+        data += words[state >> 28];
+        data += (state & 0x100) ? ' ' : (char) ('0' + (state >> 8) % 10);
+    }
+    data.resize(size);
+    return data;
+}
+
+void bench::write_zip (const std::string& file, const std::vector<std::string>& paths,
+                       const std::vector<std::string>& data, bool deflate_)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::ofstream out(file, std::ios::binary);
+    std::string central, record;
+    std::uint64_t offset = 0;
+    std::uint16_t method = deflate_ ? 8 : 0;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        std::string compressed = deflate_ ? deflate(data[i]) : std::string();
+        const std::string& stored = deflate_ ? compressed : data[i];
+        std::uint32_t crc = (std::uint32_t) crc32(0, (const Bytef*) data[i].data(), (uInt) data[i].size());
+        if (offset > 0xFFFFFFFE)
+            throw EXCEPTION("Fixture zip too large: " + file);
+
+        record.clear();
+        put(record, 0x04034b50, 4);
+        put(record, 20, 2);
+        put(record, 0, 2);
+        put(record, method, 2);
+        put(record, 0, 2);
+        put(record, 0x21, 2);
+        put(record, crc, 4);
+        put(record, stored.size(), 4);
+        put(record, data[i].size(), 4);
+        put(record, paths[i].size(), 2);
+        put(record, 0, 2);
+        record += paths[i];
+        out.write(record.data(), record.size());
+        out.write(stored.data(), stored.size());
+
+        put(central, 0x02014b50, 4);
+        put(central, 20, 2);
+        put(central, 20, 2);
+        put(central, 0, 2);
+        put(central, method, 2);
+        put(central, 0, 2);
+        put(central, 0x21, 2);
+        put(central, crc, 4);
+        put(central, stored.size(), 4);
+        put(central, data[i].size(), 4);
+        put(central, paths[i].size(), 2);
+        put(central, 0, 2);
+        put(central, 0, 2);
+        put(central, 0, 2);
+        put(central, 0, 2);
+        put(central, 0, 4);
+        put(central, offset, 4);
+        central += paths[i];
+        offset += record.size() + stored.size();
+    }
+    out.write(central.data(), central.size());
+
+    // Entry counts beyond 16 bits need the zip64 end records.
+    std::string end;
+    std::uint64_t count = paths.size();
+    if (count > 0xFFFE)
+    {
+        std::uint64_t zip64 = offset + central.size();
+        put(end, 0x06064b50, 4);
+        put(end, 44, 8);
+        put(end, 45, 2);
+        put(end, 45, 2);
+        put(end, 0, 4);
+        put(end, 0, 4);
+        put(end, count, 8);
+        put(end, count, 8);
+        put(end, central.size(), 8);
+        put(end, offset, 8);
+        put(end, 0x07064b50, 4);
+        put(end, 0, 4);
+        put(end, zip64, 8);
+        put(end, 1, 4);
+        count = 0xFFFF;
+    }
+    put(end, 0x06054b50, 4);
+    put(end, 0, 2);
+    put(end, 0, 2);
+    put(end, count, 2);
+    put(end, count, 2);
+    put(end, central.size(), 4);
+    put(end, offset, 4);
+    put(end, 0, 2);
+    out.write(end.data(), end.size());
+    if (!out)
+        throw EXCEPTION("Failed writing " + file);
+#else
+    (void) paths;
+    (void) data;
+    (void) deflate_;
+    throw EXCEPTION("Zip fixtures not supported in this build: " + file);
+#endif
+}
+
+void bench::write_tar (const std::string& file, const std::vector<std::string>& paths,
+                       const std::vector<std::string>& data)
+{
+    std::ofstream out(file, std::ios::binary);
+    auto header = [&](const std::string& name, char type, std::size_t size)
+    {
+        char block[512];
+        std::memset(block, 0, sizeof(block));
+        std::memcpy(block, name.data(), std::min<std::size_t>(name.size(), 100));
+        std::memcpy(block + 100, "0000644", 7);
+        std::memcpy(block + 108, "0000000", 7);
+        std::memcpy(block + 116, "0000000", 7);
+        std::snprintf(block + 124, 12, "%011llo", (unsigned long long) size);
+        std::memcpy(block + 136, "00000000000", 11);
+        std::memset(block + 148, ' ', 8);
+        block[156] = type;
+        std::memcpy(block + 257, "ustar", 6);
+        std::memcpy(block + 263, "00", 2);
+        unsigned sum = 0;
+        for (unsigned char c : block) sum += c;
+        std::snprintf(block + 148, 8, "%06o", sum);
+        out.write(block, sizeof(block));
+    };
+    auto pad = [&](std::size_t size)
+    {
+        static const char zeros[512] = {};
+        out.write(zeros, (512 - size % 512) % 512);
+    };
+
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        // Names that do not fit the header go in a GNU long name member.
+        if (paths[i].size() >= 100)
+        {
+            header("././@LongLink", 'L', paths[i].size() + 1);
+            out.write(paths[i].c_str(), paths[i].size() + 1);
+            pad(paths[i].size() + 1);
+        }
+        header(paths[i], '0', data[i].size());
+        out.write(data[i].data(), data[i].size());
+        pad(data[i].size());
+    }
+    static const char end[1024] = {};
+    out.write(end, sizeof(end));
+    if (!out)
+        throw EXCEPTION("Failed writing " + file);
+}
+
+std::vector<bench::Fixture> bench::make_fixtures (const std::string& dir, const FixtureOptions& options)
+{
+    std::vector<std::string> paths, data;
+    for (std::size_t i = 0; i < options.files; ++i)
+    {
+        paths.push_back(fixture_path(i, options.path_length));
+        data.push_back(fixture_data(i, options.file_size));
+    }
+
+    std::vector<Fixture> fixtures;
+    make_parents(dir + "/");
+    std::string tree = dir + "/tree";
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        make_parents(tree + "/" + paths[i]);
+        write_file(tree + "/" + paths[i], data[i]);
+    }
+    fixtures.push_back({ "regular", [=]() { return std::unique_ptr<FileSystemHandler>(new RegularFileSystem(tree.c_str())); }, paths });
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::string stored = dir + "/stored.zip", deflated = dir + "/deflated.zip";
+    write_zip(stored, paths, data, false);
+    write_zip(deflated, paths, data, true);
+    fixtures.push_back({ "zip-stored", [=]() { return std::unique_ptr<FileSystemHandler>(new ZipFileSystem(stored.c_str())); }, paths });
+    fixtures.push_back({ "zip-deflate", [=]() { return std::unique_ptr<FileSystemHandler>(new ZipFileSystem(deflated.c_str())); }, paths });
+#endif
+
+    std::string tar = dir + "/files.tar";
+    write_tar(tar, paths, data);
+    fixtures.push_back({ "tar", [=]() { return std::unique_ptr<FileSystemHandler>(new TarFileSystem(tar.c_str())); }, paths });
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    std::string zst = dir + "/zst";
+    std::vector<std::string> zst_paths;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        zst_paths.push_back(paths[i] + ".zst");
+        make_parents(zst + "/" + paths[i]);
+        write_file(zst + "/" + zst_paths[i], seekable_zstd(data[i]));
+    }
+    fixtures.push_back({ "seekable-zstd", [=]()
+    {
+        std::unique_ptr<FileSystemHandler> inner(new RegularFileSystem(zst.c_str()));
+        return std::unique_ptr<FileSystemHandler>(new SeekableZstdFileSystem(std::move(inner)));
+    }, zst_paths });
+#endif
+
+    // SquashFS images are left to mksquashfs, when it is installed.
+    std::string image = dir + "/files.sqfs";
+    std::string command = "mksquashfs \"" + tree + "\" \"" + image + "\" -noappend -quiet";
+#ifdef _WIN32
+    command += " >NUL 2>&1";
+#else
+    command += " >/dev/null 2>&1";
+#endif
+    if (std::system(command.c_str()) == 0)
+        fixtures.push_back({ "squashfs", [=]() { return std::unique_ptr<FileSystemHandler>(new SquashFsFileSystem(image.c_str())); }, paths });
+
+    return fixtures;
+}
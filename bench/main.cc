@@ -0,0 +1,77 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <cstring>
+#include <cstdlib>
+
+using namespace bench;
+
+Options::Options (int argc, char** argv)
+{
+    for (int i = 0; i + 1 < argc; ++i)
+        if (std::strncmp(argv[i], "--", 2) == 0)
+        {
+            values[argv[i] + 2] = argv[i + 1];
+            ++i;
+        }
+}
+
+std::size_t Options::get (const char* name, std::size_t fallback) const
+{
+    auto it = values.find(name);
+    return it == values.end() ? fallback : (std::size_t) std::strtoull(it->second.c_str(), nullptr, 0);
+}
+
+std::string Options::get (const char* name, const char* fallback) const
+{
+    auto it = values.find(name);
+    return it == values.end() ? std::string(fallback) : it->second;
+}
+
+double bench::percentile (std::vector<double>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    std::size_t k = std::min(samples.size() - 1, (std::size_t) (p / 100 * samples.size()));
+    return samples[k];
+}
+
+double bench::micros (Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+int main (int argc, char** argv)
+{
+    const char* scenario = argc > 1 ? argv[1] : "";
+    Options options(argc - 1, argv + 1);
+    try
+    {
+        if (std::strcmp(scenario, "concurrency") == 0) return concurrency(options);
+        if (std::strcmp(scenario, "scale") == 0) return scale(options);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::cerr << "usage: bench <scenario> [--option value]...\n"
+                 "\n"
+                 "concurrency  open and read files from 1 to N threads through one FileSystem\n"
+                 "  --dir PATH        directory for the fixtures (default bench_fixtures)\n"
+                 "  --threads N       highest thread count (default: hardware threads)\n"
+                 "  --files N         files per fixture (default 256)\n"
+                 "  --size BYTES      bytes per file (default 65536)\n"
+                 "  --ms N            milliseconds per measurement (default 500)\n"
+                 "\n"
+                 "scale        open hit and miss latency and index memory over stacked archives\n"
+                 "  --dir PATH        directory for the fixtures (default bench_fixtures)\n"
+                 "  --handlers LIST   archives mounted (default 1,10,100)\n"
+                 "  --entries LIST    entries per archive (default 100,10000,1000000)\n"
+                 "  --paths LIST      path lengths (default 16,64,200)\n"
+                 "  --max-total N     most entries mounted at once (default 2000000)\n"
+                 "  --lookups N       lookups per measurement (default 20000)\n";
+    return 2;
+}
@@ -0,0 +1,137 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace bench;
+using namespace kx;
+
+namespace
+{
+
+/// Return the heap memory in use, which holds the handlers' indexes but
+/// not the mapped archives. Zero where unknown.
+std::size_t heap_memory ()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+/// Return the latency of each lookup, in nanoseconds and sorted.
+std::vector<double> lookups (const FileSystem& fs, const std::vector<std::string>& paths, bool hit)
+{
+    std::vector<double> samples;
+    samples.reserve(paths.size());
+    for (const std::string& path : paths)
+    {
+        Clock::time_point start = Clock::now();
+        try
+        {
+            fs.open(path.c_str());
+        }
+        catch (const std::exception&)
+        {
+            if (hit) throw;
+        }
+        samples.push_back(micros(start, Clock::now()) * 1000);
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples;
+}
+
+std::vector<std::size_t> list (const Options& options, const char* name, const char* fallback)
+{
+    std::vector<std::size_t> values;
+    std::istringstream in(options.get(name, fallback));
+    for (std::string value; std::getline(in, value, ','); )
+        values.push_back((std::size_t) std::strtoull(value.c_str(), nullptr, 0));
+    return values;
+}
+
+} // namespace
+
+int bench::scale (const Options& options)
+{
+    std::vector<std::size_t> handler_counts = list(options, "handlers", "1,10,100");
+    std::vector<std::size_t> entry_counts = list(options, "entries", "100,10000,1000000");
+    std::vector<std::size_t> path_lengths = list(options, "paths", "16,64,200");
+    std::size_t max_total = options.get("max-total", (std::size_t) 2000000);
+    std::size_t count = std::max<std::size_t>(1, options.get("lookups", (std::size_t) 20000));
+    std::string dir = options.get("dir", "bench_fixtures");
+    std::size_t max_handlers = *std::max_element(handler_counts.begin(), handler_counts.end());
+
+    std::printf("%-9s %8s %5s %8s %9s %8s %9s %9s %9s %9s\n", "handler", "entries", "path", "handlers",
+                "mount ms", "B/entry", "hit p50", "hit p99", "miss p50", "miss p99");
+
+    std::mt19937 rng(1);
+    for (std::size_t entries : entry_counts)
+        for (std::size_t length : path_lengths)
+        {
+            // Archive k holds its entries under "a<k>/", so that a hit in
+            // archive k first misses the k archives mounted before it.
+            std::size_t archives = std::min(max_handlers, std::max<std::size_t>(1, max_total / entries));
+            std::vector<std::string> data(entries, fixture_data(0, 16));
+            for (std::size_t k = 0; k < archives; ++k)
+            {
+                std::vector<std::string> paths(entries);
+                for (std::size_t i = 0; i < entries; ++i)
+                    paths[i] = "a" + std::to_string(k) + "/" + fixture_path(i, length);
+                std::string base = dir + "/scale-" + std::to_string(k);
+                write_zip(base + ".zip", paths, data, false);
+                write_tar(base + ".tar", paths, data);
+                TarFileSystem tar((base + ".tar").c_str());
+                tar.save_index((base + ".idx").c_str());
+            }
+
+            for (const char* type : { "zip", "tar", "tar-index" })
+                for (std::size_t handlers : handler_counts)
+                {
+                    if (handlers > archives) continue;
+
+                    std::vector<std::string> hits(count), misses(count);
+                    for (std::size_t n = 0; n < count; ++n)
+                    {
+                        std::string k = std::to_string(rng() % handlers);
+                        hits[n] = "a" + k + "/" + fixture_path(rng() % entries, length);
+                        misses[n] = "a" + k + "/" + fixture_path(entries + rng() % entries, length);
+                    }
+
+                    std::size_t memory = heap_memory();
+                    Clock::time_point start = Clock::now();
+                    FileSystem fs;
+                    for (std::size_t k = 0; k < handlers; ++k)
+                    {
+                        std::string base = dir + "/scale-" + std::to_string(k);
+                        std::string type_ = type;
+                        FileSystemHandler* handler =
+                            type_ == "zip" ? (FileSystemHandler*) new ZipFileSystem((base + ".zip").c_str()) :
+                            type_ == "tar" ? (FileSystemHandler*) new TarFileSystem((base + ".tar").c_str()) :
+                            (FileSystemHandler*) new TarFileSystem((base + ".tar").c_str(), (base + ".idx").c_str());
+                        fs.addHandler(std::unique_ptr<FileSystemHandler>(handler));
+                    }
+                    double mount = micros(start, Clock::now()) / 1000;
+                    std::size_t index = heap_memory() - std::min(memory, heap_memory());
+
+                    std::vector<double> hit = lookups(fs, hits, true);
+                    std::vector<double> miss = lookups(fs, misses, false);
+                    std::printf("%-9s %8zu %5zu %8zu %9.1f %8.1f %9.0f %9.0f %9.0f %9.0f\n", type, entries,
+                                fixture_path(0, length).size(), handlers, mount,
+                                (double) index / (entries * handlers),
+                                percentile(hit, 50), percentile(hit, 99), percentile(miss, 50), percentile(miss, 99));
+                }
+        }
+    std::printf("\nlatencies in ns; misses include the exception FileSystem::open throws\n");
+    return 0;
+}
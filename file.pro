@@ -14,6 +14,19 @@ else {
 QMAKE_CXXFLAGS_DEBUG += -D_DEBUG
 unix: {
     QMAKE_CXXFLAGS += --std=c++11
+    LIBS += -lpthread
+}
+!contains(DEFINES, FILESYSTEM_DISABLE_ZIP) {
+    LIBS += -lz
+}
+!contains(DEFINES, FILESYSTEM_DISABLE_ZSTD) {
+    LIBS += -lzstd
+}
+!contains(DEFINES, FILESYSTEM_DISABLE_XZ) {
+    LIBS += -llzma
+}
+!contains(DEFINES, FILESYSTEM_DISABLE_LZ4) {
+    LIBS += -llz4
 }
 win32: {
     QMAKE_CXXFLAGS += -DNOMINMAX
@@ -24,6 +37,31 @@ win32: {
 INCLUDEPATH = include $$(SRC)/cpp/include
 DEPENDPATH = include $$(SRC)/cpp/include
 
-HEADERS += include/file.h
+HEADERS += include/file.h \
+           src/cache.h \
+           src/content.h \
+           src/fold.h \
+           src/io.h \
+           src/merkle.h \
+           src/parallel.h \
+           src/pathindex.h \
+           src/perfecthash.h \
+           src/pool.h \
+           src/queue.h
 
-SOURCES += src/file.cc
+SOURCES += src/content.cc \
+           src/file.cc \
+           src/fold.cc \
+           src/io.cc \
+           src/memory.cc \
+           src/merkle.cc \
+           src/parallel.cc \
+           src/pathindex.cc \
+           src/perfecthash.cc \
+           src/pipeline.cc \
+           src/pool.cc \
+           src/pressure.cc \
+           src/squashfs.cc \
+           src/tar.cc \
+           src/zip.cc \
+           src/zstd.cc
@@ -5,7 +5,12 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <array>
 #include <cstdint>
+#include <exception>
 
 namespace kx
 {
@@ -13,10 +18,106 @@ namespace kx
 class File;
 class FileSystemHandler;
 class FileHandler;
+class SlowOpLog;
+class MemoryPressureMonitor;
+class RandomAccessFile;
+class MemoryResource;
 
 using Path = const char*;
 using FilePath = const char*;
 
+/// Releases a Buffer to the resource it was allocated from, or with
+/// delete[] if it has none.
+struct BufferDeleter
+{
+    MemoryResource* resource = nullptr;
+    std::size_t size = 0;
+
+    void operator() (std::uint8_t* data) const;
+};
+
+/// An owned array of bytes.
+using Buffer = std::unique_ptr<std::uint8_t[], BufferDeleter>;
+
+/// Allocate a buffer from 'resource', or with new[] if it is null.
+Buffer allocate_buffer (std::size_t size, MemoryResource* resource = nullptr);
+
+/// Receives a chunk of a file read progressively: 'size' bytes at 'data',
+/// found at 'offset' in the file. The data is only valid during the call.
+/// Return false to stop reading.
+using ChunkCallback = std::function<bool (const std::uint8_t* data,
+                                          std::size_t size,
+                                          std::uint64_t offset)>;
+
+/// A SHA-256 digest.
+using Digest = std::array<std::uint8_t, 32>;
+
+/// Write a Merkle tree of a file, such as an archive, to 'tree_file'.
+/// The file is hashed in blocks of 'block_size' bytes, in parallel.
+/// Return the root of the tree, to be passed to enable_verification() by
+/// readers that do not trust the tree file.
+/// Throw an exception if the file cannot be read or the tree written.
+Digest write_merkle_tree (const Path& file, const Path& tree_file,
+                          std::size_t block_size = 64 << 10);
+
+/// A file resolved by FileSystem::resolve.
+/// Records the handler serving the file and the location of its entry so
+/// that the file can be reopened without a path lookup.
+struct FileId
+{
+    std::uint32_t handler = UINT32_MAX; // handler's index in the file system
+    std::uint32_t generation = 0; // generation the id was resolved in
+    std::uint64_t entry = 0; // handler-specific entry location
+
+    bool valid () const { return handler != UINT32_MAX; }
+};
+
+/// Identity of a file's contents as recorded by an archive index, such as
+/// the SHA-256 and size of a zip entry written by ZipWriter. Files are
+/// hashed when loaded into the content cache and must match their key.
+struct ContentKey
+{
+    std::uint64_t size = 0;
+    Digest sha256 = Digest();
+
+    bool operator== (const ContentKey& o) const
+    {
+        return size == o.size && sha256 == o.sha256;
+    }
+};
+
+/// A file loaded by FileSystem::load_pipeline().
+struct LoadResult
+{
+    std::size_t index = 0; // position of the file in the batch
+    FilePath path = nullptr;
+    Buffer data;
+    std::size_t size = 0;
+    std::exception_ptr error; // set on failure; 'data' is then unspecified
+};
+
+/// Options of FileSystem::load_pipeline().
+struct PipelineOptions
+{
+    // Threads of each stage. Zero decode threads means one per core.
+    unsigned read_threads = 2;
+    unsigned decode_threads = 0;
+    unsigned verify_threads = 1;
+    unsigned transform_threads = 1;
+
+    /// Files each stage may hold ready for the next. Bounds the files in
+    /// memory at once to about the sum of the queues and threads.
+    std::size_t queue_depth = 4;
+
+    /// Expected SHA-256 of each file, in batch order; empty to skip
+    /// verification.
+    std::vector<Digest> digests;
+
+    /// Applied to each verified file on a transform thread; may replace
+    /// its data. Empty to skip. Exceptions are reported in the result.
+    std::function<void (LoadResult&)> transform;
+};
+
 class FileSystem : NonCopyable
 {
 public:
@@ -40,10 +141,94 @@ public:
     /// Throw an exception if the file cannot be found.
     File open (const FilePath&) const;
 
+    /// Resolve a file to an id that can be reopened without a path lookup.
+    /// Throw an exception if the file cannot be found or its handler does
+    /// not support resolving.
+    FileId resolve (const FilePath&) const;
+
+    /// Open a resolved file.
+    /// Throw an exception if the id is invalid or stale, which happens
+    /// when handlers are added after the id was resolved.
+    File open (const FileId&) const;
+
+    /// Open every file of the named group.
+    /// Groups are declared by archive manifests; the first handler that
+    /// knows the group opens it.
+    /// Throw an exception if no handler knows the group.
+    std::vector<File> load_group (const char* name) const;
+
+    /// Open several files, returned in the order given.
+    /// Handlers may read the files together, such as in a single sweep
+    /// over an archive.
+    /// Throw an exception if a file cannot be found.
+    std::vector<File> open_batch (const std::vector<FilePath>&) const;
+
+    /// Read a file in chunks as it is decompressed, without waiting for the
+    /// whole file as open() does for compressed archive entries. See
+    /// File::read_progressive().
+    /// Return true if the whole file was delivered, false if the callback
+    /// stopped early.
+    /// Throw an exception if the file cannot be found or is corrupt; a
+    /// checksum mismatch is only found, and thrown, after the last chunk.
+    bool read_progressive (const FilePath&, std::size_t chunk_size,
+                           const ChunkCallback&) const;
+
+    /// Load a batch of files through concurrent stages: raw reads,
+    /// decompression, verification against PipelineOptions::digests and
+    /// the optional transform. Stages are joined by bounded queues, so a
+    /// slow stage or consumer holds back the ones before it and memory
+    /// stays capped.
+    /// 'deliver' is called on the calling thread for each file as it
+    /// completes, in completion order, with any error in the result.
+    /// If 'deliver' throws, the pipeline is stopped and the exception
+    /// rethrown.
+    void load_pipeline (const std::vector<FilePath>&, const PipelineOptions&,
+                        const std::function<void (LoadResult&&)>& deliver) const;
+
     void addHandler (std::unique_ptr<FileSystemHandler>);
 
+    /// Log opens, reads and decompressions that exceed the log's thresholds.
+    /// Pass null to disable logging.
+    /// Must not be called concurrently with open().
+    void setSlowOpLog (std::shared_ptr<SlowOpLog>);
+
+    /// Cache decompressed files by content rather than by path, so that
+    /// identical files in different archives or under different paths are
+    /// decompressed once and share memory. Only files whose handler knows
+    /// a ContentKey for them are cached. 'budget' is the byte budget of
+    /// the cache; pass 0 to disable it.
+    /// At most 'hot_budget' bytes hold decompressed files. Files evicted
+    /// from them are kept LZ4-compressed in the rest of the budget and
+    /// decompressed on access, until read often enough to move back; this
+    /// fits more files in the budget at the cost of CPU on cold reads.
+    /// Without LZ4 support the whole budget is hot.
+    /// Must not be called concurrently with open().
+    void setContentCache (std::size_t budget, std::size_t hot_budget = SIZE_MAX);
+
+    /// Shrink the content cache and handler caches under memory pressure.
+    /// Pass null to keep budgets fixed.
+    /// Must not be called concurrently with open().
+    void setMemoryPressureMonitor (std::shared_ptr<MemoryPressureMonitor>);
+
+    /// Let handlers that support it find files whatever their case and
+    /// separators, by also looking paths up in folded form. See
+    /// FileSystemHandler::setFoldedLookup().
+    /// Must not be called concurrently with open().
+    void setFoldedLookup (bool);
+
+    /// Allocate the data of opened files, such as decompressed entries and
+    /// read buffers, from 'resource', which must outlive every file opened
+    /// while it is set. Pass null to use global new.
+    /// The content cache outlives any one resource and keeps its own copies.
+    /// Must not be called concurrently with open().
+    void setMemoryResource (MemoryResource*);
+
 private:
 
+    /// Read a file's raw data through the first handler that has it and
+    /// return the function decoding it, or null if no handler has it.
+    std::function<FileHandler* ()> fetch (const FilePath&) const;
+
     struct impl;
     std::unique_ptr<impl> my;
 };
@@ -58,13 +243,34 @@ public:
 
     ~File ();
 
+    /// Return an independent cursor over the same file, starting at the
+    /// current position.
+    /// The clone shares the file's backing data, so no I/O or
+    /// decompression is repeated, and may be used from another thread.
+    /// Throw an exception if the file does not support cloning.
+    File clone () const;
+
     /// Read the entire file and return its contents as a string.
     std::string read_all ();
 
+    /// Read the entire file into an owned buffer and set 'size' to its
+    /// size. When the file owns its data alone, such as an inflated zip
+    /// entry, the data is moved out without copying and the file is left
+    /// empty; otherwise the file is read from the start into a new buffer.
+    Buffer read_all_owned (std::size_t& size);
+
     /// Attempt to read 'size' bytes into the buffer.
     /// Return the number of bytes read.
     std::size_t read (void* buffer, std::size_t size);
 
+    /// Read the rest of the file in chunks of up to 'chunk_size' bytes,
+    /// passing each chunk to 'callback' as soon as it is read or
+    /// decompressed, so that parsing can start before the file is loaded.
+    /// Return true if the end of the file was reached, false if the
+    /// callback stopped early; the position is then after the last chunk
+    /// delivered.
+    bool read_progressive (std::size_t chunk_size, const ChunkCallback&);
+
     /// Attempt to read 'size' bytes into the buffer or until a newline is found.
     /// Return the number of bytes read.
     std::size_t read_line (char* buffer, std::size_t count);
@@ -97,6 +303,168 @@ private:
     std::unique_ptr<FileHandler> handler;
 };
 
+//
+// Diagnostics
+//
+
+/// An operation that exceeded its latency threshold.
+struct SlowOp
+{
+    enum Kind { Open, Read, Decompress };
+
+    Kind kind;
+    char path[256]; // truncated to fit
+    const char* handler; // name of the handler that served the operation
+    std::size_t size; // bytes read or decompressed, file size for Open
+    std::chrono::nanoseconds duration;
+    std::thread::id thread;
+};
+
+/// Latency thresholds of the slow-operation log.
+/// Use std::chrono::nanoseconds::max() to stop logging an operation kind.
+struct SlowOpThresholds
+{
+    std::chrono::nanoseconds open = std::chrono::milliseconds(10);
+    std::chrono::nanoseconds read = std::chrono::milliseconds(10);
+    std::chrono::nanoseconds decompress = std::chrono::milliseconds(10);
+};
+
+/// A bounded, lock-free log of slow operations.
+/// Any number of threads may record; one thread at a time may drain.
+class SlowOpLog : NonCopyable
+{
+public:
+
+    using Callback = std::function<void (const SlowOp&)>;
+
+    /// Construct a log holding up to 'capacity' undrained records.
+    /// The capacity is rounded up to a power of two.
+    explicit SlowOpLog (const SlowOpThresholds& = SlowOpThresholds(),
+                        std::size_t capacity = 1024);
+
+    ~SlowOpLog ();
+
+    /// Record the operation if it exceeds the threshold of its kind.
+    /// The record is dropped if the log is full.
+    void record (SlowOp::Kind, const char* path, const char* handler,
+                 std::size_t size, std::chrono::nanoseconds duration);
+
+    /// Pass the pending records to the callback, oldest first.
+    /// Return the number of records drained.
+    std::size_t drain (const Callback&);
+
+    /// Return the number of records dropped because the log was full.
+    std::size_t dropped () const;
+
+    const SlowOpThresholds& thresholds () const;
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+/// Shrinks caches while the system is under memory pressure, and grows
+/// them back when the pressure clears.
+///
+/// On Linux, a background thread waits on a pressure stall information
+/// trigger on /proc/pressure/memory, or on the cgroup's memory.pressure,
+/// falling back to the cgroup's memory.events. Each pressure event halves
+/// the scale applied to cache budgets, down to 'min_scale'; each quiet
+/// window doubles it, up to 1. If none of these files can be watched, only
+/// pressure() shrinks the scale. Elsewhere, the scale only changes through
+/// pressure() and does not grow back.
+class MemoryPressureMonitor : NonCopyable
+{
+public:
+
+    using Callback = std::function<void (double scale)>;
+
+    /// Watch for 'stall' of memory stall time within each 'window'.
+    /// Unprivileged processes may need a window that is a multiple of 2s.
+    explicit MemoryPressureMonitor (
+        std::chrono::milliseconds stall = std::chrono::milliseconds(150),
+        std::chrono::milliseconds window = std::chrono::seconds(2),
+        double min_scale = 1.0 / 16);
+
+    ~MemoryPressureMonitor ();
+
+    /// Return true if pressure is being watched.
+    bool active () const;
+
+    /// Return the scale currently applied to cache budgets.
+    double scale () const;
+
+    /// Call 'callback' with the current scale, then from the monitor
+    /// thread each time the scale changes. Callbacks run one at a time
+    /// and may call the monitor, including to subscribe or unsubscribe.
+    /// Return an id for unsubscribe().
+    std::uint64_t subscribe (Callback);
+
+    /// Stop calling a callback. Unless called from a callback, no
+    /// callback is running once this returns.
+    void unsubscribe (std::uint64_t id);
+
+    /// Apply a pressure event, as if signaled by the system.
+    void pressure ();
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+//
+// Memory
+//
+
+/// A source of memory for file data, in the manner of
+/// std::pmr::memory_resource.
+/// Implementations must be safe to call from several threads.
+class MemoryResource
+{
+public:
+
+    virtual ~MemoryResource() {}
+
+    virtual void* allocate (std::size_t size, std::size_t alignment) = 0;
+
+    virtual void deallocate (void* data, std::size_t size,
+                             std::size_t alignment) = 0;
+};
+
+/// A monotonic arena. Allocations are carved from large blocks and are all
+/// freed at once by release() or destruction; deallocate() does nothing.
+/// Suited to data that lives as long as a level or a load, released in one
+/// shot without fragmenting the heap.
+class ArenaResource final : public MemoryResource, NonCopyable
+{
+public:
+
+    /// Construct an arena taking blocks of at least 'block_size' bytes
+    /// from 'upstream', or from global new if it is null.
+    explicit ArenaResource (std::size_t block_size = 1 << 20,
+                            MemoryResource* upstream = nullptr);
+
+    ~ArenaResource ();
+
+    void* allocate (std::size_t size, std::size_t alignment) override;
+
+    void deallocate (void*, std::size_t, std::size_t) override {}
+
+    /// Free every allocation. Nothing allocated from the arena may be
+    /// used afterwards.
+    void release ();
+
+    /// Return the number of bytes allocated since the last release.
+    std::size_t allocated () const;
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
 //
 // Interfaces
 //
@@ -111,6 +479,95 @@ public:
     /// Open the given file.
     /// Return null on failure.
     virtual FileHandler* open (const FilePath&) = 0;
+
+    /// Resolve the given file to an entry accepted by open_resolved().
+    /// Return false if the file is not found or resolving is not supported.
+    virtual bool resolve (const FilePath&, std::uint64_t& /*entry*/)
+    {
+        return false;
+    }
+
+    /// Open an entry returned by resolve().
+    /// Return null on failure.
+    virtual FileHandler* open_resolved (std::uint64_t /*entry*/)
+    {
+        return nullptr;
+    }
+
+    /// Return the content key of an entry returned by resolve(), if the
+    /// handler's index records one.
+    virtual bool content_key (std::uint64_t /*entry*/, ContentKey&)
+    {
+        return false;
+    }
+
+    /// Resolve a file and return its content key, if the handler's index
+    /// records one. Return false otherwise, including for handlers that
+    /// have the file but no key for it.
+    virtual bool content_key (const FilePath&, std::uint64_t& /*entry*/,
+                              ContentKey&)
+    {
+        return false;
+    }
+
+    /// Open every file of the named group, appending them to 'files'.
+    /// Return false if the handler does not know the group.
+    virtual bool open_group (
+        const char* /*name*/,
+        std::vector<std::unique_ptr<FileHandler>>& /*files*/)
+    {
+        return false;
+    }
+
+    /// Open the files of 'paths' into the matching slots of 'files', which
+    /// has the same size. Slots already set are skipped, and slots of
+    /// files not found are left null.
+    /// The default opens the files one by one.
+    virtual void open_batch (const std::vector<FilePath>& paths,
+                             std::vector<std::unique_ptr<FileHandler>>& files);
+
+    /// Read a file's raw data, such as a compressed archive entry, and
+    /// return a function that decodes it into an open file. Lets callers
+    /// overlap I/O with decompression on other threads. The function may
+    /// be called once, from any thread, while the handler lives.
+    /// Return null if the file is not found.
+    /// The default opens and reads the whole file during the fetch.
+    virtual std::function<FileHandler* ()> fetch (const FilePath&);
+
+    /// Read a file progressively; see FileSystem::read_progressive().
+    /// Set 'finished' to whether the whole file was delivered.
+    /// Return false if the file is not found.
+    /// The default opens the file and reads it through the file handler.
+    virtual bool read_progressive (const FilePath&, std::size_t chunk_size,
+                                   const ChunkCallback&, bool& finished);
+
+    /// Return the name of the handler, used to attribute slow operations.
+    virtual const char* name () const { return "FileSystemHandler"; }
+
+    /// Set the log that slow decompressions are reported to. May be null.
+    virtual void setSlowOpLog (SlowOpLog* log) { slow_ops = log; }
+
+    /// Set the monitor that handler caches follow. May be null.
+    virtual void setMemoryPressureMonitor (
+        std::shared_ptr<MemoryPressureMonitor>) {}
+
+    /// Look up paths that miss the exact index in folded form as well:
+    /// ASCII letters lowercased, '\' read as '/', and empty and "."
+    /// segments dropped. An exact match always wins; among entries folding
+    /// to the same path, the first in the archive wins.
+    virtual void setFoldedLookup (bool) {}
+
+    /// Set the resource that the data of opened files is allocated from.
+    /// May be null.
+    virtual void setMemoryResource (MemoryResource* resource)
+    {
+        memory = resource;
+    }
+
+protected:
+
+    SlowOpLog* slow_ops = nullptr;
+    MemoryResource* memory = nullptr;
 };
 
 /// A common interface for file implementations.
@@ -123,6 +580,18 @@ public:
     virtual void seek (std::ios::off_type offset, std::ios_base::seekdir) = 0;
     virtual std::ios::pos_type tell () const = 0;
     virtual std::size_t size () const = 0;
+
+    /// Return an independent cursor over the same data.
+    /// Return null if cloning is not supported.
+    virtual FileHandler* clone () const { return nullptr; }
+
+    /// Move the file's data out if the handler owns it alone, leaving the
+    /// file empty. Return null otherwise.
+    virtual Buffer take_buffer () { return nullptr; }
+
+    /// Pass the rest of the file to 'callback' in chunks; see
+    /// File::read_progressive(). The default reads chunks into a buffer.
+    virtual bool read_progressive (std::size_t chunk_size, const ChunkCallback&);
 };
 
 //
@@ -136,25 +605,352 @@ public:
 
     RegularFileSystem (const Path& root);
 
+    ~RegularFileSystem ();
+
     FileHandler* open (const FilePath&);
 
+    /// Resolve a file to its full path, interned for the lifetime of the
+    /// file system.
+    bool resolve (const FilePath&, std::uint64_t& entry) override;
+
+    FileHandler* open_resolved (std::uint64_t entry) override;
+
+    const char* name () const override { return "RegularFileSystem"; }
+
 private:
 
     const Path root;
+
+    struct impl;
+    std::unique_ptr<impl> my;
 };
 
 /// A file system that can load files from zip files.
+///
+/// The central directory is read once on construction. Paths are looked
+/// up in a hash map, or, in archives of 2^18 entries or more, only in a
+/// compact sorted index that takes a fraction of the memory.
+/// A zip file may declare groups of entries in a manifest entry named
+/// ".groups": a "[name]" line starts a group, followed by one entry path
+/// per line. Lines starting with '#' are ignored.
+/// Entries may be stored, deflated or compressed with zstd (method 93).
+/// zstd entries may use dictionaries stored in the archive as entries
+/// under dictionary_prefix, as written by ZipWriter; they are loaded with
+/// the first entry needing one and shared by all threads.
 class ZipFileSystem final : public FileSystemHandler
 {
 public:
 
+    /// Name of the entry declaring groups.
+    static const char* const manifest_name;
+
+    /// Path prefix of the entries holding zstd dictionaries.
+    static const char* const dictionary_prefix;
+
+    /// Construct a ZipFileSystem.
+    /// Throw an exception if the zip file cannot be read.
     ZipFileSystem (const Path& zip_file);
 
+    ~ZipFileSystem ();
+
+    /// Verify the zip file against a tree written by write_merkle_tree().
+    /// Blocks are verified each time they are read and unverified data is
+    /// never served; a block failing verification throws an exception
+    /// from the read. If 'expected_root' is given the tree must match it.
+    /// Call before opening files.
+    /// Throw an exception if the tree does not match the zip file.
+    void enable_verification (const Path& tree_file,
+                              const Digest* expected_root = nullptr);
+
+    /// Verify every block not verified yet, in parallel.
+    /// Throw an exception if verification is not enabled or a block fails.
+    void verify_all ();
+
     FileHandler* open (const FilePath&);
 
+    /// Resolve a file to the index of its central directory entry.
+    bool resolve (const FilePath&, std::uint64_t& entry) override;
+
+    FileHandler* open_resolved (std::uint64_t entry) override;
+
+    /// Return the SHA-256 and uncompressed size of the entry, if the zip
+    /// file was written by ZipWriter.
+    bool content_key (std::uint64_t entry, ContentKey&) override;
+
+    bool content_key (const FilePath&, std::uint64_t& entry,
+                      ContentKey&) override;
+
+    /// Build a folded index next to the exact one.
+    void setFoldedLookup (bool) override;
+
+    /// Return the folded paths shared by several entries.
+    std::vector<std::string> folded_collisions () const;
+
+    /// Open the group as a batch of its members.
+    bool open_group (const char* name,
+                     std::vector<std::unique_ptr<FileHandler>>&) override;
+
+    /// Read the entries in order of their offsets, in one forward sweep.
+    /// Entries separated by small gaps are fetched with a single read and
+    /// decompressed in parallel.
+    void open_batch (const std::vector<FilePath>&,
+                     std::vector<std::unique_ptr<FileHandler>>&) override;
+
+    /// Inflate the entry a chunk at a time, passing each chunk on as soon
+    /// as it is inflated. The CRC is checked after the last chunk.
+    bool read_progressive (const FilePath&, std::size_t chunk_size,
+                           const ChunkCallback&, bool& finished) override;
+
+    /// Read the entry's compressed data; the returned function inflates it.
+    std::function<FileHandler* ()> fetch (const FilePath&) override;
+
+    const char* name () const override { return "ZipFileSystem"; }
+
 private:
 
-    const Path zip_file;
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+/// Options of a ZipWriter.
+struct ZipWriterOptions
+{
+    /// Files of up to this many bytes are compressed with zstd and a
+    /// dictionary trained on the files of the same extension; other files
+    /// are deflated.
+    std::size_t small_file = 16 << 10;
+
+    /// Size of each dictionary.
+    std::size_t dictionary_size = 110 << 10;
+
+    /// Bytes of small files sampled to train the dictionary of their
+    /// extension. Files are held in memory until their dictionary is
+    /// trained.
+    std::size_t training_bytes = 100 * (110 << 10);
+
+    /// zstd compression level of small files.
+    int zstd_level = 3;
+
+    /// zlib compression level of other files.
+    int deflate_level = 6;
+};
+
+/// Writes zip files for ZipFileSystem.
+///
+/// Archives of many small files, such as JSON or XML documents, barely
+/// compress one file at a time. ZipWriter trains a zstd dictionary for
+/// each extension on the first small files added, stores it in the
+/// archive and compresses the small files of the extension with it.
+/// Files that do not compress are stored. Small files are written once
+/// their dictionary is trained, possibly after files added later.
+/// Without zstd support all files are deflated. The SHA-256 of each file
+/// is recorded for FileSystem::setContentCache().
+class ZipWriter : NonCopyable
+{
+public:
+
+    /// Create the zip file.
+    /// Throw an exception if it cannot be created.
+    ZipWriter (const Path& zip_file,
+               const ZipWriterOptions& = ZipWriterOptions());
+
+    /// Close the zip file; it is incomplete unless finish() was called.
+    ~ZipWriter ();
+
+    /// Add a file.
+    /// Throw an exception if it cannot be written or finish() was called.
+    void add (const FilePath&, const void* data, std::size_t size);
+
+    /// Write the files held for training and the central directory.
+    /// Throw an exception if they cannot be written.
+    void finish ();
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+/// A file system that can load files from uncompressed tar files.
+///
+/// The tar file is mapped into memory and its members are served without
+/// copying, unless verification is enabled. Member headers are scanned
+/// once on construction, or read from an index file saved by
+/// save_index(). GNU long names, PAX path and size records and base-256
+/// sizes are supported.
+class TarFileSystem final : public FileSystemHandler
+{
+public:
+
+    /// Construct a TarFileSystem.
+    /// If 'index_file' is given and matches the tar file, the headers are
+    /// not scanned. Throw an exception if the tar file cannot be read.
+    TarFileSystem (const Path& tar_file, const Path& index_file = nullptr);
+
+    ~TarFileSystem ();
+
+    /// Save the member index for later construction. The index holds a
+    /// minimal perfect hash of the member paths, which looks paths up
+    /// from the mapped index file with one hash and one comparison.
+    /// Throw an exception if the index cannot be written.
+    void save_index (const Path& index_file) const;
+
+    /// Verify the tar file against a tree written by write_merkle_tree().
+    /// The member headers are scanned again through the tree and must give
+    /// the members scanned or loaded from the index on construction.
+    /// Members are copied out of the mapping and verified when opened, so
+    /// unverified data is never served; a block failing verification
+    /// throws an exception from the open. If 'expected_root' is given the
+    /// tree must match it. Call before opening files.
+    /// Throw an exception if the tree does not match the tar file, or the
+    /// headers do not match the members.
+    void enable_verification (const Path& tree_file,
+                              const Digest* expected_root = nullptr);
+
+    /// Verify every block not verified yet, in parallel.
+    /// Throw an exception if verification is not enabled or a block fails.
+    void verify_all ();
+
+    FileHandler* open (const FilePath&);
+
+    /// Resolve a file to the index of its member.
+    bool resolve (const FilePath&, std::uint64_t& entry) override;
+
+    FileHandler* open_resolved (std::uint64_t entry) override;
+
+    /// Build a folded index next to the exact one.
+    void setFoldedLookup (bool) override;
+
+    /// Return the folded paths shared by several entries.
+    std::vector<std::string> folded_collisions () const;
+
+    const char* name () const override { return "TarFileSystem"; }
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+/// A file system that can load files from SquashFS images, without
+/// mounting them.
+///
+/// Decompressed data, fragment and metadata blocks are kept in a cache
+/// shared by all files of the image. On sequential reads the following
+/// blocks are fetched with the same read and decompressed in parallel.
+/// gzip, xz, lz4 and zstd images are supported. Symbolic links are not
+/// followed.
+class SquashFsFileSystem final : public FileSystemHandler
+{
+public:
+
+    /// Construct a SquashFsFileSystem.
+    /// 'cache_size' is the byte budget of the block cache and 'readahead'
+    /// the number of blocks decompressed ahead of sequential reads.
+    /// Throw an exception if the image cannot be read.
+    SquashFsFileSystem (const Path& image, std::size_t cache_size = 32 << 20,
+                        unsigned readahead = 4);
+
+    ~SquashFsFileSystem ();
+
+    /// Verify the image against a tree written by write_merkle_tree().
+    /// The superblock is read again through the tree and must match the
+    /// one read on construction, and cached blocks are dropped.
+    /// Blocks are verified each time they are read and unverified data is
+    /// never served; a block failing verification throws an exception
+    /// from the read. If 'expected_root' is given the tree must match it.
+    /// Call before opening files.
+    /// Throw an exception if the tree does not match the image, or the
+    /// superblock does not match the one read on construction.
+    void enable_verification (const Path& tree_file,
+                              const Digest* expected_root = nullptr);
+
+    /// Verify every block not verified yet, in parallel.
+    /// Throw an exception if verification is not enabled or a block fails.
+    void verify_all ();
+
+    FileHandler* open (const FilePath&);
+
+    /// Resolve a file to its inode reference.
+    bool resolve (const FilePath&, std::uint64_t& entry) override;
+
+    FileHandler* open_resolved (std::uint64_t entry) override;
+
+    const char* name () const override { return "SquashFsFileSystem"; }
+
+    /// Scale the block cache budget with memory pressure.
+    void setMemoryPressureMonitor (
+        std::shared_ptr<MemoryPressureMonitor>) override;
+
+private:
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+/// A file system that serves files in the zstd seekable format from
+/// another file system, decompressing only the frames that are read.
+///
+/// Files named "*.zst" that end with a seek table are served decompressed;
+/// all other files are passed through unchanged.
+class SeekableZstdFileSystem final : public FileSystemHandler
+{
+public:
+
+    explicit SeekableZstdFileSystem (std::unique_ptr<FileSystemHandler> inner);
+
+    FileHandler* open (const FilePath&);
+
+    bool resolve (const FilePath&, std::uint64_t& entry) override;
+
+    FileHandler* open_resolved (std::uint64_t entry) override;
+
+    /// Files served decompressed have no content key; the inner key
+    /// describes the compressed data.
+    bool content_key (std::uint64_t entry, ContentKey&) override;
+
+    bool content_key (const FilePath&, std::uint64_t& entry,
+                      ContentKey&) override;
+
+    bool open_group (const char* name,
+                     std::vector<std::unique_ptr<FileHandler>>&) override;
+
+    void open_batch (const std::vector<FilePath>&,
+                     std::vector<std::unique_ptr<FileHandler>>&) override;
+
+    bool read_progressive (const FilePath&, std::size_t chunk_size,
+                           const ChunkCallback&, bool& finished) override;
+
+    std::function<FileHandler* ()> fetch (const FilePath&) override;
+
+    const char* name () const override { return "SeekableZstdFileSystem"; }
+
+    void setSlowOpLog (SlowOpLog* log) override
+    {
+        slow_ops = log;
+        inner->setSlowOpLog(log);
+    }
+
+    void setMemoryPressureMonitor (
+        std::shared_ptr<MemoryPressureMonitor> monitor) override
+    {
+        inner->setMemoryPressureMonitor(std::move(monitor));
+    }
+
+    void setFoldedLookup (bool enable) override
+    {
+        inner->setFoldedLookup(enable);
+    }
+
+    void setMemoryResource (MemoryResource* resource) override
+    {
+        memory = resource;
+        inner->setMemoryResource(resource);
+    }
+
+private:
+
+    std::unique_ptr<FileSystemHandler> inner;
 };
 
 //
@@ -168,12 +964,23 @@ public:
 
     /// Construct a MemFile.
     /// The MemFile takes ownership of the data.
+    MemFile (Buffer data, std::size_t size);
+
+    /// Construct a MemFile.
+    /// The MemFile takes ownership of the data, which must have been
+    /// allocated with new[]. Prefer the Buffer overload.
     MemFile (std::unique_ptr<std::uint8_t> data, std::size_t size);
 
     /// Construct a MemFile.
     /// The MemFile does not take ownership of the data.
     MemFile (void* data, std::size_t size);
 
+    /// Construct a MemFile.
+    /// The MemFile shares ownership of the data with 'owner', which keeps
+    /// it alive, for example a buffer or a file mapping.
+    MemFile (std::shared_ptr<const void> owner, const void* data,
+             std::size_t size);
+
     ~MemFile ();
 
     std::size_t read (void* buffer, std::size_t size) override;
@@ -181,28 +988,88 @@ public:
     std::ios::pos_type tell () const override;
     std::size_t size () const override;
 
+    /// Return a MemFile sharing this file's data.
+    FileHandler* clone () const override;
+
+    /// Move the data out if the MemFile, or the file it was cloned from,
+    /// owns it and no other file shares it.
+    Buffer take_buffer () override;
+
+    /// Pass chunks of the data itself, without copying.
+    bool read_progressive (std::size_t chunk_size,
+                           const ChunkCallback&) override;
+
 private:
 
     struct impl;
     std::unique_ptr<impl> my;
 };
 
-/// A FileHandler wrapper for an std::ifstream.
+/// A file on the hard drive, read with positional reads through a small
+/// buffer.
 class RegularFile final : public FileHandler
 {
 public:
 
-    RegularFile (std::unique_ptr<std::ifstream>);
+    /// Construct a RegularFile whose read buffer is allocated from
+    /// 'resource', or from the scratch buffer pools if it is null.
+    explicit RegularFile (std::shared_ptr<RandomAccessFile>,
+                          MemoryResource* resource = nullptr);
+
+    ~RegularFile ();
 
     std::size_t read (void* buffer, std::size_t size) override;
     void seek (std::ios::off_type offset, std::ios::seekdir origin) override;
     std::ios::pos_type tell () const override;
     std::size_t size () const override;
 
+    /// Return a RegularFile sharing this file's descriptor. The file and
+    /// its clones each adapt to their own access pattern; the kernel's
+    /// whole-file readahead advice, which they share, only follows a
+    /// pattern all of them read with.
+    FileHandler* clone () const override;
+
 private:
 
-    std::unique_ptr<std::ifstream> file;
-    std::size_t size_;
+    struct impl;
+    explicit RegularFile (impl*);
+    std::unique_ptr<impl> my;
+};
+
+/// A file in the zstd seekable format: independently compressed frames
+/// followed by a seek table.
+/// Seeking is free and reading decompresses only the frames it touches.
+class SeekableZstdFile final : public FileHandler
+{
+public:
+
+    /// Construct a SeekableZstdFile reading compressed data from 'file'.
+    /// Decompressed frames are held in buffers allocated from 'resource',
+    /// or from the scratch pools if it is null.
+    /// Throw an exception if 'file' is not in the seekable format.
+    explicit SeekableZstdFile (std::unique_ptr<FileHandler> file,
+                               MemoryResource* resource = nullptr);
+
+    ~SeekableZstdFile ();
+
+    /// Return true if the file ends with a zstd seek table.
+    static bool is_seekable (FileHandler&);
+
+    std::size_t read (void* buffer, std::size_t size) override;
+    void seek (std::ios::off_type offset, std::ios::seekdir origin) override;
+    std::ios::pos_type tell () const override;
+    std::size_t size () const override;
+
+    /// Return a SeekableZstdFile sharing the seek table, if the compressed
+    /// file can be cloned.
+    FileHandler* clone () const override;
+
+private:
+
+    SeekableZstdFile ();
+
+    struct impl;
+    std::unique_ptr<impl> my;
 };
 
 } // namespace kx
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <iterator>
+#include <unordered_map>
+#include <cstddef>
+
+namespace kx
+{
+
+/// A thread-safe least-recently-used cache with a byte budget.
+/// Values are shared, so evicting a value does not invalidate it for
+/// readers still holding it.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache : NonCopyable
+{
+public:
+
+    using Evicted = std::function<void (const Key&, std::shared_ptr<const Value>)>;
+
+    explicit LruCache (std::size_t budget)
+        : budget_(budget), size_(0) {}
+
+    /// Pass values evicted to stay within budget to 'callback', once the
+    /// cache is unlocked. Set before the cache is shared.
+    void on_evict (Evicted callback) { evicted = std::move(callback); }
+
+    /// Return the cached value, or null if not cached.
+    std::shared_ptr<const Value> get (const Key& key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->value;
+    }
+
+    /// Cache a value occupying 'bytes' bytes, evicting the least recently
+    /// used values to stay within budget.
+    void put (const Key& key, std::shared_ptr<const Value> value, std::size_t bytes)
+    {
+        std::list<Node> out;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bytes > budget_) return;
+            auto it = map.find(key);
+            if (it != map.end())
+            {
+                size_ -= it->second->bytes;
+                lru.erase(it->second);
+                map.erase(it);
+            }
+            Node node = { key, std::move(value), bytes };
+            lru.push_front(std::move(node));
+            map.emplace(key, lru.begin());
+            size_ += bytes;
+            evict(out);
+        }
+        notify(out);
+    }
+
+    /// Remove a value, if cached.
+    void erase (const Key& key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end()) return;
+        size_ -= it->second->bytes;
+        lru.erase(it->second);
+        map.erase(it);
+    }
+
+    /// Remove every value, without passing them to the eviction callback.
+    void clear ()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        map.clear();
+        lru.clear();
+        size_ = 0;
+    }
+
+    /// Change the budget, evicting values if it shrinks.
+    void set_budget (std::size_t budget)
+    {
+        std::list<Node> out;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            budget_ = budget;
+            evict(out);
+        }
+        notify(out);
+    }
+
+    std::size_t budget () const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return budget_;
+    }
+
+    /// Return the bytes held by the cache.
+    std::size_t size () const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return size_;
+    }
+
+private:
+
+    struct Node
+    {
+        Key key;
+        std::shared_ptr<const Value> value;
+        std::size_t bytes;
+    };
+
+    /// Evict values until within budget, moving them to 'out'.
+    void evict (std::list<Node>& out)
+    {
+        while (size_ > budget_)
+        {
+            size_ -= lru.back().bytes;
+            map.erase(lru.back().key);
+            out.splice(out.end(), lru, std::prev(lru.end()));
+        }
+    }
+
+    void notify (std::list<Node>& out)
+    {
+        if (!evicted) return;
+        for (Node& node : out) evicted(node.key, std::move(node.value));
+    }
+
+    mutable std::mutex mutex;
+    std::list<Node> lru; // most recently used first
+    std::unordered_map<Key, typename std::list<Node>::iterator, Hash> map;
+    std::size_t budget_;
+    std::size_t size_;
+    Evicted evicted;
+};
+
+} // namespace kx
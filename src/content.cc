@@ -0,0 +1,108 @@
+#include "content.h"
+#include "pool.h"
+
+#include <new>
+#include <cstring>
+
+#ifndef FILESYSTEM_DISABLE_LZ4
+#include <lz4.h>
+#endif
+
+using namespace kx;
+
+namespace
+{
+
+// Reads of a cold file that move it back to the hot tier; colder files
+// are decompressed without being kept.
+const unsigned PROMOTE_HITS = 2;
+
+} // namespace
+
+ContentCache::ContentCache (std::size_t budget, std::size_t hot_budget)
+    : hot_share(hot_budget < budget ? (double) hot_budget / budget : 1.0),
+      hot(hot_budget < budget ? hot_budget : budget)
+{
+#ifndef FILESYSTEM_DISABLE_LZ4
+    if (hot_budget >= budget) return;
+    cold.reset(new LruCache<ContentKey, Compressed, ContentKeyHash>(budget - hot_budget));
+    hot.on_evict([this](const ContentKey& key, std::shared_ptr<const Content> content)
+    {
+        demote(key, std::move(content));
+    });
+#endif
+}
+
+std::shared_ptr<const Content> ContentCache::get (const ContentKey& key)
+{
+    std::shared_ptr<const Content> data = hot.get(key);
+    if (data || !cold) return data;
+    std::shared_ptr<const Compressed> packed = cold->get(key);
+    if (!packed) return nullptr;
+
+    std::shared_ptr<Content> loaded(new Content);
+    loaded->size = packed->size;
+    loaded->data = allocate_buffer(packed->size);
+    if (packed->raw)
+        std::memcpy(loaded->data.get(), packed->data.get(), packed->size);
+#ifndef FILESYSTEM_DISABLE_LZ4
+    else if (LZ4_decompress_safe((const char*) packed->data.get(), (char*) loaded->data.get(),
+                                 (int) packed->stored, (int) packed->size) != (int) packed->size)
+    {
+        cold->erase(key);
+        return nullptr;
+    }
+#endif
+
+    if (++packed->hits >= PROMOTE_HITS)
+    {
+        cold->erase(key);
+        hot.put(key, loaded, loaded->size);
+    }
+    return loaded;
+}
+
+void ContentCache::put (const ContentKey& key, std::shared_ptr<const Content> content, std::size_t bytes)
+{
+    if (cold) cold->erase(key);
+    hot.put(key, std::move(content), bytes);
+}
+
+void ContentCache::set_budget (std::size_t budget)
+{
+    std::size_t hot_budget = (std::size_t) (budget * hot_share);
+    // Shrink the cold tier first, so that files it keeps are not evicted
+    // by those the hot tier demotes.
+    if (cold) cold->set_budget(budget - hot_budget);
+    hot.set_budget(hot_budget);
+}
+
+void ContentCache::demote (const ContentKey& key, std::shared_ptr<const Content> content)
+{
+#ifndef FILESYSTEM_DISABLE_LZ4
+    if (!content->size || content->size > LZ4_MAX_INPUT_SIZE) return;
+    try
+    {
+        int bound = LZ4_compressBound((int) content->size);
+        PooledBuffer scratch(bound);
+        int n = LZ4_compress_default((const char*) content->data.get(), (char*) scratch.data(),
+                                     (int) content->size, bound);
+
+        std::shared_ptr<Compressed> packed(new Compressed);
+        packed->size = content->size;
+        packed->raw = n <= 0 || (std::size_t) n >= content->size;
+        packed->stored = packed->raw ? content->size : (std::size_t) n;
+        packed->hits = 0;
+        packed->data = allocate_buffer(packed->stored);
+        std::memcpy(packed->data.get(), packed->raw ? content->data.get() : scratch.data(), packed->stored);
+        cold->put(key, packed, packed->stored);
+    }
+    catch (const std::bad_alloc&)
+    {
+        // Eviction frees memory; dropping the file is fine.
+    }
+#else
+    (void) key;
+    (void) content;
+#endif
+}
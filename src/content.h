@@ -0,0 +1,76 @@
+#pragma once
+
+#include <file.h>
+#include <cpp/cpp.h>
+#include "cache.h"
+
+#include <memory>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+namespace kx
+{
+
+struct ContentKeyHash
+{
+    std::size_t operator() (const ContentKey& key) const
+    {
+        // The digest is already uniform; any 8 bytes of it will do.
+        std::uint64_t h;
+        std::memcpy(&h, key.sha256.data(), sizeof(h));
+        return std::hash<std::uint64_t>()(h ^ key.size);
+    }
+};
+
+/// The data of a file in the content cache.
+struct Content
+{
+    Buffer data;
+    std::size_t size;
+};
+
+/// The content cache of a FileSystem. Files are kept decompressed in a hot
+/// tier. Files evicted from it move to a cold tier, if any, where they are
+/// kept LZ4-compressed and decompressed on each access; a file read again
+/// while cold moves back to the hot tier.
+class ContentCache : NonCopyable
+{
+public:
+
+    /// Construct a cache of 'budget' bytes, at most 'hot_budget' of which
+    /// hold decompressed files. All of it does if 'hot_budget' is at least
+    /// 'budget' or LZ4 is disabled.
+    ContentCache (std::size_t budget, std::size_t hot_budget);
+
+    /// Return a file's data, or null if not cached.
+    std::shared_ptr<const Content> get (const ContentKey&);
+
+    /// Add a file's data to the hot tier.
+    void put (const ContentKey&, std::shared_ptr<const Content>, std::size_t bytes);
+
+    /// Change the budget, keeping the share of each tier.
+    void set_budget (std::size_t budget);
+
+private:
+
+    /// A file in the cold tier.
+    struct Compressed
+    {
+        Buffer data;
+        std::size_t stored;          // bytes in 'data'
+        std::size_t size;            // bytes decompressed
+        bool raw;                    // stored as is, LZ4 did not shrink it
+        mutable std::atomic<unsigned> hits;
+    };
+
+    /// Move a file evicted from the hot tier to the cold tier.
+    void demote (const ContentKey&, std::shared_ptr<const Content>);
+
+    const double hot_share;
+    LruCache<ContentKey, Content, ContentKeyHash> hot;
+    std::unique_ptr<LruCache<ContentKey, Compressed, ContentKeyHash>> cold;
+};
+
+} // namespace kx
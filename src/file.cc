@@ -1,13 +1,18 @@
 #include <file.h>
 #include <cpp/Exception.h>
-
-#ifndef FILESYSTEM_DISABLE_ZIP
-#include <zip.h>
-#endif
+#include "io.h"
+#include "content.h"
+#include "merkle.h"
+#include "pool.h"
 
 #include <vector>
+#include <deque>
 #include <string>
+#include <unordered_map>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include <cstdio>
 #include <cstring>
@@ -15,11 +20,101 @@
 
 using namespace kx;
 
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+/// A FileHandler wrapper that reports slow reads to a SlowOpLog.
+class TimedFile final : public FileHandler
+{
+public:
+
+    TimedFile (std::unique_ptr<FileHandler> file, std::shared_ptr<SlowOpLog> log,
+               const char* path, const char* handler)
+        : file(std::move(file)), log(std::move(log)), path(path), handler(handler) {}
+
+    std::size_t read (void* buffer, std::size_t size) override
+    {
+        Clock::time_point start = Clock::now();
+        std::size_t n = file->read(buffer, size);
+        log->record(SlowOp::Read, path.c_str(), handler, n, Clock::now() - start);
+        return n;
+    }
+
+    bool read_progressive (std::size_t chunk_size, const ChunkCallback& callback) override
+    {
+        // Time spent in the callback is the caller's, not the read's.
+        std::size_t n = 0;
+        Clock::duration in_callback(0);
+        Clock::time_point start = Clock::now();
+        bool finished = file->read_progressive(chunk_size,
+            [&](const std::uint8_t* data, std::size_t size, std::uint64_t offset)
+            {
+                n += size;
+                Clock::time_point called = Clock::now();
+                bool more = callback(data, size, offset);
+                in_callback += Clock::now() - called;
+                return more;
+            });
+        log->record(SlowOp::Read, path.c_str(), handler, n, Clock::now() - start - in_callback);
+        return finished;
+    }
+
+    void seek (std::ios::off_type offset, std::ios::seekdir origin) override
+    {
+        file->seek(offset, origin);
+    }
+
+    std::ios::pos_type tell () const override { return file->tell(); }
+
+    std::size_t size () const override { return file->size(); }
+
+    FileHandler* clone () const override
+    {
+        std::unique_ptr<FileHandler> copy(file->clone());
+        if (!copy) return nullptr;
+        return new TimedFile(std::move(copy), log, path.c_str(), handler);
+    }
+
+    Buffer take_buffer () override { return file->take_buffer(); }
+
+private:
+
+    std::unique_ptr<FileHandler> file;
+    std::shared_ptr<SlowOpLog> log; // keeps the log alive while the file is open
+    std::string path;
+    const char* handler;
+};
+
+} // namespace
+
 // FileSystem
 
 struct FileSystem::impl
 {
     std::vector<std::unique_ptr<FileSystemHandler>> handlers;
+    std::shared_ptr<SlowOpLog> slow_ops;
+    std::shared_ptr<ContentCache> content;
+    std::size_t content_budget = 0;
+
+    std::shared_ptr<MemoryPressureMonitor> pressure;
+    std::uint64_t subscription = UINT64_MAX;
+
+    bool folded = false;
+    MemoryResource* memory = nullptr;
+
+    ~impl () { unwatch_pressure(); }
+
+    /// Subscribe the content cache to the pressure monitor, if both are set.
+    void watch_pressure ();
+    void unwatch_pressure ();
+
+    /// Open an entry through the content cache.
+    FileHandler* open_cached (FileSystemHandler&, std::uint64_t entry, const ContentKey&);
+
+    // Bumped whenever handlers change, invalidating resolved FileIds.
+    std::uint32_t generation = 0;
 };
 
 FileSystem::FileSystem ()
@@ -40,23 +135,289 @@ FileSystem::FileSystem (const std::vector<FilePath>& paths)
 
 FileSystem::~FileSystem () {}
 
+void FileSystem::impl::watch_pressure ()
+{
+    if (!pressure || !content) return;
+    std::weak_ptr<ContentCache> cache = content;
+    std::size_t budget = content_budget;
+    subscription = pressure->subscribe([cache, budget](double scale)
+    {
+        if (std::shared_ptr<ContentCache> c = cache.lock())
+            c->set_budget((std::size_t) (budget * scale));
+    });
+}
+
+void FileSystem::impl::unwatch_pressure ()
+{
+    if (subscription == UINT64_MAX) return;
+    pressure->unsubscribe(subscription);
+    subscription = UINT64_MAX;
+}
+
+FileHandler* FileSystem::impl::open_cached (FileSystemHandler& handler, std::uint64_t entry,
+                                            const ContentKey& key)
+{
+    std::shared_ptr<const Content> data = content->get(key);
+    if (!data)
+    {
+        std::unique_ptr<FileHandler> file(handler.open_resolved(entry));
+        if (!file) return nullptr;
+        // Inflated entries are moved into the cache rather than copied,
+        // unless they belong to a memory resource the cache may outlive.
+        std::shared_ptr<Content> loaded(new Content);
+        loaded->size = file->size();
+        loaded->data = file->take_buffer();
+        if (loaded->data && loaded->data.get_deleter().resource)
+        {
+            Buffer copy = allocate_buffer(loaded->size);
+            std::memcpy(copy.get(), loaded->data.get(), loaded->size);
+            loaded->data = std::move(copy);
+        }
+        if (!loaded->data)
+        {
+            loaded->data = allocate_buffer(loaded->size);
+            loaded->size = file->read(loaded->data.get(), loaded->size);
+        }
+        // Keys are read from the archive, so check them before other
+        // files, from other archives, are served this data.
+        if (loaded->size != key.size || Sha256::hash(loaded->data.get(), loaded->size) != key.sha256)
+        {
+            std::ostringstream os;
+            os << "Entry " << entry << " of " << handler.name() << " does not match its content key";
+            throw EXCEPTION(os);
+        }
+        content->put(key, loaded, loaded->size);
+        data = loaded;
+    }
+    return new MemFile(data, data->data.get(), data->size);
+}
+
 File FileSystem::open(const FilePath& filepath) const
 {
+    SlowOpLog* log = my->slow_ops.get();
+    Clock::time_point start = log ? Clock::now() : Clock::time_point();
     for (auto& handler : my->handlers)
     {
-        FileHandler* file = handler->open(filepath);
+        std::uint64_t entry;
+        ContentKey key;
+        FileHandler* file = my->content && handler->content_key(filepath, entry, key) ?
+                            my->open_cached(*handler, entry, key) : nullptr;
+        if (file == nullptr)
+            file = handler->open(filepath);
         if (file != nullptr)
-            return File(std::move(std::unique_ptr<FileHandler>(file)));
+        {
+            std::unique_ptr<FileHandler> f(file);
+            if (log)
+            {
+                log->record(SlowOp::Open, filepath, handler->name(), f->size(), Clock::now() - start);
+                f.reset(new TimedFile(std::move(f), my->slow_ops, filepath, handler->name()));
+            }
+            return File(std::move(f));
+        }
     }
+    // Misses can be slow too when many handlers are probed
+    if (log) log->record(SlowOp::Open, filepath, "", 0, Clock::now() - start);
     // Throw exception only after trying all handlers
     std::ostringstream os;
     os << "Failed opening file " << filepath;
     throw EXCEPTION(os);
 }
 
+FileId FileSystem::resolve (const FilePath& filepath) const
+{
+    for (std::size_t i = 0; i < my->handlers.size(); ++i)
+    {
+        FileSystemHandler& handler = *my->handlers[i];
+        FileId id;
+        if (handler.resolve(filepath, id.entry))
+        {
+            id.handler = (std::uint32_t) i;
+            id.generation = my->generation;
+            return id;
+        }
+        // A handler that cannot resolve must not be skipped if it has the file,
+        // or the id would refer to a file other than the one open() finds.
+        std::unique_ptr<FileHandler> file(handler.open(filepath));
+        if (file)
+        {
+            std::ostringstream os;
+            os << "Failed resolving file " << filepath << ": " << handler.name()
+               << " does not support resolving";
+            throw EXCEPTION(os);
+        }
+    }
+    std::ostringstream os;
+    os << "Failed resolving file " << filepath;
+    throw EXCEPTION(os);
+}
+
+File FileSystem::open (const FileId& id) const
+{
+    if (!id.valid() || id.generation != my->generation || id.handler >= my->handlers.size())
+        throw EXCEPTION("Invalid or stale FileId");
+
+    SlowOpLog* log = my->slow_ops.get();
+    Clock::time_point start = log ? Clock::now() : Clock::time_point();
+    FileSystemHandler& handler = *my->handlers[id.handler];
+    ContentKey key;
+    std::unique_ptr<FileHandler> file(my->content && handler.content_key(id.entry, key) ?
+                                      my->open_cached(handler, id.entry, key) : nullptr);
+    if (!file)
+        file.reset(handler.open_resolved(id.entry));
+    if (!file)
+    {
+        std::ostringstream os;
+        os << "Failed opening entry " << id.entry << " of " << handler.name();
+        throw EXCEPTION(os);
+    }
+    if (log)
+    {
+        char path[32];
+        std::snprintf(path, sizeof(path), "#%llu", (unsigned long long) id.entry);
+        log->record(SlowOp::Open, path, handler.name(), file->size(), Clock::now() - start);
+        file.reset(new TimedFile(std::move(file), my->slow_ops, path, handler.name()));
+    }
+    return File(std::move(file));
+}
+
+std::vector<File> FileSystem::load_group (const char* name) const
+{
+    std::vector<std::unique_ptr<FileHandler>> handlers;
+    for (auto& handler : my->handlers)
+    {
+        if (handler->open_group(name, handlers))
+        {
+            std::vector<File> files;
+            files.reserve(handlers.size());
+            for (auto& file : handlers)
+                files.push_back(File(std::move(file)));
+            return files;
+        }
+    }
+    std::ostringstream os;
+    os << "Failed loading group " << name;
+    throw EXCEPTION(os);
+}
+
+std::vector<File> FileSystem::open_batch (const std::vector<FilePath>& paths) const
+{
+    std::vector<std::unique_ptr<FileHandler>> handlers(paths.size());
+    std::vector<const char*> names(paths.size()); // handler of each file
+    for (auto& handler : my->handlers)
+    {
+        handler->open_batch(paths, handlers);
+        for (std::size_t i = 0; i < paths.size(); ++i)
+            if (handlers[i] && !names[i]) names[i] = handler->name();
+    }
+
+    std::vector<File> files;
+    files.reserve(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        if (!handlers[i])
+        {
+            std::ostringstream os;
+            os << "Failed opening file " << paths[i];
+            throw EXCEPTION(os);
+        }
+        if (my->slow_ops)
+            handlers[i].reset(new TimedFile(std::move(handlers[i]), my->slow_ops, paths[i], names[i]));
+        files.push_back(File(std::move(handlers[i])));
+    }
+    return files;
+}
+
+bool FileSystem::read_progressive (const FilePath& filepath, std::size_t chunk_size,
+                                   const ChunkCallback& callback) const
+{
+    if (chunk_size == 0)
+        throw EXCEPTION("Chunk size must not be zero");
+    for (auto& handler : my->handlers)
+    {
+        // Files already in the content cache are served from it; others
+        // are streamed rather than loaded into it.
+        std::uint64_t entry;
+        ContentKey key;
+        if (my->content && handler->content_key(filepath, entry, key))
+        {
+            std::shared_ptr<const Content> data = my->content->get(key);
+            if (data) return MemFile(data, data->data.get(), data->size).read_progressive(chunk_size, callback);
+        }
+        bool finished;
+        if (handler->read_progressive(filepath, chunk_size, callback, finished))
+            return finished;
+    }
+    std::ostringstream os;
+    os << "Failed opening file " << filepath;
+    throw EXCEPTION(os);
+}
+
+std::function<FileHandler* ()> FileSystem::fetch (const FilePath& filepath) const
+{
+    for (auto& handler : my->handlers)
+    {
+        // Cached entries are opened, or loaded into the cache, by the
+        // decoding function.
+        std::uint64_t entry;
+        ContentKey key;
+        if (my->content && handler->content_key(filepath, entry, key))
+        {
+            impl* fs = my.get();
+            FileSystemHandler* h = handler.get();
+            return [=]() { return fs->open_cached(*h, entry, key); };
+        }
+        std::function<FileHandler* ()> decode = handler->fetch(filepath);
+        if (decode) return decode;
+    }
+    return nullptr;
+}
+
 void FileSystem::addHandler (std::unique_ptr<FileSystemHandler> handler)
 {
+    handler->setSlowOpLog(my->slow_ops.get());
+    if (my->pressure) handler->setMemoryPressureMonitor(my->pressure);
+    if (my->folded) handler->setFoldedLookup(true);
+    if (my->memory) handler->setMemoryResource(my->memory);
     my->handlers.push_back(std::move(handler));
+    my->generation++;
+}
+
+void FileSystem::setSlowOpLog (std::shared_ptr<SlowOpLog> log)
+{
+    my->slow_ops = std::move(log);
+    for (auto& handler : my->handlers)
+        handler->setSlowOpLog(my->slow_ops.get());
+}
+
+void FileSystem::setContentCache (std::size_t budget, std::size_t hot_budget)
+{
+    my->unwatch_pressure();
+    my->content.reset(budget ? new ContentCache(budget, hot_budget) : nullptr);
+    my->content_budget = budget;
+    my->watch_pressure();
+}
+
+void FileSystem::setMemoryPressureMonitor (std::shared_ptr<MemoryPressureMonitor> monitor)
+{
+    my->unwatch_pressure();
+    my->pressure = std::move(monitor);
+    my->watch_pressure();
+    for (auto& handler : my->handlers)
+        handler->setMemoryPressureMonitor(my->pressure);
+}
+
+void FileSystem::setFoldedLookup (bool enable)
+{
+    my->folded = enable;
+    for (auto& handler : my->handlers)
+        handler->setFoldedLookup(enable);
+}
+
+void FileSystem::setMemoryResource (MemoryResource* resource)
+{
+    my->memory = resource;
+    for (auto& handler : my->handlers)
+        handler->setMemoryResource(resource);
 }
 
 // File
@@ -64,8 +425,25 @@ void FileSystem::addHandler (std::unique_ptr<FileSystemHandler> handler)
 File::File (std::unique_ptr<FileHandler> handler)
     : handler(std::move(handler)) {}
 
+File::File (File&& other)
+    : handler(std::move(other.handler)) {}
+
+File& File::operator= (File&& other)
+{
+    handler = std::move(other.handler);
+    return *this;
+}
+
 File::~File () {}
 
+File File::clone () const
+{
+    std::unique_ptr<FileHandler> copy(handler->clone());
+    if (!copy)
+        throw EXCEPTION("File does not support cloning");
+    return File(std::move(copy));
+}
+
 std::string File::read_all ()
 {
     std::string contents(this->size(), 0);
@@ -73,11 +451,29 @@ std::string File::read_all ()
     return contents;
 }
 
+Buffer File::read_all_owned (std::size_t& size)
+{
+    size = this->size();
+    Buffer data = handler->take_buffer();
+    if (data) return data;
+    data = allocate_buffer(size);
+    seek(0, std::ios::beg);
+    size = read(data.get(), size);
+    return data;
+}
+
 std::size_t File::read (void* buffer, std::size_t size)
 {
     return handler->read(buffer, size);
 }
 
+bool File::read_progressive (std::size_t chunk_size, const ChunkCallback& callback)
+{
+    if (chunk_size == 0)
+        throw EXCEPTION("Chunk size must not be zero");
+    return handler->read_progressive(chunk_size, callback);
+}
+
 std::size_t File::read_line (char *buffer, std::size_t count)
 {
     char c = 0;
@@ -130,54 +526,215 @@ bool File::eof() const
     return (std::size_t) handler->tell() == handler->size();
 }
 
+// SlowOpLog
+
+// A bounded multi-producer queue after Dmitry Vyukov's design: each cell
+// carries a sequence number telling producers and the consumer whose turn
+// it is, so recording never takes a lock or allocates.
+
+struct SlowOpLog::impl
+{
+    struct Cell
+    {
+        std::atomic<std::size_t> seq;
+        SlowOp op;
+    };
+
+    SlowOpThresholds thresholds;
+    std::unique_ptr<Cell[]> cells;
+    std::size_t mask;
+    std::atomic<std::size_t> enqueue_pos;
+    std::atomic<std::size_t> dequeue_pos;
+    std::atomic<std::size_t> dropped;
+
+    impl (const SlowOpThresholds& thresholds, std::size_t capacity)
+        : thresholds(thresholds), enqueue_pos(0), dequeue_pos(0), dropped(0)
+    {
+        std::size_t n = 2;
+        while (n < capacity) n <<= 1;
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (std::size_t i = 0; i < n; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+};
+
+SlowOpLog::SlowOpLog (const SlowOpThresholds& thresholds, std::size_t capacity)
+    : my(new impl(thresholds, capacity)) {}
+
+SlowOpLog::~SlowOpLog () {}
+
+void SlowOpLog::record (SlowOp::Kind kind, const char* path, const char* handler,
+                        std::size_t size, std::chrono::nanoseconds duration)
+{
+    std::chrono::nanoseconds threshold =
+        kind == SlowOp::Open ? my->thresholds.open :
+        kind == SlowOp::Read ? my->thresholds.read : my->thresholds.decompress;
+    if (duration < threshold) return;
+
+    impl::Cell* cell;
+    std::size_t pos = my->enqueue_pos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &my->cells[pos & my->mask];
+        std::size_t seq = cell->seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+        if (diff == 0)
+        {
+            if (my->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Full; the consumer has not caught up.
+            my->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else pos = my->enqueue_pos.load(std::memory_order_relaxed);
+    }
+
+    SlowOp& op = cell->op;
+    op.kind = kind;
+    std::strncpy(op.path, path, sizeof(op.path) - 1);
+    op.path[sizeof(op.path) - 1] = 0;
+    op.handler = handler;
+    op.size = size;
+    op.duration = duration;
+    op.thread = std::this_thread::get_id();
+    cell->seq.store(pos + 1, std::memory_order_release);
+}
+
+std::size_t SlowOpLog::drain (const Callback& callback)
+{
+    std::size_t count = 0;
+    for (;;)
+    {
+        std::size_t pos = my->dequeue_pos.load(std::memory_order_relaxed);
+        impl::Cell& cell = my->cells[pos & my->mask];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+            break;
+        SlowOp op = cell.op;
+        cell.seq.store(pos + my->mask + 1, std::memory_order_release);
+        my->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        callback(op);
+        count++;
+    }
+    return count;
+}
+
+std::size_t SlowOpLog::dropped () const
+{
+    return my->dropped.load(std::memory_order_relaxed);
+}
+
+const SlowOpThresholds& SlowOpLog::thresholds () const
+{
+    return my->thresholds;
+}
+
 //
 // File system implementations
 //
 
+// FileSystemHandler
+
+void FileSystemHandler::open_batch (const std::vector<FilePath>& paths,
+                                    std::vector<std::unique_ptr<FileHandler>>& files)
+{
+    for (std::size_t i = 0; i < paths.size(); ++i)
+        if (!files[i]) files[i].reset(open(paths[i]));
+}
+
+std::function<FileHandler* ()> FileSystemHandler::fetch (const FilePath& filepath)
+{
+    std::unique_ptr<FileHandler> handler(open(filepath));
+    if (!handler) return nullptr;
+    // Read the file here, in the pipeline's read stage; the returned
+    // function only wraps the data.
+    std::size_t size = handler->size();
+    std::shared_ptr<Buffer> data(new Buffer(handler->take_buffer()));
+    if (!*data)
+    {
+        *data = allocate_buffer(size);
+        size = handler->read(data->get(), size);
+    }
+    return [data, size]() { return new MemFile(std::move(*data), size); };
+}
+
+bool FileSystemHandler::read_progressive (const FilePath& filepath, std::size_t chunk_size,
+                                          const ChunkCallback& callback, bool& finished)
+{
+    std::unique_ptr<FileHandler> file(open(filepath));
+    if (!file) return false;
+    finished = file->read_progressive(chunk_size, callback);
+    return true;
+}
+
+// FileHandler
+
+bool FileHandler::read_progressive (std::size_t chunk_size, const ChunkCallback& callback)
+{
+    PooledBuffer buffer(chunk_size);
+    std::uint64_t offset = (std::uint64_t) (std::streamoff) tell();
+    for (std::size_t n; (n = read(buffer.data(), chunk_size)) > 0; offset += n)
+        if (!callback(buffer.data(), n, offset)) return false;
+    return true;
+}
+
 // RegularFileSystem
 
+struct RegularFileSystem::impl
+{
+    // Resolved paths. A deque keeps references stable as it grows.
+    std::mutex mutex;
+    std::deque<std::string> paths;
+    std::unordered_map<std::string, std::uint64_t> ids;
+};
+
 RegularFileSystem::RegularFileSystem (const Path& root)
-    : root(root) {}
+    : root(root), my(new impl) {}
 
-FileHandler* RegularFileSystem::open (const FilePath& filepath)
+RegularFileSystem::~RegularFileSystem () {}
+
+static FileHandler* open_regular_file (const std::string& filepath, MemoryResource* memory)
 {
-    std::string filepath_ = std::string(root) + "/" + filepath;
-    std::unique_ptr<std::ifstream> f(new std::ifstream(filepath_, std::ios::binary));
-    if (f->is_open())
-        return new RegularFile(std::move(f));
+    std::shared_ptr<RandomAccessFile> f(new RandomAccessFile);
+    if (f->open(filepath.c_str()))
+        return new RegularFile(std::move(f), memory);
     else
         return nullptr;
 }
 
-// ZipFileSystem
+FileHandler* RegularFileSystem::open (const FilePath& filepath)
+{
+    return open_regular_file(std::string(root) + "/" + filepath, memory);
+}
 
-ZipFileSystem::ZipFileSystem (const Path& zip_file)
-    : zip_file(zip_file) {}
+bool RegularFileSystem::resolve (const FilePath& filepath, std::uint64_t& entry)
+{
+    std::string filepath_ = std::string(root) + "/" + filepath;
+    if (!RandomAccessFile().open(filepath_.c_str()))
+        return false;
+    std::lock_guard<std::mutex> lock(my->mutex);
+    auto it = my->ids.find(filepath_);
+    if (it == my->ids.end())
+    {
+        it = my->ids.emplace(filepath_, my->paths.size()).first;
+        my->paths.push_back(filepath_);
+    }
+    entry = it->second;
+    return true;
+}
 
-FileHandler* ZipFileSystem::open (const FilePath& filepath)
+FileHandler* RegularFileSystem::open_resolved (std::uint64_t entry)
 {
-#ifndef FILESYSTEM_DISABLE_ZIP
-    zip* z = zip_open(filepath, 0, NULL);
-    if (z != NULL)
+    const std::string* filepath;
     {
-        struct zip_stat stat;
-        zip_stat(z, filepath, 0, &stat);
-        struct zip_file* file = zip_fopen(z, filepath, 0);
-        if (file != NULL)
-        {
-            std::size_t size = stat.size;
-            std::unique_ptr<std::uint8_t> data(new std::uint8_t[size]);
-            zip_fread(file, data.get(), stat.size);
-            zip_fclose(file);
-            zip_close(z);
-            return new MemFile(std::move(data), size);
-        }
-        zip_close(z);
+        std::lock_guard<std::mutex> lock(my->mutex);
+        if (entry >= my->paths.size()) return nullptr;
+        filepath = &my->paths[(std::size_t) entry];
     }
-    return nullptr;
-#else
-    throw EXCEPTION("zip files not supported in this FileSystem build");
-#endif
+    return open_regular_file(*filepath, memory);
 }
 
 //
@@ -188,9 +745,14 @@ FileHandler* ZipFileSystem::open (const FilePath& filepath)
 
 struct MemFile::impl
 {
-    // This is used when the MemFile takes ownership of the file data.
-    // Otherwise remains null.
-    std::unique_ptr<std::uint8_t> data;
+    // Keeps the file data alive when the MemFile owns or shares it.
+    // Otherwise remains null. Clones share it.
+    std::shared_ptr<const void> owner;
+
+    // The buffer held by 'owner' if the MemFile or the file it was cloned
+    // from was given it, so that take_buffer() can move it out once no
+    // other file shares it.
+    Buffer* owned = nullptr;
 
     // We use std::uint8_t* so that we can compute byte offsets
     // by subtracting pointers
@@ -199,28 +761,39 @@ struct MemFile::impl
 
     std::size_t size; // file size
 
-    impl (std::unique_ptr<std::uint8_t> data, std::size_t size)
-        : data(std::move(data)), beg(data.get()), pointer(beg), size(size) {}
-
-    impl (void* data, std::size_t size)
-        : beg((std::uint8_t*)data), pointer(beg), size(size) {}
+    impl (std::shared_ptr<const void> owner, const void* data, std::size_t size)
+        : owner(std::move(owner)), beg((const std::uint8_t*)data), pointer(beg), size(size) {}
 };
 
+MemFile::MemFile (Buffer data, std::size_t size)
+    : my(new impl(nullptr, data.get(), size))
+{
+    // Shared from the start, so that clone() only copies 'owner'.
+    std::shared_ptr<Buffer> owned = std::make_shared<Buffer>(std::move(data));
+    my->owned = owned.get();
+    my->owner = std::move(owned);
+}
+
+// Owned data is allocated with new[] and must be released with delete[].
 MemFile::MemFile (std::unique_ptr<std::uint8_t> data, std::size_t size)
-    : my(new impl(std::move(data), size)) {}
+    : MemFile(Buffer(data.release()), size) {}
 
 MemFile::MemFile (void* data, std::size_t size)
-    : my(new impl(data, size)) {}
+    : my(new impl(nullptr, data, size)) {}
+
+MemFile::MemFile (std::shared_ptr<const void> owner, const void* data, std::size_t size)
+    : my(new impl(std::move(owner), data, size)) {}
 
 MemFile::~MemFile () {}
 
 std::size_t MemFile::read (void* buffer, std::size_t size)
 {
-    std::size_t remaining = my->beg + my->size - my->pointer;
+    const std::uint8_t* end = my->beg + my->size;
+    std::size_t remaining = my->pointer < end ? end - my->pointer : 0;
     std::size_t read = std::min(remaining, size);
-    memcpy(buffer, my->pointer, read);
+    if (read) memcpy(buffer, my->pointer, read); // data is null once taken
     my->pointer += read;
-    return read/my->size;
+    return read;
 }
 
 void MemFile::seek (std::ios::off_type offset, std::ios::seekdir origin)
@@ -240,34 +813,233 @@ std::size_t MemFile::size () const
     return my->size;
 }
 
+FileHandler* MemFile::clone () const
+{
+    MemFile* copy = new MemFile(my->owner, my->beg, my->size);
+    copy->my->owned = my->owned;
+    copy->my->pointer = my->pointer;
+    return copy;
+}
+
+bool MemFile::read_progressive (std::size_t chunk_size, const ChunkCallback& callback)
+{
+    const std::uint8_t* end = my->beg + my->size;
+    while (my->pointer < end)
+    {
+        const std::uint8_t* chunk = my->pointer;
+        std::size_t n = std::min<std::size_t>(chunk_size, end - chunk);
+        my->pointer += n;
+        if (!callback(chunk, n, (std::uint64_t) (chunk - my->beg))) return false;
+    }
+    return true;
+}
+
+Buffer MemFile::take_buffer ()
+{
+    if (!my->owned || my->owner.use_count() != 1) return nullptr;
+    Buffer data = std::move(*my->owned);
+    my->owned = nullptr;
+    my->owner.reset();
+    my->beg = my->pointer = nullptr;
+    my->size = 0;
+    return data;
+}
+
 // RegularFile
 
-RegularFile::RegularFile (std::unique_ptr<std::ifstream> file_)
-    : file(std::move(file_))
+struct RegularFile::impl
+{
+    // Reads that reach the file are sized by the access pattern: the
+    // buffer grows from min_window up to max_window while reads are
+    // sequential, and is bypassed for random and strided reads.
+    static const std::size_t min_window = 4096;
+    static const std::size_t max_window = 1 << 20;
+
+    enum Pattern { Unknown, Sequential, Strided, Random };
+
+    /// Whole-file advice applies to the descriptor, which clones share,
+    /// so it follows the files sharing it only while they all agree.
+    struct Advice
+    {
+        std::mutex mutex;
+        unsigned files = 0;
+        unsigned sequential = 0; // files reading sequentially
+        unsigned random = 0; // files reading randomly or strided
+        RandomAccessFile::Advice current = RandomAccessFile::Normal;
+    };
+
+    std::shared_ptr<RandomAccessFile> file; // shared between clones
+    std::shared_ptr<Advice> advice; // shared between clones
+    MemoryResource* memory; // allocates the buffer; the scratch pools if null
+    std::uint64_t offset = 0; // input position indicator
+    Buffer buffer;
+    std::size_t buffer_capacity = 0;
+    std::uint64_t buffer_offset = 0; // file offset of buffer[0]
+    std::size_t buffer_size = 0; // valid bytes in the buffer
+
+    // Access pattern, classified from the offsets of the last reads.
+    Pattern pattern = Unknown;
+    Pattern candidate = Unknown;
+    unsigned votes = 0; // consecutive reads classified as the candidate
+    std::uint64_t last = UINT64_MAX; // offset of the last read
+    std::uint64_t next = UINT64_MAX; // end of the last read
+    std::int64_t stride = 0; // distance between the last two reads
+    std::size_t window = min_window;
+
+    impl (std::shared_ptr<RandomAccessFile> file, std::shared_ptr<Advice> shared, MemoryResource* memory)
+        : file(std::move(file)), advice(std::move(shared)), memory(memory)
+    {
+        std::lock_guard<std::mutex> lock(advice->mutex);
+        advice->files++;
+        advise();
+    }
+
+    ~impl ()
+    {
+        vote(Unknown);
+        std::lock_guard<std::mutex> lock(advice->mutex);
+        advice->files--;
+        advise();
+    }
+
+    /// Classify a read of 'size' bytes at the current offset. The pattern
+    /// changes after two reads agree.
+    void observe (std::size_t size);
+
+    /// Move this file's vote on the whole-file advice to 'seen'.
+    void vote (Pattern seen);
+
+    /// Apply the advice every file sharing the descriptor agrees on.
+    /// Called with the advice locked.
+    void advise ();
+
+    /// Hint the system about the data following a read that reached the
+    /// file.
+    void prefetch (std::uint64_t offset, std::size_t size);
+};
+
+void RegularFile::impl::observe (std::size_t size)
+{
+    std::int64_t distance = (std::int64_t) (offset - last);
+    // Rereading the last read, as peek() does, does not break a stream.
+    Pattern seen = offset >= last && offset <= next ? Sequential :
+                   stride != 0 && distance == stride ? Strided : Random;
+    stride = distance;
+    last = offset;
+    next = offset + size;
+
+    votes = seen == candidate ? votes + 1 : 1;
+    candidate = seen;
+    if (votes < 2 || seen == pattern) return;
+
+    vote(seen);
+    pattern = seen;
+    window = min_window;
+}
+
+void RegularFile::impl::vote (Pattern seen)
+{
+    std::lock_guard<std::mutex> lock(advice->mutex);
+    if (pattern == Sequential) advice->sequential--;
+    else if (pattern != Unknown) advice->random--;
+    if (seen == Sequential) advice->sequential++;
+    else if (seen != Unknown) advice->random++;
+    advise();
+}
+
+void RegularFile::impl::advise ()
+{
+    RandomAccessFile::Advice agreed =
+        advice->files && advice->sequential == advice->files ? RandomAccessFile::Sequential :
+        advice->files && advice->random == advice->files ? RandomAccessFile::Random : RandomAccessFile::Normal;
+    if (agreed == advice->current) return;
+    file->advise(0, 0, agreed);
+    advice->current = agreed;
+}
+
+void RegularFile::impl::prefetch (std::uint64_t offset, std::size_t size)
 {
-    // Compute file size.
-    file->seekg(0, std::ios::end);
-    size_ = file->tellg();
-    file->seekg(0, std::ios::beg);
+    if (pattern == Sequential)
+        file->advise(offset + size, window, RandomAccessFile::WillNeed);
+    else if (pattern == Strided && stride > 0)
+        file->advise(offset + stride, size, RandomAccessFile::WillNeed);
 }
 
+RegularFile::RegularFile (std::shared_ptr<RandomAccessFile> file, MemoryResource* memory)
+    : my(new impl(std::move(file), std::make_shared<impl::Advice>(), memory)) {}
+
+RegularFile::RegularFile (impl* clone)
+    : my(clone) {}
+
+RegularFile::~RegularFile () {}
+
 std::size_t RegularFile::read (void* buffer, std::size_t size)
 {
-    file->read((char*)buffer, (std::streamsize) size);
-    return file->gcount();
+    if (size == 0) return 0;
+    my->observe(size);
+
+    std::uint8_t* out = (std::uint8_t*) buffer;
+    std::size_t total = 0;
+    while (total < size)
+    {
+        if (my->offset >= my->buffer_offset && my->offset < my->buffer_offset + my->buffer_size)
+        {
+            std::size_t start = (std::size_t) (my->offset - my->buffer_offset);
+            std::size_t n = std::min(size - total, my->buffer_size - start);
+            memcpy(out + total, my->buffer.get() + start, n);
+            total += n;
+            my->offset += n;
+        }
+        else if (size - total >= my->window || my->pattern == impl::Random || my->pattern == impl::Strided)
+        {
+            // Large reads bypass the buffer, and random probes read only
+            // what they ask for.
+            std::size_t n = my->file->read_at(my->offset, out + total, size - total);
+            my->prefetch(my->offset, n);
+            total += n;
+            my->offset += n;
+            break;
+        }
+        else
+        {
+            // Streams double the window on each refill.
+            if (my->pattern == impl::Sequential && my->buffer_size == my->buffer_capacity)
+                my->window = std::min(my->window * 2, (std::size_t) impl::max_window);
+            if (my->buffer_capacity < my->window)
+            {
+                my->buffer = allocate_buffer(my->window, my->memory ? my->memory : pool_resource());
+                my->buffer_capacity = my->window;
+            }
+            my->buffer_offset = my->offset;
+            my->buffer_size = my->file->read_at(my->offset, my->buffer.get(), my->window);
+            my->prefetch(my->offset, my->buffer_size);
+            if (my->buffer_size == 0) break;
+        }
+    }
+    return total;
 }
 
 void RegularFile::seek (std::ios::off_type offset, std::ios::seekdir origin)
 {
-    file->seekg(offset, origin);
+    std::int64_t base = origin == std::ios::beg ? 0 :
+                        origin == std::ios::cur ? (std::int64_t) my->offset :
+                        (std::int64_t) my->file->size();
+    my->offset = (std::uint64_t) std::max<std::int64_t>(0, base + offset);
 }
 
 std::ios::pos_type RegularFile::tell () const
 {
-    return file->tellg();
+    return (std::ios::pos_type) my->offset;
 }
 
 std::size_t RegularFile::size () const
 {
-    return size_;
+    return (std::size_t) my->file->size();
+}
+
+FileHandler* RegularFile::clone () const
+{
+    RegularFile* copy = new RegularFile(new impl(my->file, my->advice, my->memory));
+    copy->my->offset = my->offset;
+    return copy;
 }
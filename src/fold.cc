@@ -0,0 +1,95 @@
+#include "fold.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+using namespace kx;
+
+namespace
+{
+
+/// Write the folded form of 'path' to 'out', which must have room for
+/// strlen(path) bytes, and return its length.
+std::size_t fold (const char* path, char* out)
+{
+    std::size_t n = 0;
+    for (const char* p = path; *p; )
+    {
+        // Skip separators and "." segments at the start of each segment.
+        if (*p == '/' || *p == '\\') { ++p; continue; }
+        if (p[0] == '.' && (p[1] == 0 || p[1] == '/' || p[1] == '\\')) { ++p; continue; }
+
+        if (n > 0) out[n++] = '/';
+        for (; *p && *p != '/' && *p != '\\'; ++p)
+            out[n++] = (*p >= 'A' && *p <= 'Z') ? (char) (*p - 'A' + 'a') : *p;
+    }
+    return n;
+}
+
+} // namespace
+
+std::string kx::fold_path (const char* path)
+{
+    std::string folded(std::strlen(path), '\0');
+    folded.resize(fold(path, &folded[0]));
+    return folded;
+}
+
+void FoldedIndex::build (const PathIndex& exact)
+{
+    std::vector<std::pair<std::string, std::uint32_t>> keys;
+    keys.reserve(exact.size());
+    exact.enumerate("", [&](const std::string& path, std::uint32_t entry)
+    {
+        keys.emplace_back(fold_path(path.c_str()), entry);
+    });
+
+    // Order entries of the same key by index, so that the first of each
+    // key is the lowest.
+    std::sort(keys.begin(), keys.end());
+    collisions_.clear();
+    std::vector<std::string> distinct;
+    keys_.clear();
+    starts.clear();
+    entries.clear();
+    for (std::size_t i = 0; i < keys.size(); ++i)
+    {
+        if (!distinct.empty() && keys[i].first == distinct.back())
+        {
+            if (collisions_.empty() || collisions_.back() != keys[i].first)
+                collisions_.push_back(keys[i].first);
+            continue;
+        }
+        starts.push_back((std::uint32_t) keys_.size());
+        keys_ += keys[i].first;
+        entries.push_back(keys[i].second);
+        distinct.push_back(std::move(keys[i].first));
+    }
+    starts.push_back((std::uint32_t) keys_.size());
+    hash.build(distinct);
+}
+
+bool FoldedIndex::find (const char* path, std::uint32_t& entry) const
+{
+    if (entries.empty()) return false;
+
+    // Fold on the stack unless the path is unusually long.
+    std::size_t len = std::strlen(path);
+    char buffer[256];
+    std::string heap;
+    char* folded = buffer;
+    if (len > sizeof(buffer))
+    {
+        heap.resize(len);
+        folded = &heap[0];
+    }
+    len = fold(path, folded);
+
+    // Paths outside the index hash to some key too.
+    std::size_t i = hash.find(folded, len);
+    if (starts[i + 1] - starts[i] != len || std::memcmp(keys_.data() + starts[i], folded, len) != 0)
+        return false;
+    entry = entries[i];
+    return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include "pathindex.h"
+#include "perfecthash.h"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace kx
+{
+
+/// Return the folded form of a path: ASCII letters lowercased, '\' read
+/// as '/', and empty and "." segments dropped.
+std::string fold_path (const char* path);
+
+/// An index from folded paths to entries, built next to an exact index.
+///
+/// Folded keys are held in a perfect hash: a lookup folds the path on the
+/// stack, hashes it and compares the one key in its slot.
+/// When several entries fold to the same key, the key resolves to the
+/// entry that comes first in the archive, that is the lowest entry index,
+/// and the key is reported as a collision.
+class FoldedIndex : NonCopyable
+{
+public:
+
+    /// Build the index from an exact index of paths to entry indexes.
+    void build (const PathIndex& exact);
+
+    /// Look up a path by its folded form.
+    bool find (const char* path, std::uint32_t& entry) const;
+
+    /// Return the folded keys shared by several entries.
+    const std::vector<std::string>& collisions () const { return collisions_; }
+
+private:
+
+    PerfectHash hash;
+    std::string keys_; // folded keys, in the order given to the hash
+    std::vector<std::uint32_t> starts; // of each key in keys_, and its end
+    std::vector<std::uint32_t> entries; // of each key
+    std::vector<std::string> collisions_;
+};
+
+} // namespace kx
@@ -0,0 +1,220 @@
+#include "io.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <algorithm>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cerrno>
+#endif
+
+using namespace kx;
+
+// RandomAccessFile
+
+#ifdef _WIN32
+
+RandomAccessFile::RandomAccessFile ()
+    : handle(INVALID_HANDLE_VALUE), size_(0) {}
+
+RandomAccessFile::~RandomAccessFile ()
+{
+    if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+}
+
+bool RandomAccessFile::open (const char* path)
+{
+    HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size))
+    {
+        CloseHandle(h);
+        return false;
+    }
+    if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+    handle = h;
+    size_ = size.QuadPart;
+    return true;
+}
+
+bool RandomAccessFile::is_open () const
+{
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+std::size_t RandomAccessFile::read_at (std::uint64_t offset, void* buffer, std::size_t size) const
+{
+    std::size_t total = 0;
+    while (total < size)
+    {
+        OVERLAPPED ov = {};
+        std::uint64_t pos = offset + total;
+        ov.Offset = (DWORD) pos;
+        ov.OffsetHigh = (DWORD) (pos >> 32);
+        DWORD chunk = (DWORD) std::min<std::size_t>(size - total, 1u << 30);
+        DWORD n = 0;
+        if (!ReadFile(handle, (char*)buffer + total, chunk, &n, &ov) || n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+void RandomAccessFile::advise (std::uint64_t, std::uint64_t, Advice) const {}
+
+#else
+
+RandomAccessFile::RandomAccessFile ()
+    : fd(-1), size_(0) {}
+
+RandomAccessFile::~RandomAccessFile ()
+{
+    if (fd != -1) close(fd);
+}
+
+bool RandomAccessFile::open (const char* path)
+{
+    int f = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (f == -1) return false;
+    struct stat st;
+    if (fstat(f, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(f);
+        return false;
+    }
+    if (fd != -1) close(fd);
+    fd = f;
+    size_ = st.st_size;
+    return true;
+}
+
+bool RandomAccessFile::is_open () const
+{
+    return fd != -1;
+}
+
+std::size_t RandomAccessFile::read_at (std::uint64_t offset, void* buffer, std::size_t size) const
+{
+    std::size_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = pread(fd, (char*)buffer + total, size - total, (off_t) (offset + total));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+void RandomAccessFile::advise (std::uint64_t offset, std::uint64_t size, Advice advice) const
+{
+#ifdef POSIX_FADV_NORMAL
+    static const int flags[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED };
+    posix_fadvise(fd, (off_t) offset, (off_t) size, flags[advice]);
+#else
+    (void) offset;
+    (void) size;
+    (void) advice;
+#endif
+}
+
+#endif
+
+std::uint64_t RandomAccessFile::size () const
+{
+    return size_;
+}
+
+// MappedFile
+
+#ifdef _WIN32
+
+MappedFile::MappedFile ()
+    : data_(nullptr), size_(0), mapping(NULL) {}
+
+MappedFile::~MappedFile ()
+{
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping) CloseHandle(mapping);
+}
+
+bool MappedFile::open (const char* path)
+{
+    HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(h, &size) != 0;
+    HANDLE m = NULL;
+    const void* view = nullptr;
+    if (ok && size.QuadPart > 0)
+    {
+        m = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL);
+        view = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        ok = view != nullptr;
+    }
+    CloseHandle(h);
+    if (!ok)
+    {
+        if (m) CloseHandle(m);
+        return false;
+    }
+    data_ = (const std::uint8_t*) view;
+    size_ = size.QuadPart;
+    mapping = m;
+    return true;
+}
+
+#else
+
+MappedFile::MappedFile ()
+    : data_(nullptr), size_(0) {}
+
+MappedFile::~MappedFile ()
+{
+    if (data_) munmap((void*) data_, (std::size_t) size_);
+}
+
+bool MappedFile::open (const char* path)
+{
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+    void* view = nullptr;
+    if (st.st_size > 0)
+    {
+        view = mmap(nullptr, (std::size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (view == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+    }
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    data_ = (const std::uint8_t*) view;
+    size_ = st.st_size;
+    return true;
+}
+
+#endif
+
+const std::uint8_t* MappedFile::data () const
+{
+    return data_;
+}
+
+std::uint64_t MappedFile::size () const
+{
+    return size_;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include <cstdint>
+#include <cstddef>
+
+namespace kx
+{
+
+/// A read-only file supporting positional reads.
+/// Reads do not share a file pointer and may be issued from any thread.
+class RandomAccessFile : NonCopyable
+{
+public:
+
+    RandomAccessFile ();
+
+    ~RandomAccessFile ();
+
+    /// Open the given file.
+    /// Return false on failure.
+    bool open (const char* path);
+
+    bool is_open () const;
+
+    /// Return the size of the file.
+    std::uint64_t size () const;
+
+    /// Attempt to read 'size' bytes at the given offset into the buffer.
+    /// Return the number of bytes read.
+    std::size_t read_at (std::uint64_t offset, void* buffer, std::size_t size) const;
+
+    enum Advice { Normal, Sequential, Random, WillNeed };
+
+    /// Advise the system of the expected access to a range; a size of 0
+    /// extends to the end of the file. The advice applies to every user
+    /// of the file. Ignored where unsupported.
+    void advise (std::uint64_t offset, std::uint64_t size, Advice) const;
+
+private:
+
+#ifdef _WIN32
+    void* handle;
+#else
+    int fd;
+#endif
+    std::uint64_t size_;
+};
+
+/// A read-only mapping of a whole file.
+class MappedFile : NonCopyable
+{
+public:
+
+    MappedFile ();
+
+    ~MappedFile ();
+
+    /// Map the given file.
+    /// Return false on failure.
+    bool open (const char* path);
+
+    /// Return the start of the mapping. Null if the file is empty.
+    const std::uint8_t* data () const;
+
+    /// Return the size of the file.
+    std::uint64_t size () const;
+
+private:
+
+    const std::uint8_t* data_;
+    std::uint64_t size_;
+#ifdef _WIN32
+    void* mapping;
+#endif
+};
+
+} // namespace kx
@@ -0,0 +1,122 @@
+#include <file.h>
+#include <cpp/Exception.h>
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <algorithm>
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace kx;
+
+// Buffer
+
+void BufferDeleter::operator() (std::uint8_t* data) const
+{
+    if (resource)
+        resource->deallocate(data, size, 1);
+    else
+        delete[] data;
+}
+
+Buffer kx::allocate_buffer (std::size_t size, MemoryResource* resource)
+{
+    if (!resource)
+        return Buffer(new std::uint8_t[size]);
+    BufferDeleter deleter;
+    deleter.resource = resource;
+    deleter.size = size;
+    return Buffer((std::uint8_t*) resource->allocate(size, 1), deleter);
+}
+
+// ArenaResource
+
+struct ArenaResource::impl
+{
+    struct Block
+    {
+        void* data;
+        std::size_t size;
+    };
+
+    std::size_t block_size;
+    MemoryResource* upstream;
+
+    mutable std::mutex mutex;
+    std::vector<Block> blocks;
+    std::uintptr_t next = 0; // free space in the last block
+    std::uintptr_t end = 0;
+    std::size_t allocated = 0;
+
+    impl (std::size_t block_size, MemoryResource* upstream)
+        : block_size(std::max<std::size_t>(block_size, 64)), upstream(upstream) {}
+
+    ~impl () { release(); }
+
+    /// Take a block of at least 'size' bytes from upstream.
+    void grow (std::size_t size);
+
+    void release ();
+};
+
+void ArenaResource::impl::grow (std::size_t size)
+{
+    Block block;
+    block.size = std::max(size, block_size);
+    block.data = upstream ? upstream->allocate(block.size, alignof(std::max_align_t)) :
+                            ::operator new(block.size);
+    blocks.push_back(block);
+    next = (std::uintptr_t) block.data;
+    end = next + block.size;
+}
+
+void ArenaResource::impl::release ()
+{
+    for (const Block& block : blocks)
+    {
+        if (upstream)
+            upstream->deallocate(block.data, block.size, alignof(std::max_align_t));
+        else
+            ::operator delete(block.data);
+    }
+    blocks.clear();
+    next = end = 0;
+    allocated = 0;
+}
+
+ArenaResource::ArenaResource (std::size_t block_size, MemoryResource* upstream)
+    : my(new impl(block_size, upstream)) {}
+
+ArenaResource::~ArenaResource () {}
+
+void* ArenaResource::allocate (std::size_t size, std::size_t alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        throw EXCEPTION("Alignment must be a power of two");
+    std::lock_guard<std::mutex> lock(my->mutex);
+    std::uintptr_t p = (my->next + alignment - 1) & ~(std::uintptr_t) (alignment - 1);
+    if (my->blocks.empty() || p > my->end || size > my->end - p)
+    {
+        // Blocks are aligned for any type; stricter alignments take
+        // padding from the block.
+        my->grow(size + (alignment > alignof(std::max_align_t) ? alignment : 0));
+        p = (my->next + alignment - 1) & ~(std::uintptr_t) (alignment - 1);
+    }
+    my->next = p + size;
+    my->allocated += size;
+    return (void*) p;
+}
+
+void ArenaResource::release ()
+{
+    std::lock_guard<std::mutex> lock(my->mutex);
+    my->release();
+}
+
+std::size_t ArenaResource::allocated () const
+{
+    std::lock_guard<std::mutex> lock(my->mutex);
+    return my->allocated;
+}
@@ -0,0 +1,399 @@
+#include "merkle.h"
+#include "parallel.h"
+#include "pool.h"
+#include <cpp/Exception.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+
+using namespace kx;
+
+// Sha256
+
+namespace
+{
+
+const std::uint32_t K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+std::uint32_t rotr (std::uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+} // namespace
+
+Sha256::Sha256 ()
+    : length(0)
+{
+    static const std::uint32_t init[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::memcpy(state, init, sizeof(state));
+}
+
+void Sha256::compress (const std::uint8_t* block)
+{
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (block[4*i] << 24) | (block[4*i+1] << 16) | (block[4*i+2] << 8) | block[4*i+3];
+    for (int i = 16; i < 64; ++i)
+    {
+        std::uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        std::uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void Sha256::update (const void* data, std::size_t size)
+{
+    const std::uint8_t* p = (const std::uint8_t*) data;
+    std::size_t used = length % 64;
+    length += size;
+    if (used)
+    {
+        std::size_t n = std::min(size, 64 - used);
+        std::memcpy(buffer + used, p, n);
+        p += n;
+        size -= n;
+        if (used + n < 64) return;
+        compress(buffer);
+    }
+    for (; size >= 64; p += 64, size -= 64)
+        compress(p);
+    std::memcpy(buffer, p, size);
+}
+
+Digest Sha256::finish ()
+{
+    std::uint64_t bits = length * 8;
+    std::uint8_t pad[72] = { 0x80 };
+    std::size_t used = length % 64;
+    std::size_t n = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; ++i) pad[n + i] = (std::uint8_t) (bits >> (56 - 8*i));
+    update(pad, n + 8);
+    Digest digest;
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 4; ++j)
+            digest[4*i + j] = (std::uint8_t) (state[i] >> (24 - 8*j));
+    return digest;
+}
+
+Digest Sha256::hash (const void* data, std::size_t size)
+{
+    Sha256 sha;
+    sha.update(data, size);
+    return sha.finish();
+}
+
+// Merkle trees
+
+// Tree file layout, little-endian:
+//   "KXMT", version (u32), block size (u32), reserved (u32),
+//   file size (u64), then the nodes level by level, leaves first and the
+//   root last, 32 bytes each.
+// Leaves hash 0x00 followed by the block; inner nodes hash 0x01 followed
+// by their children. A node without a sibling is carried up unchanged.
+
+namespace
+{
+
+const char TREE_MAGIC[4] = { 'K', 'X', 'M', 'T' };
+const std::uint32_t TREE_VERSION = 1;
+const std::size_t TREE_HEADER_SIZE = 24;
+
+Digest leaf_hash (const std::uint8_t* data, std::size_t size)
+{
+    const std::uint8_t prefix = 0;
+    Sha256 sha;
+    sha.update(&prefix, 1);
+    sha.update(data, size);
+    return sha.finish();
+}
+
+Digest node_hash (const std::uint8_t* left, const std::uint8_t* right)
+{
+    const std::uint8_t prefix = 1;
+    Sha256 sha;
+    sha.update(&prefix, 1);
+    sha.update(left, 32);
+    sha.update(right, 32);
+    return sha.finish();
+}
+
+/// Return the number of nodes of each level, leaves first.
+std::vector<std::uint64_t> level_sizes (std::uint64_t file_size, std::uint32_t block_size)
+{
+    std::vector<std::uint64_t> sizes(1, std::max<std::uint64_t>(1, (file_size + block_size - 1) / block_size));
+    while (sizes.back() > 1)
+        sizes.push_back((sizes.back() + 1) / 2);
+    return sizes;
+}
+
+void put (std::ofstream& out, std::uint64_t value, std::size_t bytes)
+{
+    char buf[8];
+    for (std::size_t i = 0; i < bytes; ++i) buf[i] = (char) (value >> (8*i));
+    out.write(buf, bytes);
+}
+
+std::uint64_t get (const std::uint8_t* p, std::size_t bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i) value |= (std::uint64_t) p[i] << (8*i);
+    return value;
+}
+
+} // namespace
+
+Digest kx::write_merkle_tree (const Path& file, const Path& tree_file, std::size_t block_size)
+{
+    RandomAccessFile f;
+    if (!f.open(file))
+        throw EXCEPTION("Failed opening " + std::string(file));
+    if (block_size == 0 || block_size > UINT32_MAX)
+        throw EXCEPTION("Invalid Merkle tree block size");
+
+    std::vector<std::uint64_t> sizes = level_sizes(f.size(), (std::uint32_t) block_size);
+    std::vector<std::vector<Digest>> levels(sizes.size());
+
+    // Leaves are independent, so hash them in parallel.
+    levels[0].resize((std::size_t) sizes[0]);
+    std::uint64_t chunk = std::max<std::uint64_t>(1, (4 << 20) / block_size);
+    std::uint64_t chunks = (sizes[0] + chunk - 1) / chunk;
+    parallel_for((std::size_t) chunks, [&](std::size_t c)
+    {
+        std::vector<std::uint8_t> data(block_size);
+        std::uint64_t end = std::min(sizes[0], (c + 1) * chunk);
+        for (std::uint64_t i = c * chunk; i < end; ++i)
+        {
+            std::size_t n = f.read_at(i * block_size, data.data(), block_size);
+            levels[0][(std::size_t) i] = leaf_hash(data.data(), n);
+        }
+    });
+
+    for (std::size_t l = 1; l < levels.size(); ++l)
+    {
+        const std::vector<Digest>& below = levels[l-1];
+        for (std::size_t i = 0; i < below.size(); i += 2)
+            levels[l].push_back(i + 1 < below.size() ? node_hash(below[i].data(), below[i+1].data()) : below[i]);
+    }
+
+    std::ofstream out(tree_file, std::ios::binary);
+    out.write(TREE_MAGIC, sizeof(TREE_MAGIC));
+    put(out, TREE_VERSION, 4);
+    put(out, block_size, 4);
+    put(out, 0, 4);
+    put(out, f.size(), 8);
+    for (const auto& level : levels)
+        for (const Digest& d : level)
+            out.write((const char*) d.data(), d.size());
+    if (!out)
+        throw EXCEPTION("Failed writing Merkle tree " + std::string(tree_file));
+    return levels.back()[0];
+}
+
+// MerkleVerifier
+
+struct MerkleVerifier::impl
+{
+    std::vector<Digest> nodes; // copied from the tree file, which may change
+    std::uint32_t block_size;
+    std::uint64_t file_size;
+    std::vector<std::uint64_t> sizes; // nodes per level
+    std::vector<std::uint64_t> starts; // index of the first node of each level
+    std::unique_ptr<std::atomic<bool>[]> authentic; // per node
+    std::unique_ptr<std::atomic<bool>[]> verified; // per block
+};
+
+MerkleVerifier::MerkleVerifier (const char* tree_file, std::uint64_t file_size, const Digest* expected_root)
+    : my(new impl)
+{
+    MappedFile tree;
+    if (!tree.open(tree_file) || tree.size() < TREE_HEADER_SIZE ||
+        std::memcmp(tree.data(), TREE_MAGIC, sizeof(TREE_MAGIC)) != 0 ||
+        get(tree.data() + 4, 4) != TREE_VERSION)
+        throw EXCEPTION("Failed loading Merkle tree " + std::string(tree_file));
+
+    my->block_size = (std::uint32_t) get(tree.data() + 8, 4);
+    my->file_size = get(tree.data() + 16, 8);
+    if (my->file_size != file_size || my->block_size == 0)
+        throw EXCEPTION("Merkle tree " + std::string(tree_file) + " does not match its file");
+
+    my->sizes = level_sizes(file_size, my->block_size);
+    std::uint64_t nodes = 0;
+    for (std::uint64_t n : my->sizes)
+    {
+        my->starts.push_back(nodes);
+        nodes += n;
+    }
+    if (tree.size() != TREE_HEADER_SIZE + nodes * 32)
+        throw EXCEPTION("Corrupt Merkle tree " + std::string(tree_file));
+
+    // Nodes are marked authentic once checked, so they must not change
+    // afterwards: copy them rather than reading the mapping again.
+    my->nodes.resize((std::size_t) nodes);
+    std::memcpy(my->nodes.data(), tree.data() + TREE_HEADER_SIZE, (std::size_t) nodes * 32);
+
+    my->authentic.reset(new std::atomic<bool>[(std::size_t) nodes]);
+    for (std::uint64_t i = 0; i < nodes; ++i) my->authentic[(std::size_t) i] = false;
+    my->verified.reset(new std::atomic<bool>[(std::size_t) my->sizes[0]]);
+    for (std::uint64_t i = 0; i < my->sizes[0]; ++i) my->verified[(std::size_t) i] = false;
+
+    // The root is trusted if it matches the expected one. Without an
+    // expected root the tree only guards against corruption.
+    const std::uint8_t* root = node(my->sizes.size() - 1, 0);
+    if (expected_root && std::memcmp(root, expected_root->data(), 32) != 0)
+        throw EXCEPTION("Merkle tree " + std::string(tree_file) + " does not match the expected root");
+    my->authentic[(std::size_t) (nodes - 1)] = true;
+}
+
+MerkleVerifier::~MerkleVerifier () {}
+
+const std::uint8_t* MerkleVerifier::node (std::size_t level, std::uint64_t index) const
+{
+    return my->nodes[(std::size_t) (my->starts[level] + index)].data();
+}
+
+bool MerkleVerifier::authenticate (std::size_t level, std::uint64_t index)
+{
+    // Walk up until a node known to be authentic, then mark the path.
+    std::vector<std::pair<std::size_t, std::uint64_t>> path;
+    for (; !my->authentic[(std::size_t) (my->starts[level] + index)]; ++level, index /= 2)
+    {
+        std::uint64_t first = index & ~1ull;
+        const std::uint8_t* parent = node(level + 1, index / 2);
+        if (first + 1 < my->sizes[level])
+        {
+            Digest d = node_hash(node(level, first), node(level, first + 1));
+            if (std::memcmp(d.data(), parent, 32) != 0) return false;
+        }
+        else if (std::memcmp(node(level, index), parent, 32) != 0)
+            return false;
+        path.push_back(std::make_pair(level, index));
+    }
+    for (const auto& n : path)
+        my->authentic[(std::size_t) (my->starts[n.first] + n.second)] = true;
+    return true;
+}
+
+void MerkleVerifier::check (std::uint64_t block, const std::uint8_t* data, std::size_t size)
+{
+    Digest d = leaf_hash(data, size);
+    if (std::memcmp(d.data(), node(0, block), 32) != 0 || !authenticate(0, block))
+    {
+        std::ostringstream os;
+        os << "Integrity check failed for block " << block;
+        throw EXCEPTION(os);
+    }
+    my->verified[(std::size_t) block] = true;
+}
+
+std::size_t MerkleVerifier::read_at (const RandomAccessFile& file, std::uint64_t offset, void* buffer, std::size_t size)
+{
+    return read_blocks(offset, buffer, size, [&](std::uint64_t at, std::uint8_t* out, std::size_t n)
+    {
+        return file.read_at(at, out, n);
+    });
+}
+
+std::size_t MerkleVerifier::read_at (const std::uint8_t* file, std::uint64_t offset, void* buffer, std::size_t size)
+{
+    return read_blocks(offset, buffer, size, [&](std::uint64_t at, std::uint8_t* out, std::size_t n)
+    {
+        std::memcpy(out, file + at, n);
+        return n;
+    });
+}
+
+std::size_t MerkleVerifier::read_blocks (std::uint64_t offset, void* buffer, std::size_t size,
+                                         const std::function<std::size_t (std::uint64_t, std::uint8_t*, std::size_t)>& read)
+{
+    if (size == 0 || offset >= my->file_size) return 0;
+    size = (std::size_t) std::min<std::uint64_t>(size, my->file_size - offset);
+    std::uint64_t bs = my->block_size;
+    std::uint64_t first = offset / bs;
+    std::uint64_t last = (offset + size - 1) / bs;
+
+    // The file may change after a block was checked, so every block is
+    // hashed again and only the hashed bytes are returned. Reads of whole
+    // blocks are hashed in place; others go through a buffer.
+    std::uint64_t start = first * bs;
+    std::uint64_t end = std::min((last + 1) * bs, my->file_size);
+    bool aligned = start == offset && end == offset + size;
+    PooledBuffer copy(aligned ? 0 : (std::size_t) (end - start));
+    std::uint8_t* data = aligned ? (std::uint8_t*) buffer : copy.data();
+    if (read(start, data, (std::size_t) (end - start)) != end - start)
+        throw EXCEPTION("Failed reading block for verification");
+    for (std::uint64_t b = first; b <= last; ++b)
+    {
+        std::uint64_t block_start = (b - first) * bs;
+        check(b, data + block_start, (std::size_t) std::min<std::uint64_t>(bs, end - start - block_start));
+    }
+    if (!aligned) std::memcpy(buffer, data + (offset - start), size);
+    return size;
+}
+
+void MerkleVerifier::verify (const std::uint8_t* file, std::uint64_t offset, std::uint64_t size)
+{
+    if (size == 0 || offset >= my->file_size) return;
+    std::uint64_t bs = my->block_size;
+    std::uint64_t last = (std::min(offset + size, my->file_size) - 1) / bs;
+    for (std::uint64_t b = offset / bs; b <= last; ++b)
+    {
+        if (my->verified[(std::size_t) b]) continue;
+        check(b, file + b * bs, (std::size_t) std::min<std::uint64_t>(bs, my->file_size - b * bs));
+    }
+}
+
+void MerkleVerifier::verify_all (const RandomAccessFile& file)
+{
+    std::uint64_t blocks = my->sizes[0];
+    std::uint64_t chunk = std::max<std::uint64_t>(1, (4 << 20) / my->block_size);
+    parallel_for((std::size_t) ((blocks + chunk - 1) / chunk), [&](std::size_t c)
+    {
+        std::vector<std::uint8_t> data(my->block_size);
+        std::uint64_t end = std::min(blocks, (c + 1) * chunk);
+        for (std::uint64_t b = c * chunk; b < end; ++b)
+        {
+            if (my->verified[(std::size_t) b]) continue;
+            std::size_t n = file.read_at(b * my->block_size, data.data(), data.size());
+            check(b, data.data(), n);
+        }
+    });
+}
+
+void MerkleVerifier::verify_all (const std::uint8_t* file)
+{
+    std::uint64_t chunk = std::max<std::uint64_t>(my->block_size, 4 << 20);
+    parallel_for((std::size_t) ((my->file_size + chunk - 1) / chunk), [&](std::size_t c)
+    {
+        verify(file, c * chunk, chunk);
+    });
+}
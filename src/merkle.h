@@ -0,0 +1,101 @@
+#pragma once
+
+#include <file.h>
+#include "io.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace kx
+{
+
+/// SHA-256.
+class Sha256
+{
+public:
+
+    Sha256 ();
+
+    void update (const void* data, std::size_t size);
+
+    Digest finish ();
+
+    static Digest hash (const void* data, std::size_t size);
+
+private:
+
+    void compress (const std::uint8_t* block);
+
+    std::uint32_t state[8];
+    std::uint8_t buffer[64];
+    std::uint64_t length;
+};
+
+/// Verifies blocks of a file against a Merkle tree written by
+/// write_merkle_tree().
+///
+/// The tree is copied into memory when it is loaded, and only its root
+/// is checked then. The path from a block to the root is checked when
+/// the block is first read, but the block itself is hashed on every
+/// read, and the bytes hashed are the bytes returned: a file changed
+/// after a block was checked is caught, and so is a tree file changed
+/// after it was loaded.
+class MerkleVerifier : NonCopyable
+{
+public:
+
+    /// Load the tree of a file of the given size.
+    /// Throw an exception if the tree does not match the file size, its
+    /// root does not match its nodes, or the root differs from
+    /// 'expected_root'.
+    MerkleVerifier (const char* tree_file, std::uint64_t file_size, const Digest* expected_root);
+
+    ~MerkleVerifier ();
+
+    /// Attempt to read 'size' bytes at 'offset', verifying the blocks that
+    /// cover them.
+    /// Return the number of bytes read.
+    /// Throw an exception if a block fails verification.
+    std::size_t read_at (const RandomAccessFile&, std::uint64_t offset, void* buffer, std::size_t size);
+
+    /// Copy 'size' bytes at 'offset' out of a mapped file, verifying the
+    /// copies of the blocks that cover them.
+    /// Return the number of bytes copied.
+    /// Throw an exception if a block fails verification.
+    std::size_t read_at (const std::uint8_t* file, std::uint64_t offset, void* buffer, std::size_t size);
+
+    /// Verify the blocks covering a range of a mapped file.
+    /// Throw an exception if a block fails verification.
+    void verify (const std::uint8_t* file, std::uint64_t offset, std::uint64_t size);
+
+    /// Verify every block not verified yet, in parallel.
+    /// Throw an exception if a block fails verification.
+    void verify_all (const RandomAccessFile&);
+
+    /// Verify every block of a mapped file not verified yet, in parallel.
+    /// Throw an exception if a block fails verification.
+    void verify_all (const std::uint8_t* file);
+
+private:
+
+    /// Read whole blocks with 'read' and hash each of them.
+    std::size_t read_blocks (std::uint64_t offset, void* buffer, std::size_t size,
+                             const std::function<std::size_t (std::uint64_t, std::uint8_t*, std::size_t)>& read);
+
+    /// Check a block's contents against its leaf, authenticating the
+    /// leaf on the way.
+    void check (std::uint64_t block, const std::uint8_t* data, std::size_t size);
+
+    /// Check the path from a node up to an authenticated node.
+    bool authenticate (std::size_t level, std::uint64_t index);
+
+    const std::uint8_t* node (std::size_t level, std::uint64_t index) const;
+
+    struct impl;
+    std::unique_ptr<impl> my;
+};
+
+} // namespace kx
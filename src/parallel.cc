@@ -0,0 +1,136 @@
+#include "parallel.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <algorithm>
+
+using namespace kx;
+
+namespace
+{
+
+/// A call to parallel_for, on the caller's stack.
+struct Job
+{
+    const std::function<void (std::size_t)>* f;
+    std::size_t count;
+    std::atomic<std::size_t> next;
+    std::atomic<std::size_t> finished;
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+    unsigned workers = 0; // pool threads inside run(); guarded by the pool mutex
+
+    Job (const std::function<void (std::size_t)>& f, std::size_t count)
+        : f(&f), count(count), next(0), finished(0), failed(false) {}
+};
+
+struct Pool
+{
+    std::mutex mutex;
+    std::condition_variable work; // a job was queued
+    std::condition_variable done; // a job may have finished
+    std::deque<Job*> jobs; // jobs with indices left to claim
+    unsigned threads = 0;
+
+    /// Claim and run indices of the job until none are left.
+    void run (Job& job)
+    {
+        for (std::size_t i; (i = job.next.fetch_add(1)) < job.count; )
+        {
+            // Indices left after a failure are skipped, but still counted.
+            if (!job.failed)
+            {
+                try { (*job.f)(i); }
+                catch (...)
+                {
+                    if (!job.failed.exchange(true)) job.error = std::current_exception();
+                }
+            }
+            if (job.finished.fetch_add(1) + 1 == job.count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+    }
+
+    void worker ()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            work.wait(lock, [this]() { return !jobs.empty(); });
+            Job* job = jobs.front();
+            if (job->next >= job->count)
+            {
+                jobs.pop_front();
+                continue;
+            }
+            ++job->workers;
+            lock.unlock();
+            run(*job);
+            lock.lock();
+            if (--job->workers == 0) done.notify_all();
+        }
+    }
+};
+
+// Never destroyed: its threads wait on it for the life of the process.
+Pool& pool ()
+{
+    static Pool* instance = []()
+    {
+        Pool* p = new Pool;
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        // Threads that fail to start leave a smaller pool; callers still
+        // do the work themselves.
+        for (unsigned t = 1; t < cores; ++t)
+        {
+            try
+            {
+                std::thread(&Pool::worker, p).detach();
+                ++p->threads;
+            }
+            catch (const std::system_error&)
+            {
+                break;
+            }
+        }
+        return p;
+    }();
+    return *instance;
+}
+
+} // namespace
+
+void kx::parallel_for (std::size_t count, const std::function<void (std::size_t)>& f)
+{
+    Pool& p = pool();
+    if (count <= 1 || p.threads == 0)
+    {
+        for (std::size_t i = 0; i < count; ++i) f(i);
+        return;
+    }
+
+    Job job(f, count);
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.jobs.push_back(&job);
+    }
+    p.work.notify_all();
+    p.run(job);
+
+    // The job lives on this stack: wait until no pool thread can reach it.
+    {
+        std::unique_lock<std::mutex> lock(p.mutex);
+        auto it = std::find(p.jobs.begin(), p.jobs.end(), &job);
+        if (it != p.jobs.end()) p.jobs.erase(it);
+        p.done.wait(lock, [&]() { return job.finished == job.count && job.workers == 0; });
+    }
+    if (job.error) std::rethrow_exception(job.error);
+}
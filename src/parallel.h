@@ -0,0 +1,15 @@
+#pragma once
+
+#include <functional>
+#include <cstddef>
+
+namespace kx
+{
+
+/// Call f(i) for every i in [0, count) on a pool of one thread per core,
+/// started once and shared by all callers. The calling thread takes part
+/// in the work, so calls may nest and still finish if the pool is busy.
+/// The first exception thrown by f is rethrown once all calls finish.
+void parallel_for (std::size_t count, const std::function<void (std::size_t)>& f);
+
+} // namespace kx
@@ -0,0 +1,256 @@
+#include "pathindex.h"
+#include <cpp/Exception.h>
+
+#include <algorithm>
+
+#include <cstring>
+
+using namespace kx;
+
+// Image layout, little-endian:
+//   "KXPI", version (u32), path count (u64), block count (u64),
+//   block offsets into the data (u64 each), values in path order (u32 each),
+//   then the blocks. A block holds up to BLOCK paths: the first as its
+//   length (varint) and bytes, the others as the length of the prefix
+//   shared with the previous path (varint), the length of the rest
+//   (varint) and the rest.
+
+namespace
+{
+
+const char MAGIC[4] = { 'K', 'X', 'P', 'I' };
+const std::uint32_t VERSION = 1;
+const std::size_t HEADER_SIZE = 24;
+const std::size_t BLOCK = 16;
+
+std::uint64_t get (const std::uint8_t* p, std::size_t bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i) value |= (std::uint64_t) p[i] << (8*i);
+    return value;
+}
+
+void put (std::vector<std::uint8_t>& out, std::uint64_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i) out.push_back((std::uint8_t) (value >> (8*i)));
+}
+
+void put_varint (std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7) out.push_back((std::uint8_t) (value | 0x80));
+    out.push_back((std::uint8_t) value);
+}
+
+/// Decode the varint at 'p', advancing it.
+/// Throw an exception if the varint runs past 'end'.
+std::size_t get_varint (const std::uint8_t*& p, const std::uint8_t* end)
+{
+    std::size_t value = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        if (p >= end)
+            throw EXCEPTION("Corrupt path index");
+        std::uint8_t byte = *p++;
+        value |= (std::size_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80) || shift > 28) return value;
+    }
+}
+
+/// Compare a path with a string of known length, as std::string does.
+int compare (const std::string& a, const char* b, std::size_t len)
+{
+    int c = std::memcmp(a.data(), b, std::min(a.size(), len));
+    if (c != 0) return c;
+    return a.size() < len ? -1 : a.size() > len ? 1 : 0;
+}
+
+} // namespace
+
+PathIndex::PathIndex ()
+    : image_(nullptr), image_size_(0), count(0), blocks(0),
+      offsets(nullptr), values(nullptr), data(nullptr) {}
+
+void PathIndex::build (std::vector<std::pair<std::string, std::uint32_t>>& paths)
+{
+    std::stable_sort(paths.begin(), paths.end(),
+                     [](const std::pair<std::string, std::uint32_t>& a, const std::pair<std::string, std::uint32_t>& b)
+                     {
+                         return a.first < b.first;
+                     });
+
+    std::vector<std::uint8_t> blob;
+    std::vector<std::uint64_t> starts;
+    std::vector<std::uint32_t> values_;
+    values_.reserve(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        const std::string& path = paths[i].first;
+        if (i > 0 && path == paths[i - 1].first) continue;
+        values_.push_back(paths[i].second);
+        if ((values_.size() - 1) % BLOCK == 0)
+        {
+            starts.push_back(blob.size());
+            put_varint(blob, path.size());
+            blob.insert(blob.end(), path.begin(), path.end());
+            continue;
+        }
+        const std::string& previous = paths[i - 1].first;
+        std::size_t shared = 0;
+        std::size_t limit = std::min(previous.size(), path.size());
+        while (shared < limit && previous[shared] == path[shared]) ++shared;
+        put_varint(blob, shared);
+        put_varint(blob, path.size() - shared);
+        blob.insert(blob.end(), path.begin() + shared, path.end());
+    }
+
+    std::shared_ptr<std::vector<std::uint8_t>> image(new std::vector<std::uint8_t>);
+    image->reserve(HEADER_SIZE + starts.size() * 8 + values_.size() * 4 + blob.size());
+    image->insert(image->end(), MAGIC, MAGIC + sizeof(MAGIC));
+    put(*image, VERSION, 4);
+    put(*image, values_.size(), 8);
+    put(*image, starts.size(), 8);
+    for (std::uint64_t start : starts) put(*image, start, 8);
+    for (std::uint32_t value : values_) put(*image, value, 4);
+    image->insert(image->end(), blob.begin(), blob.end());
+
+    const std::uint8_t* p = image->data();
+    std::size_t size = image->size();
+    assign(image, p, size);
+}
+
+bool PathIndex::assign (std::shared_ptr<const void> owner_, const std::uint8_t* image, std::size_t size)
+{
+    if (size < HEADER_SIZE || std::memcmp(image, MAGIC, sizeof(MAGIC)) != 0 || get(image + 4, 4) != VERSION)
+        return false;
+    std::uint64_t count_ = get(image + 8, 8);
+    std::uint64_t blocks_ = get(image + 16, 8);
+    if (blocks_ != (count_ + BLOCK - 1) / BLOCK || blocks_ > size / 8 || count_ > size / 4 ||
+        HEADER_SIZE + blocks_ * 8 + count_ * 4 > size)
+        return false;
+
+    const std::uint8_t* offsets_ = image + HEADER_SIZE;
+    const std::uint8_t* values_ = offsets_ + blocks_ * 8;
+    const std::uint8_t* data_ = values_ + count_ * 4;
+    std::uint64_t data_size = size - (data_ - image);
+    for (std::uint64_t b = 0; b < blocks_; ++b)
+        if (get(offsets_ + b * 8, 8) >= data_size) return false;
+
+    owner = std::move(owner_);
+    image_ = image;
+    image_size_ = size;
+    count = (std::size_t) count_;
+    blocks = (std::size_t) blocks_;
+    offsets = offsets_;
+    values = values_;
+    data = data_;
+    return true;
+}
+
+void PathIndex::swap (PathIndex& other)
+{
+    std::swap(owner, other.owner);
+    std::swap(image_, other.image_);
+    std::swap(image_size_, other.image_size_);
+    std::swap(count, other.count);
+    std::swap(blocks, other.blocks);
+    std::swap(offsets, other.offsets);
+    std::swap(values, other.values);
+    std::swap(data, other.data);
+}
+
+std::uint64_t PathIndex::block_offset (std::size_t block) const
+{
+    return get(offsets + block * 8, 8);
+}
+
+void PathIndex::next (std::size_t position, std::string& current, const std::uint8_t*& p) const
+{
+    const std::uint8_t* end = image_ + image_size_;
+    if (position % BLOCK == 0)
+    {
+        p = data + block_offset(position / BLOCK);
+        std::size_t len = get_varint(p, end);
+        if (len > (std::size_t) (end - p))
+            throw EXCEPTION("Corrupt path index");
+        current.assign((const char*) p, len);
+        p += len;
+        return;
+    }
+    std::size_t shared = get_varint(p, end);
+    std::size_t len = get_varint(p, end);
+    if (shared > current.size() || len > (std::size_t) (end - p))
+        throw EXCEPTION("Corrupt path index");
+    current.resize(shared);
+    current.append((const char*) p, len);
+    p += len;
+}
+
+std::size_t PathIndex::seek (const char* path, std::size_t len, std::string& current, const std::uint8_t*& p) const
+{
+    // Find the last block whose first path is not after 'path'.
+    std::size_t lo = 0, hi = blocks;
+    while (hi - lo > 1)
+    {
+        std::size_t mid = lo + (hi - lo) / 2;
+        next(mid * BLOCK, current, p);
+        if (compare(current, path, len) <= 0) lo = mid;
+        else hi = mid;
+    }
+    next(lo * BLOCK, current, p);
+    return lo * BLOCK;
+}
+
+bool PathIndex::find (const char* path, std::uint32_t& value_) const
+{
+    if (count == 0) return false;
+    std::size_t len = std::strlen(path);
+    std::string current;
+    const std::uint8_t* p;
+    std::size_t position = seek(path, len, current, p);
+    std::size_t end = std::min(count, position + BLOCK);
+    for (;;)
+    {
+        int c = compare(current, path, len);
+        if (c == 0)
+        {
+            value_ = value(position);
+            return true;
+        }
+        if (c > 0 || ++position == end) return false;
+        next(position, current, p);
+    }
+}
+
+void PathIndex::enumerate (const char* prefix, const Callback& f) const
+{
+    if (count == 0) return;
+    std::size_t len = std::strlen(prefix);
+    std::string current;
+    const std::uint8_t* p;
+    std::size_t position = seek(prefix, len, current, p);
+    for (;;)
+    {
+        int c = compare(current, prefix, len);
+        if (c >= 0)
+        {
+            if (current.compare(0, len, prefix, len) != 0) return;
+            f(current, value(position));
+        }
+        if (++position == count) return;
+        next(position, current, p);
+    }
+}
+
+std::string PathIndex::path (std::size_t position) const
+{
+    std::string current;
+    const std::uint8_t* p;
+    for (std::size_t i = position - position % BLOCK; i <= position; ++i)
+        next(i, current, p);
+    return current;
+}
+
+std::uint32_t PathIndex::value (std::size_t position) const
+{
+    return (std::uint32_t) get(values + position * 4, 4);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+namespace kx
+{
+
+/// A compact, sorted index of paths to 32-bit values.
+///
+/// Paths are sorted and front-coded in blocks of 16: the first path of a
+/// block is stored whole, the others as the length of the prefix shared
+/// with the previous path followed by the rest. Lookups binary search the
+/// blocks, then decode one block.
+/// The index is a single position-independent image that can be saved
+/// and used again straight from a mapping of the file.
+class PathIndex : NonCopyable
+{
+public:
+
+    using Callback = std::function<void (const std::string& path, std::uint32_t value)>;
+
+    PathIndex ();
+
+    /// Build the index, sorting 'paths' by path in place.
+    /// Of paths given more than once, the first is kept.
+    void build (std::vector<std::pair<std::string, std::uint32_t>>& paths);
+
+    /// Use an image held elsewhere, kept alive by 'owner'.
+    /// Return false if the image is not valid.
+    bool assign (std::shared_ptr<const void> owner, const std::uint8_t* image, std::size_t size);
+
+    void swap (PathIndex&);
+
+    /// Return the image of the index.
+    const std::uint8_t* image () const { return image_; }
+
+    std::size_t image_size () const { return image_size_; }
+
+    /// Return the number of paths.
+    std::size_t size () const { return count; }
+
+    bool find (const char* path, std::uint32_t& value) const;
+
+    /// Call 'f' for every path starting with 'prefix', in sorted order.
+    void enumerate (const char* prefix, const Callback& f) const;
+
+    /// Return the path and value at a position in sorted order.
+    std::string path (std::size_t position) const;
+
+    std::uint32_t value (std::size_t position) const;
+
+private:
+
+    /// Return the position of the first path of the block that may hold
+    /// 'path', and decode that path.
+    std::size_t seek (const char* path, std::size_t len, std::string& current, const std::uint8_t*& p) const;
+
+    /// Decode the path at 'position' following 'current', advancing 'p'.
+    void next (std::size_t position, std::string& current, const std::uint8_t*& p) const;
+
+    std::uint64_t block_offset (std::size_t block) const;
+
+    std::shared_ptr<const void> owner;
+    const std::uint8_t* image_;
+    std::size_t image_size_;
+    std::size_t count;
+    std::size_t blocks;
+    const std::uint8_t* offsets; // per block, into 'data'
+    const std::uint8_t* values; // per path, in sorted order
+    const std::uint8_t* data;
+};
+
+} // namespace kx
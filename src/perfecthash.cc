@@ -0,0 +1,201 @@
+#include "perfecthash.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+using namespace kx;
+
+// Image layout, little-endian:
+//   "KXPH", version (u32), key count (u64), bucket count (u64), seed (u64),
+//   then the pilot of each bucket (u32 each),
+//   then the key in each slot (u32 each).
+
+namespace
+{
+
+const char MAGIC[4] = { 'K', 'X', 'P', 'H' };
+const std::uint32_t VERSION = 1;
+const std::size_t HEADER_SIZE = 32;
+const std::size_t BUCKET_KEYS = 4;
+
+// Pilots tried per bucket before building again with another seed.
+const std::uint32_t MAX_PILOT = 1u << 31;
+
+std::uint64_t get (const std::uint8_t* p, std::size_t bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i) value |= (std::uint64_t) p[i] << (8*i);
+    return value;
+}
+
+void put (std::vector<std::uint8_t>& out, std::uint64_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i) out.push_back((std::uint8_t) (value >> (8*i)));
+}
+
+/// The splitmix64 finaliser.
+std::uint64_t mix (std::uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/// Hash a key. Words are read little-endian so that images hash the same
+/// on every host.
+std::uint64_t hash (const char* key, std::size_t len, std::uint64_t seed)
+{
+    const std::uint8_t* p = (const std::uint8_t*) key;
+    std::uint64_t h = mix(seed ^ len);
+    for (; len >= 8; p += 8, len -= 8) h = mix(h ^ get(p, 8));
+    if (len > 0) h = mix(h ^ get(p, len));
+    return h;
+}
+
+std::size_t bucket_of (std::uint64_t h, std::size_t buckets)
+{
+    return (std::size_t) (((h >> 32) * buckets) >> 32);
+}
+
+std::size_t slot_of (std::uint64_t h, std::uint32_t pilot, std::uint64_t seed, std::size_t count)
+{
+    return (std::size_t) (mix(h ^ mix(seed + pilot)) % count);
+}
+
+} // namespace
+
+PerfectHash::PerfectHash ()
+    : image_(nullptr), image_size_(0), count(0), buckets(0), seed(0), pilots(nullptr), keys(nullptr) {}
+
+void PerfectHash::build (const std::vector<std::string>& keys)
+{
+    std::size_t n = keys.size();
+    std::size_t b = (n + BUCKET_KEYS - 1) / BUCKET_KEYS;
+    std::vector<std::uint64_t> hashes(n);
+    std::vector<std::uint32_t> pilots_(b);
+    std::vector<std::uint32_t> keys_(n);
+    std::uint64_t seed_ = 0;
+    for (std::uint64_t attempt = 1; n > 0; ++attempt)
+    {
+        seed_ = mix(attempt);
+        for (std::size_t i = 0; i < n; ++i)
+            hashes[i] = hash(keys[i].data(), keys[i].size(), seed_);
+
+        // Group the keys by bucket.
+        std::vector<std::uint32_t> starts(b + 1, 0);
+        for (std::uint64_t h : hashes) ++starts[bucket_of(h, b) + 1];
+        for (std::size_t k = 0; k < b; ++k) starts[k + 1] += starts[k];
+        std::vector<std::uint32_t> members(n);
+        std::vector<std::uint32_t> fill(starts.begin(), starts.end() - 1);
+        for (std::size_t i = 0; i < n; ++i) members[fill[bucket_of(hashes[i], b)]++] = (std::uint32_t) i;
+
+        // Place the largest buckets first, while most slots are free.
+        std::vector<std::uint32_t> order(b);
+        for (std::size_t k = 0; k < b; ++k) order[k] = (std::uint32_t) k;
+        std::stable_sort(order.begin(), order.end(), [&](std::uint32_t x, std::uint32_t y)
+        {
+            return starts[x + 1] - starts[x] > starts[y + 1] - starts[y];
+        });
+
+        std::vector<bool> taken(n, false);
+        std::vector<std::size_t> slots;
+        bool placed = true;
+        for (std::uint32_t k : order)
+        {
+            std::uint32_t first = starts[k], last = starts[k + 1];
+            if (first == last) break;
+
+            // Keys of equal hashes cannot be told apart by any pilot.
+            for (std::uint32_t m = first; m < last && placed; ++m)
+                for (std::uint32_t o = first; o < m && placed; ++o)
+                    placed = hashes[members[m]] != hashes[members[o]];
+            if (!placed) break;
+
+            std::uint32_t pilot = 0;
+            for (; pilot < MAX_PILOT; ++pilot)
+            {
+                slots.clear();
+                bool free = true;
+                for (std::uint32_t m = first; m < last && free; ++m)
+                {
+                    std::size_t s = slot_of(hashes[members[m]], pilot, seed_, n);
+                    free = !taken[s] && std::find(slots.begin(), slots.end(), s) == slots.end();
+                    slots.push_back(s);
+                }
+                if (free) break;
+            }
+            if (pilot == MAX_PILOT)
+            {
+                placed = false;
+                break;
+            }
+            pilots_[k] = pilot;
+            for (std::size_t j = 0; j < slots.size(); ++j)
+            {
+                taken[slots[j]] = true;
+                keys_[slots[j]] = members[first + j];
+            }
+        }
+        if (placed) break;
+    }
+
+    std::shared_ptr<std::vector<std::uint8_t>> image(new std::vector<std::uint8_t>);
+    image->reserve(HEADER_SIZE + b * 4 + n * 4);
+    image->insert(image->end(), MAGIC, MAGIC + sizeof(MAGIC));
+    put(*image, VERSION, 4);
+    put(*image, n, 8);
+    put(*image, b, 8);
+    put(*image, seed_, 8);
+    for (std::uint32_t pilot : pilots_) put(*image, pilot, 4);
+    for (std::uint32_t key : keys_) put(*image, key, 4);
+
+    const std::uint8_t* p = image->data();
+    std::size_t size = image->size();
+    assign(image, p, size);
+}
+
+bool PerfectHash::assign (std::shared_ptr<const void> owner_, const std::uint8_t* image, std::size_t size)
+{
+    if (size < HEADER_SIZE || std::memcmp(image, MAGIC, sizeof(MAGIC)) != 0 || get(image + 4, 4) != VERSION)
+        return false;
+    std::uint64_t count_ = get(image + 8, 8);
+    std::uint64_t buckets_ = get(image + 16, 8);
+    if (buckets_ != (count_ + BUCKET_KEYS - 1) / BUCKET_KEYS || count_ > (size - HEADER_SIZE) / 4 ||
+        HEADER_SIZE + (buckets_ + count_) * 4 != size)
+        return false;
+    const std::uint8_t* keys_ = image + HEADER_SIZE + buckets_ * 4;
+    for (std::uint64_t s = 0; s < count_; ++s)
+        if (get(keys_ + s * 4, 4) >= count_) return false;
+
+    owner = std::move(owner_);
+    image_ = image;
+    image_size_ = size;
+    count = (std::size_t) count_;
+    buckets = (std::size_t) buckets_;
+    seed = get(image + 24, 8);
+    pilots = image + HEADER_SIZE;
+    keys = keys_;
+    return true;
+}
+
+void PerfectHash::swap (PerfectHash& other)
+{
+    std::swap(owner, other.owner);
+    std::swap(image_, other.image_);
+    std::swap(image_size_, other.image_size_);
+    std::swap(count, other.count);
+    std::swap(buckets, other.buckets);
+    std::swap(seed, other.seed);
+    std::swap(pilots, other.pilots);
+    std::swap(keys, other.keys);
+}
+
+std::size_t PerfectHash::find (const char* key, std::size_t len) const
+{
+    std::uint64_t h = hash(key, len, seed);
+    std::uint32_t pilot = (std::uint32_t) get(pilots + bucket_of(h, buckets) * 4, 4);
+    return (std::size_t) get(keys + slot_of(h, pilot, seed, count) * 4, 4);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace kx
+{
+
+/// A minimal perfect hash of a fixed set of keys.
+///
+/// Keys are hashed into buckets of about four; each bucket stores the
+/// pilot that displaces its keys to slots no other key takes, so the n
+/// keys map to the n slots [0, n) one to one, and each slot holds the
+/// index of its key. A key outside the set maps to some key as well, so
+/// callers compare the key found.
+/// Like PathIndex, the hash is a single image that can be used straight
+/// from a mapping of a file.
+class PerfectHash : NonCopyable
+{
+public:
+
+    PerfectHash ();
+
+    /// Build the hash of distinct keys.
+    void build (const std::vector<std::string>& keys);
+
+    /// Use an image held elsewhere, kept alive by 'owner'.
+    /// Return false if the image is not valid.
+    bool assign (std::shared_ptr<const void> owner, const std::uint8_t* image, std::size_t size);
+
+    void swap (PerfectHash&);
+
+    const std::uint8_t* image () const { return image_; }
+
+    std::size_t image_size () const { return image_size_; }
+
+    /// Return the number of keys.
+    std::size_t size () const { return count; }
+
+    /// Return the index of a key in the keys given to build().
+    /// Undefined for an empty hash.
+    std::size_t find (const char* key, std::size_t len) const;
+
+private:
+
+    std::shared_ptr<const void> owner;
+    const std::uint8_t* image_;
+    std::size_t image_size_;
+    std::size_t count;
+    std::size_t buckets;
+    std::uint64_t seed;
+    const std::uint8_t* pilots; // per bucket
+    const std::uint8_t* keys; // per slot
+};
+
+} // namespace kx
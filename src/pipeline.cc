@@ -0,0 +1,146 @@
+#include <file.h>
+#include <cpp/Exception.h>
+#include "merkle.h"
+#include "queue.h"
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+using namespace kx;
+
+namespace
+{
+
+/// A file on its way through the pipeline.
+struct Job
+{
+    LoadResult result;
+    std::function<FileHandler* ()> decode; // set by the read stage
+};
+
+/// Run 'work' on each job of a stage; jobs that already failed pass
+/// through, and exceptions fail the job.
+template <typename F>
+void run (Job& job, F work)
+{
+    if (job.result.error) return;
+    try
+    {
+        work(job);
+    }
+    catch (...)
+    {
+        job.result.error = std::current_exception();
+        job.result.data.reset();
+        job.result.size = 0;
+    }
+}
+
+} // namespace
+
+void FileSystem::load_pipeline (const std::vector<FilePath>& paths, const PipelineOptions& options,
+                                const std::function<void (LoadResult&&)>& deliver) const
+{
+    if (!options.digests.empty() && options.digests.size() != paths.size())
+        throw EXCEPTION("Pipeline digests do not match the files");
+    if (paths.empty()) return;
+
+    // The stages after the raw reads; each takes jobs from the queue
+    // before it and passes them to the queue after it.
+    struct Stage
+    {
+        unsigned threads;
+        std::function<void (Job&)> work;
+    };
+    std::vector<Stage> stages;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    stages.push_back({ options.decode_threads ? options.decode_threads : cores, [](Job& job)
+    {
+        std::unique_ptr<FileHandler> handler(job.decode());
+        job.decode = nullptr;
+        if (!handler)
+            throw EXCEPTION(std::string("Failed opening file ") + job.result.path);
+        File file(std::move(handler));
+        job.result.data = file.read_all_owned(job.result.size);
+    }});
+    if (!options.digests.empty())
+        stages.push_back({ options.verify_threads, [&](Job& job)
+        {
+            if (Sha256::hash(job.result.data.get(), job.result.size) != options.digests[job.result.index])
+                throw EXCEPTION(std::string("Digest mismatch for ") + job.result.path);
+        }});
+    if (options.transform)
+        stages.push_back({ options.transform_threads, [&](Job& job) { options.transform(job.result); } });
+
+    std::vector<std::unique_ptr<BoundedQueue<Job>>> queues;
+    for (std::size_t i = 0; i <= stages.size(); ++i)
+        queues.emplace_back(new BoundedQueue<Job>(options.queue_depth));
+
+    // Each stage closes its output queue when its last thread finishes.
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<std::atomic<unsigned>>> running;
+    auto spawn = [&](unsigned count, std::function<void ()> body, std::size_t out)
+    {
+        count = std::max(1u, count);
+        running.emplace_back(new std::atomic<unsigned>(count));
+        std::atomic<unsigned>* left = running.back().get();
+        BoundedQueue<Job>* queue = queues[out].get();
+        for (unsigned t = 0; t < count; ++t)
+            threads.emplace_back([=]()
+            {
+                body();
+                if (--*left == 0) queue->close();
+            });
+    };
+
+    // Stop every stage if spawning fails or the consumer throws.
+    std::atomic<std::size_t> next(0);
+    try
+    {
+        spawn(options.read_threads, [&]()
+        {
+            for (std::size_t i; (i = next++) < paths.size(); )
+            {
+                Job job;
+                job.result.index = i;
+                job.result.path = paths[i];
+                run(job, [&](Job& job)
+                {
+                    job.decode = fetch(paths[i]);
+                    if (!job.decode)
+                        throw EXCEPTION(std::string("Failed opening file ") + paths[i]);
+                });
+                if (!queues[0]->push(std::move(job))) return;
+            }
+        }, 0);
+
+        for (std::size_t s = 0; s < stages.size(); ++s)
+        {
+            BoundedQueue<Job>* in = queues[s].get();
+            BoundedQueue<Job>* out = queues[s + 1].get();
+            const std::function<void (Job&)>* work = &stages[s].work;
+            spawn(stages[s].threads, [=]()
+            {
+                for (Job job; in->pop(job); )
+                {
+                    run(job, *work);
+                    if (!out->push(std::move(job))) return;
+                }
+            }, s + 1);
+        }
+
+        // Results are delivered on this thread.
+        for (Job job; queues.back()->pop(job); )
+            deliver(std::move(job.result));
+    }
+    catch (...)
+    {
+        for (auto& queue : queues) queue->cancel();
+        for (std::thread& thread : threads) thread.join();
+        throw;
+    }
+    for (std::thread& thread : threads) thread.join();
+}
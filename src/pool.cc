@@ -0,0 +1,233 @@
+#include "pool.h"
+
+#include <vector>
+#include <mutex>
+#include <new>
+
+#include <cstddef>
+
+using namespace kx;
+
+namespace
+{
+
+// Classes are the powers of two from 4 KiB to 16 MiB.
+const unsigned MIN_SHIFT = 12;
+const unsigned MAX_SHIFT = 24;
+const unsigned CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+const unsigned UNPOOLED = CLASSES;
+
+// Free buffers kept per thread and for all threads. Beyond these limits
+// buffers go back to the heap.
+const std::size_t THREAD_BUFFERS = 4; // per class
+const std::size_t THREAD_BYTES = 8 << 20;
+const std::size_t SHARED_BYTES = 32 << 20;
+
+// Each buffer is preceded by a header giving its class, padded to keep
+// the data aligned for any type.
+const std::size_t HEADER = alignof(std::max_align_t) > sizeof(unsigned) ?
+                           alignof(std::max_align_t) : sizeof(unsigned);
+
+std::size_t class_size (unsigned c)
+{
+    return (std::size_t) 1 << (MIN_SHIFT + c);
+}
+
+unsigned size_class (std::size_t size)
+{
+    unsigned c = 0;
+    while (c < CLASSES && class_size(c) < size) ++c;
+    return c;
+}
+
+unsigned& header (void* data)
+{
+    return *(unsigned*) ((char*) data - HEADER);
+}
+
+void* allocate_new (std::size_t size, unsigned c)
+{
+    char* block = (char*) ::operator new(size + HEADER);
+    *(unsigned*) block = c;
+    return block + HEADER;
+}
+
+void free_now (void* data)
+{
+    ::operator delete((char*) data - HEADER);
+}
+
+struct Shared
+{
+    std::mutex mutex;
+    std::vector<void*> free[CLASSES];
+    std::size_t bytes = 0;
+};
+
+// Never destroyed, so that buffers freed during static destruction still
+// have somewhere to go.
+Shared& shared ()
+{
+    static Shared* pool = new Shared;
+    return *pool;
+}
+
+void free_shared (void* data, unsigned c)
+{
+    Shared& pool = shared();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        try
+        {
+            if (pool.bytes + class_size(c) <= SHARED_BYTES)
+            {
+                pool.free[c].push_back(data);
+                pool.bytes += class_size(c);
+                return;
+            }
+        }
+        catch (const std::bad_alloc&) {}
+    }
+    free_now(data);
+}
+
+// Set once the thread's pool is destroyed, after which its buffers go
+// straight to the shared pool.
+thread_local bool thread_exited = false;
+
+struct Local
+{
+    std::vector<void*> free[CLASSES];
+    std::size_t bytes = 0;
+
+    Local ()
+    {
+        // Freeing must not allocate.
+        for (unsigned c = 0; c < CLASSES; ++c) free[c].reserve(THREAD_BUFFERS);
+    }
+
+    ~Local ()
+    {
+        thread_exited = true;
+        for (unsigned c = 0; c < CLASSES; ++c)
+            for (void* data : free[c]) free_shared(data, c);
+    }
+};
+
+Local* local ()
+{
+    if (thread_exited) return nullptr;
+    thread_local Local pool;
+    return &pool;
+}
+
+class PoolResource final : public MemoryResource
+{
+public:
+
+    void* allocate (std::size_t size, std::size_t alignment) override
+    {
+        if (alignment > HEADER) throw std::bad_alloc();
+        return pool_allocate(size);
+    }
+
+    void deallocate (void* data, std::size_t, std::size_t) override
+    {
+        pool_free(data);
+    }
+};
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+struct ZstdContext
+{
+    ZSTD_DCtx* dctx = nullptr;
+
+    ~ZstdContext () { ZSTD_freeDCtx(dctx); }
+};
+#endif
+
+} // namespace
+
+void* kx::pool_allocate (std::size_t size)
+{
+    unsigned c = size_class(size);
+    if (c == UNPOOLED) return allocate_new(size, UNPOOLED);
+
+    Local* pool = local();
+    if (pool && !pool->free[c].empty())
+    {
+        void* data = pool->free[c].back();
+        pool->free[c].pop_back();
+        pool->bytes -= class_size(c);
+        return data;
+    }
+    {
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (!s.free[c].empty())
+        {
+            void* data = s.free[c].back();
+            s.free[c].pop_back();
+            s.bytes -= class_size(c);
+            return data;
+        }
+    }
+    return allocate_new(class_size(c), c);
+}
+
+void kx::pool_free (void* data)
+{
+    if (!data) return;
+    unsigned c = header(data);
+    if (c == UNPOOLED)
+    {
+        free_now(data);
+        return;
+    }
+
+    Local* pool = local();
+    if (pool && pool->free[c].size() < THREAD_BUFFERS && pool->bytes + class_size(c) <= THREAD_BYTES)
+    {
+        pool->free[c].push_back(data);
+        pool->bytes += class_size(c);
+    }
+    else
+        free_shared(data, c);
+}
+
+MemoryResource* kx::pool_resource ()
+{
+    static PoolResource* resource = new PoolResource;
+    return resource;
+}
+
+void* kx::pool_zalloc (void*, unsigned items, unsigned size)
+{
+    // zlib reports a null result as Z_MEM_ERROR; it cannot unwind.
+    try
+    {
+        return pool_allocate((std::size_t) items * size);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return nullptr;
+    }
+}
+
+void kx::pool_zfree (void*, void* data)
+{
+    pool_free(data);
+}
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+ZSTD_DCtx* kx::zstd_context ()
+{
+    thread_local ZstdContext context;
+    if (!context.dctx)
+    {
+        context.dctx = ZSTD_createDCtx();
+        if (!context.dctx) throw std::bad_alloc();
+    }
+    return context.dctx;
+}
+#endif
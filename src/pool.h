@@ -0,0 +1,72 @@
+#pragma once
+
+#include <file.h>
+#include <cpp/cpp.h>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace kx
+{
+
+// Scratch buffers for I/O and decompression come from size-classed pools:
+// each thread keeps a few free buffers of every class and falls back to a
+// pool shared by all threads, so that steady-state reads neither call
+// malloc nor fault in fresh pages. Buffers may be freed on any thread.
+// Requests larger than the biggest class bypass the pools.
+
+/// Take a buffer of at least 'size' bytes from the pools.
+void* pool_allocate (std::size_t size);
+
+/// Return a buffer to the pools. Null is ignored.
+void pool_free (void* data);
+
+/// Return a MemoryResource backed by the pools.
+MemoryResource* pool_resource ();
+
+/// zlib allocation functions backed by the pools, for z_stream's zalloc
+/// and zfree.
+void* pool_zalloc (void* opaque, unsigned items, unsigned size);
+void pool_zfree (void* opaque, void* data);
+
+/// A scratch buffer taken from the pools and returned on destruction.
+class PooledBuffer : NonCopyable
+{
+public:
+
+    explicit PooledBuffer (std::size_t size = 0)
+        : buffer(size ? (std::uint8_t*) pool_allocate(size) : nullptr), length(size) {}
+
+    ~PooledBuffer () { pool_free(buffer); }
+
+    std::uint8_t* data () const { return buffer; }
+
+    std::size_t size () const { return length; }
+
+    /// Make room for 'size' bytes, discarding the contents.
+    void resize (std::size_t size)
+    {
+        if (size == length) return;
+        pool_free(buffer);
+        buffer = nullptr;
+        length = 0;
+        if (size) buffer = (std::uint8_t*) pool_allocate(size);
+        length = size;
+    }
+
+private:
+
+    std::uint8_t* buffer;
+    std::size_t length;
+};
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+/// Return the calling thread's zstd decompression context, so that files
+/// need not create their own.
+ZSTD_DCtx* zstd_context ();
+#endif
+
+} // namespace kx
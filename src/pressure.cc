@@ -0,0 +1,256 @@
+#include <file.h>
+#include <cpp/Exception.h>
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace kx;
+
+using Clock = std::chrono::steady_clock;
+
+struct MemoryPressureMonitor::impl
+{
+    std::chrono::milliseconds window;
+    double min_scale;
+
+    mutable std::mutex mutex;
+    double scale = 1;
+    std::map<std::uint64_t, Callback> subscribers;
+    std::uint64_t next_id = 0;
+
+    // Held while callbacks run, so that they see changes in order.
+    // Recursive, so that callbacks may call back into the monitor.
+    std::recursive_mutex notify;
+
+    /// Multiply the scale by 'factor', within [min_scale, 1], and notify
+    /// subscribers if it changed.
+    void rescale (double factor);
+
+#ifdef __linux__
+    enum Source { None, Trigger, Events };
+
+    Source source = None;
+    int fd = -1;
+    int wake[2] = { -1, -1 };
+    std::uint64_t events = 0; // pressure events counted in memory.events
+    std::thread thread;
+
+    bool open_trigger (const std::string& path, std::chrono::milliseconds stall);
+    bool open_events (const std::string& path);
+
+    /// Return the number of times the cgroup hit its high or max limit.
+    std::uint64_t read_events () const;
+
+    void run ();
+
+    ~impl ()
+    {
+        if (fd >= 0) ::close(fd);
+        if (wake[0] >= 0) ::close(wake[0]);
+        if (wake[1] >= 0) ::close(wake[1]);
+    }
+#endif
+};
+
+void MemoryPressureMonitor::impl::rescale (double factor)
+{
+    std::lock_guard<std::recursive_mutex> notifying(notify);
+    std::vector<Callback> callbacks;
+    double scale_;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        scale_ = std::max(min_scale, std::min(1.0, scale * factor));
+        if (scale_ == scale) return;
+        scale = scale_;
+        for (auto& subscriber : subscribers)
+            callbacks.push_back(subscriber.second);
+    }
+    for (auto& callback : callbacks)
+        callback(scale_);
+}
+
+#ifdef __linux__
+
+namespace
+{
+
+/// Return the cgroup v2 directory of the process, or an empty string.
+std::string cgroup_directory ()
+{
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(in, line))
+        if (line.compare(0, 3, "0::") == 0)
+            return "/sys/fs/cgroup" + line.substr(3);
+    return std::string();
+}
+
+} // namespace
+
+bool MemoryPressureMonitor::impl::open_trigger (const std::string& path, std::chrono::milliseconds stall)
+{
+    fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+    char trigger[64];
+    int n = std::snprintf(trigger, sizeof(trigger), "some %lld %lld",
+                          (long long) stall.count() * 1000, (long long) window.count() * 1000);
+    if (::write(fd, trigger, n + 1) < 0)
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    source = Trigger;
+    return true;
+}
+
+bool MemoryPressureMonitor::impl::open_events (const std::string& path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    source = Events;
+    events = read_events();
+    return true;
+}
+
+std::uint64_t MemoryPressureMonitor::impl::read_events () const
+{
+    // Reading from the start also rearms the notification.
+    char buffer[512];
+    ssize_t n = ::pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) return events;
+    buffer[n] = 0;
+    std::uint64_t count = 0;
+    for (const char* line = buffer; line; line = std::strchr(line, '\n'))
+    {
+        if (*line == '\n') ++line;
+        unsigned long long value;
+        if (std::sscanf(line, "high %llu", &value) == 1 || std::sscanf(line, "max %llu", &value) == 1)
+            count += value;
+    }
+    return count;
+}
+
+void MemoryPressureMonitor::impl::run ()
+{
+    Clock::time_point last_event;
+    for (;;)
+    {
+        pollfd fds[2] = { { fd, POLLPRI, 0 }, { wake[0], POLLIN, 0 } };
+        int n = ::poll(fds, 2, (int) window.count());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || fds[1].revents) return;
+
+        if (n == 0)
+        {
+            // A quiet window: grow back.
+            rescale(2);
+            continue;
+        }
+        if (source == Trigger && (fds[0].revents & POLLERR))
+        {
+            // The trigger is gone; keep growing the scale back.
+            ::close(fd);
+            fd = -1;
+            source = None;
+            continue;
+        }
+        if (source == Events)
+        {
+            std::uint64_t count = read_events();
+            if (count == events) continue;
+            events = count;
+            // memory.events changes on every limit hit; shrink once per window.
+            if (Clock::now() - last_event < window) continue;
+        }
+        last_event = Clock::now();
+        rescale(0.5);
+    }
+}
+
+#endif // __linux__
+
+MemoryPressureMonitor::MemoryPressureMonitor (std::chrono::milliseconds stall,
+                                              std::chrono::milliseconds window,
+                                              double min_scale)
+    : my(new impl)
+{
+    my->window = window;
+    my->min_scale = min_scale;
+#ifdef __linux__
+    // Without a source the thread still grows the scale back after
+    // pressure() calls.
+    std::string cgroup = cgroup_directory();
+    if (!my->open_trigger("/proc/pressure/memory", stall) && !cgroup.empty() &&
+        !my->open_trigger(cgroup + "/memory.pressure", stall))
+        my->open_events(cgroup + "/memory.events");
+    // The trigger is closed with 'my' if this fails.
+    if (::pipe(my->wake) != 0)
+        throw EXCEPTION("Failed creating memory pressure monitor");
+    my->thread = std::thread([this]() { my->run(); });
+#else
+    (void) stall;
+#endif
+}
+
+MemoryPressureMonitor::~MemoryPressureMonitor ()
+{
+#ifdef __linux__
+    char c = 0;
+    if (::write(my->wake[1], &c, 1) < 0) {}
+    my->thread.join();
+#endif
+}
+
+bool MemoryPressureMonitor::active () const
+{
+#ifdef __linux__
+    return my->source != impl::None;
+#else
+    return false;
+#endif
+}
+
+double MemoryPressureMonitor::scale () const
+{
+    std::lock_guard<std::mutex> lock(my->mutex);
+    return my->scale;
+}
+
+std::uint64_t MemoryPressureMonitor::subscribe (Callback callback)
+{
+    std::lock_guard<std::recursive_mutex> notifying(my->notify);
+    double scale = this->scale();
+    callback(scale);
+    std::lock_guard<std::mutex> lock(my->mutex);
+    std::uint64_t id = my->next_id++;
+    my->subscribers.emplace(id, std::move(callback));
+    return id;
+}
+
+void MemoryPressureMonitor::unsubscribe (std::uint64_t id)
+{
+    // Waits for callbacks running on other threads.
+    std::lock_guard<std::recursive_mutex> notifying(my->notify);
+    std::lock_guard<std::mutex> lock(my->mutex);
+    my->subscribers.erase(id);
+}
+
+void MemoryPressureMonitor::pressure ()
+{
+    my->rescale(0.5);
+}
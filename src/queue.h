@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cpp/cpp.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+namespace kx
+{
+
+/// A queue holding at most 'capacity' values, between threads that
+/// produce and consume them. Producers wait while it is full.
+template <typename T>
+class BoundedQueue : NonCopyable
+{
+public:
+
+    explicit BoundedQueue (std::size_t capacity)
+        : capacity(capacity ? capacity : 1) {}
+
+    /// Wait for room and add a value.
+    /// Return false, dropping the value, if the queue is closed.
+    bool push (T&& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return closed || values.size() < capacity; });
+        if (closed) return false;
+        values.push_back(std::move(value));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /// Wait for a value and remove it.
+    /// Return false once the queue is closed and empty.
+    bool pop (T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return closed || !values.empty(); });
+        if (values.empty()) return false;
+        value = std::move(values.front());
+        values.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /// Refuse further values; consumers drain those left.
+    void close ()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    /// Close the queue and drop the values left.
+    void cancel ()
+    {
+        std::deque<T> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            dropped.swap(values);
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+    }
+
+private:
+
+    const std::size_t capacity;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+    std::deque<T> values;
+    bool closed = false;
+};
+
+} // namespace kx
@@ -0,0 +1,726 @@
+#include <file.h>
+#include <cpp/Exception.h>
+#include "io.h"
+#include "cache.h"
+#include "parallel.h"
+#include "merkle.h"
+#include "pool.h"
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+#include <zlib.h>
+#endif
+#ifndef FILESYSTEM_DISABLE_XZ
+#include <lzma.h>
+#endif
+#ifndef FILESYSTEM_DISABLE_LZ4
+#include <lz4.h>
+#endif
+#ifndef FILESYSTEM_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+
+namespace
+{
+
+const std::uint32_t MAGIC = 0x73717368;
+const std::size_t SUPERBLOCK_SIZE = 96;
+const std::size_t METADATA_SIZE = 8192;
+const std::size_t INODE_HEADER_SIZE = 16;
+const std::size_t FRAGMENT_ENTRY_SIZE = 16;
+const std::uint32_t NO_FRAGMENT = 0xFFFFFFFF;
+const std::size_t MAX_NAME = 256;
+
+// Block size fields flag uncompressed blocks with this bit.
+const std::uint32_t UNCOMPRESSED_BLOCK = 1 << 24;
+
+// Compressors.
+const std::uint16_t GZIP = 1;
+const std::uint16_t XZ = 4;
+const std::uint16_t LZ4 = 5;
+const std::uint16_t ZSTD = 6;
+
+// Inode types.
+const std::uint16_t BASIC_DIR = 1;
+const std::uint16_t BASIC_FILE = 2;
+const std::uint16_t EXTENDED_DIR = 8;
+const std::uint16_t EXTENDED_FILE = 9;
+
+std::uint16_t read16 (const std::uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+std::uint32_t read32 (const std::uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((std::uint32_t) p[3] << 24);
+}
+
+std::uint64_t read64 (const std::uint8_t* p)
+{
+    return read32(p) | ((std::uint64_t) read32(p+4) << 32);
+}
+
+#ifndef FILESYSTEM_DISABLE_XZ
+void* lzma_pool_alloc (void*, std::size_t items, std::size_t size)
+{
+    // liblzma reports a null result as LZMA_MEM_ERROR; it cannot unwind.
+    try
+    {
+        return pool_allocate(items * size);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return nullptr;
+    }
+}
+
+void lzma_pool_free (void*, void* data)
+{
+    pool_free(data);
+}
+
+// liblzma's decoder state comes from the scratch pools.
+const lzma_allocator lzma_pool = { lzma_pool_alloc, lzma_pool_free, nullptr };
+#endif
+
+/// A decompressed block. Metadata blocks also record where the next
+/// metadata block starts.
+struct Block
+{
+    std::vector<std::uint8_t> data;
+    std::uint64_t next;
+};
+
+/// A regular file: where its blocks are and where its tail fragment is.
+struct Inode
+{
+    std::uint64_t size;
+    std::vector<std::uint64_t> offsets; // disk offset of each block
+    std::vector<std::uint32_t> sizes; // size field of each block; 0 if sparse
+    std::uint32_t fragment;
+    std::uint32_t fragment_offset;
+};
+
+/// A SquashFS image, shared by the file system and the files open in it.
+struct Image
+{
+    /// A position in a metadata table.
+    struct Cursor
+    {
+        std::uint64_t block; // disk offset of the metadata block
+        std::size_t offset; // offset in the decompressed block
+    };
+
+    std::string path;
+    RandomAccessFile file;
+    std::uint32_t block_size;
+    std::uint16_t compressor;
+    std::uint32_t fragment_count;
+    std::uint64_t root_inode;
+    std::uint64_t inode_table;
+    std::uint64_t directory_table;
+    std::vector<std::uint64_t> fragment_blocks; // disk offsets of fragment table blocks
+    std::uint64_t fragment_table;
+    unsigned readahead;
+
+    // Metadata, data and fragment blocks keyed by disk offset.
+    LruCache<std::uint64_t, Block> cache;
+
+    // Set by enable_verification; all reads then go through it.
+    std::unique_ptr<MerkleVerifier> verifier;
+
+    Image (std::size_t cache_size, unsigned readahead)
+        : readahead(readahead), cache(cache_size) {}
+
+    /// Read the superblock and the fragment index, through the verifier
+    /// if it is set.
+    void read_superblock ();
+
+    /// Return the fields read by read_superblock(), to compare them.
+    std::vector<std::uint64_t> superblock_fields () const
+    {
+        std::vector<std::uint64_t> fields = { block_size, compressor, fragment_count, root_inode,
+                                              inode_table, directory_table, fragment_table };
+        fields.insert(fields.end(), fragment_blocks.begin(), fragment_blocks.end());
+        return fields;
+    }
+
+    std::size_t read_at (std::uint64_t offset, void* buffer, std::size_t size) const
+    {
+        return verifier ? verifier->read_at(file, offset, buffer, size) : file.read_at(offset, buffer, size);
+    }
+
+    /// Decompress 'size' bytes into 'out' of capacity 'capacity'.
+    /// Return the decompressed size.
+    std::size_t decompress (const std::uint8_t* in, std::size_t size,
+                            std::uint8_t* out, std::size_t capacity) const;
+
+    /// Return the data block at 'offset' with the given size field,
+    /// decompressed to at most 'capacity' bytes.
+    std::shared_ptr<const Block> data_block (std::uint64_t offset, std::uint32_t size_field,
+                                             std::size_t capacity);
+
+    /// Decompress the data blocks in a contiguous run with one read and
+    /// one task per block, and cache them.
+    void read_ahead (const Inode&, std::size_t first, std::size_t count);
+
+    std::shared_ptr<const Block> metadata_block (std::uint64_t offset);
+
+    /// Read from a metadata table, advancing the cursor across blocks.
+    void read_metadata (Cursor&, void* out, std::size_t size);
+
+    /// Look a path up, returning its inode reference.
+    bool lookup (const char* path, std::uint64_t& inode);
+
+    /// Read a regular file inode. Return false if it is not a regular file.
+    bool read_inode (std::uint64_t ref, Inode&);
+};
+
+void Image::read_superblock ()
+{
+    std::uint8_t sb[SUPERBLOCK_SIZE];
+    if (read_at(0, sb, sizeof(sb)) != sizeof(sb) || read32(sb) != MAGIC)
+        throw EXCEPTION("Not a SquashFS image: " + path);
+    if (read16(sb + 28) != 4)
+        throw EXCEPTION("Unsupported SquashFS version in " + path);
+
+    block_size = read32(sb + 12);
+    fragment_count = read32(sb + 16);
+    compressor = read16(sb + 20);
+    root_inode = read64(sb + 32);
+    inode_table = read64(sb + 64);
+    directory_table = read64(sb + 72);
+    fragment_table = read64(sb + 80);
+
+    if (block_size < 4096 || block_size > (1 << 20))
+        throw EXCEPTION("Corrupt SquashFS superblock in " + path);
+
+    bool supported = false;
+#ifndef FILESYSTEM_DISABLE_ZIP
+    supported |= compressor == GZIP;
+#endif
+#ifndef FILESYSTEM_DISABLE_XZ
+    supported |= compressor == XZ;
+#endif
+#ifndef FILESYSTEM_DISABLE_LZ4
+    supported |= compressor == LZ4;
+#endif
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    supported |= compressor == ZSTD;
+#endif
+    if (!supported)
+        throw EXCEPTION("Unsupported SquashFS compressor in " + path);
+
+    // The fragment table is indexed by a list of metadata block offsets.
+    std::size_t per_block = METADATA_SIZE / FRAGMENT_ENTRY_SIZE;
+    std::size_t blocks = (fragment_count + per_block - 1) / per_block;
+    std::vector<std::uint8_t> index(blocks * 8);
+    if (read_at(fragment_table, index.data(), index.size()) != index.size())
+        throw EXCEPTION("Corrupt SquashFS fragment table in " + path);
+    fragment_blocks.resize(blocks);
+    for (std::size_t i = 0; i < blocks; ++i)
+        fragment_blocks[i] = read64(&index[i*8]);
+}
+
+std::size_t Image::decompress (const std::uint8_t* in, std::size_t size,
+                               std::uint8_t* out, std::size_t capacity) const
+{
+    switch (compressor)
+    {
+#ifndef FILESYSTEM_DISABLE_ZIP
+    case GZIP:
+    {
+        // uncompress() would allocate zlib's state and window per block.
+        z_stream z;
+        std::memset(&z, 0, sizeof(z));
+        z.zalloc = pool_zalloc;
+        z.zfree = pool_zfree;
+        if (inflateInit(&z) != Z_OK) break;
+        z.next_in = (Bytef*) in;
+        z.avail_in = (uInt) size;
+        z.next_out = out;
+        z.avail_out = (uInt) capacity;
+        int ret = inflate(&z, Z_FINISH);
+        std::size_t n = z.total_out;
+        inflateEnd(&z);
+        if (ret != Z_STREAM_END) break;
+        return n;
+    }
+#endif
+#ifndef FILESYSTEM_DISABLE_XZ
+    case XZ:
+    {
+        std::uint64_t memlimit = UINT64_MAX;
+        std::size_t in_pos = 0, out_pos = 0;
+        if (lzma_stream_buffer_decode(&memlimit, 0, &lzma_pool, in, &in_pos, size,
+                                      out, &out_pos, capacity) != LZMA_OK) break;
+        return out_pos;
+    }
+#endif
+#ifndef FILESYSTEM_DISABLE_LZ4
+    case LZ4:
+    {
+        int n = LZ4_decompress_safe((const char*) in, (char*) out, (int) size, (int) capacity);
+        if (n < 0) break;
+        return n;
+    }
+#endif
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    case ZSTD:
+    {
+        std::size_t n = ZSTD_decompressDCtx(zstd_context(), out, capacity, in, size);
+        if (ZSTD_isError(n)) break;
+        return n;
+    }
+#endif
+    default:
+        break;
+    }
+    throw EXCEPTION("Corrupt compressed block in " + path);
+}
+
+std::shared_ptr<const Block> Image::data_block (std::uint64_t offset, std::uint32_t size_field,
+                                                std::size_t capacity)
+{
+    std::shared_ptr<const Block> cached = cache.get(offset);
+    if (cached) return cached;
+
+    std::size_t size = size_field & ~UNCOMPRESSED_BLOCK;
+    PooledBuffer raw(size);
+    if (read_at(offset, raw.data(), size) != size)
+        throw EXCEPTION("Failed reading SquashFS block from " + path);
+
+    std::shared_ptr<Block> block(new Block);
+    block->next = offset + size;
+    if (size_field & UNCOMPRESSED_BLOCK)
+        block->data.assign(raw.data(), raw.data() + size);
+    else
+    {
+        block->data.resize(capacity);
+        block->data.resize(decompress(raw.data(), size, block->data.data(), capacity));
+    }
+    cache.put(offset, block, block->data.capacity());
+    return block;
+}
+
+void Image::read_ahead (const Inode& inode, std::size_t first, std::size_t count)
+{
+    std::uint64_t start = inode.offsets[first];
+    std::uint64_t end = inode.offsets[first + count - 1] + (inode.sizes[first + count - 1] & ~UNCOMPRESSED_BLOCK);
+    PooledBuffer raw((std::size_t) (end - start));
+    if (read_at(start, raw.data(), raw.size()) != raw.size())
+        throw EXCEPTION("Failed reading SquashFS blocks from " + path);
+
+    parallel_for(count, [&](std::size_t k)
+    {
+        std::size_t i = first + k;
+        const std::uint8_t* in = raw.data() + (inode.offsets[i] - start);
+        std::size_t size = inode.sizes[i] & ~UNCOMPRESSED_BLOCK;
+        std::size_t capacity = (std::size_t) std::min<std::uint64_t>(block_size, inode.size - (std::uint64_t) i * block_size);
+        std::shared_ptr<Block> block(new Block);
+        block->next = inode.offsets[i] + size;
+        if (inode.sizes[i] & UNCOMPRESSED_BLOCK)
+            block->data.assign(in, in + size);
+        else
+        {
+            block->data.resize(capacity);
+            block->data.resize(decompress(in, size, block->data.data(), capacity));
+        }
+        cache.put(inode.offsets[i], block, block->data.capacity());
+    });
+}
+
+std::shared_ptr<const Block> Image::metadata_block (std::uint64_t offset)
+{
+    std::shared_ptr<const Block> cached = cache.get(offset);
+    if (cached) return cached;
+
+    // Metadata blocks start with a 16-bit header: the size on disk, with
+    // the high bit set if the block is stored uncompressed.
+    std::uint8_t header[2];
+    if (read_at(offset, header, 2) != 2)
+        throw EXCEPTION("Failed reading SquashFS metadata from " + path);
+    std::uint16_t size_field = read16(header);
+    std::size_t size = size_field & 0x7FFF;
+    PooledBuffer raw(size);
+    if (read_at(offset + 2, raw.data(), size) != size)
+        throw EXCEPTION("Failed reading SquashFS metadata from " + path);
+
+    std::shared_ptr<Block> block(new Block);
+    block->next = offset + 2 + size;
+    if (size_field & 0x8000)
+        block->data.assign(raw.data(), raw.data() + size);
+    else
+    {
+        block->data.resize(METADATA_SIZE);
+        block->data.resize(decompress(raw.data(), size, block->data.data(), METADATA_SIZE));
+    }
+    cache.put(offset, block, block->data.capacity());
+    return block;
+}
+
+void Image::read_metadata (Cursor& cursor, void* out, std::size_t size)
+{
+    std::uint8_t* p = (std::uint8_t*) out;
+    while (size > 0)
+    {
+        std::shared_ptr<const Block> block = metadata_block(cursor.block);
+        if (cursor.offset >= block->data.size())
+        {
+            if (block->data.empty())
+                throw EXCEPTION("Corrupt SquashFS metadata in " + path);
+            cursor.offset -= block->data.size();
+            cursor.block = block->next;
+            continue;
+        }
+        std::size_t n = std::min(size, block->data.size() - cursor.offset);
+        std::memcpy(p, block->data.data() + cursor.offset, n);
+        p += n;
+        size -= n;
+        cursor.offset += n;
+    }
+}
+
+bool Image::lookup (const char* filepath, std::uint64_t& inode)
+{
+    inode = root_inode;
+    const char* p = filepath;
+    while (*p)
+    {
+        const char* end = std::strchr(p, '/');
+        if (!end) end = p + std::strlen(p);
+        std::size_t len = end - p;
+        if (len == 0 || (len == 1 && *p == '.'))
+        {
+            p = *end ? end + 1 : end;
+            continue;
+        }
+
+        // Find the directory listing of the current inode.
+        Cursor cursor = { inode_table + (inode >> 16), (std::size_t) (inode & 0xFFFF) };
+        std::uint8_t header[INODE_HEADER_SIZE];
+        read_metadata(cursor, header, sizeof(header));
+        std::uint16_t type = read16(header);
+        std::uint64_t listing_block;
+        std::size_t listing_offset, listing_size;
+        if (type == BASIC_DIR)
+        {
+            std::uint8_t dir[16];
+            read_metadata(cursor, dir, sizeof(dir));
+            listing_block = read32(dir);
+            listing_size = read16(dir + 8);
+            listing_offset = read16(dir + 10);
+        }
+        else if (type == EXTENDED_DIR)
+        {
+            std::uint8_t dir[24];
+            read_metadata(cursor, dir, sizeof(dir));
+            listing_size = read32(dir + 4);
+            listing_block = read32(dir + 8);
+            listing_offset = read16(dir + 18);
+        }
+        else return false;
+
+        // The recorded size counts 3 bytes for the implied "." and "..".
+        if (listing_size < 3) return false;
+        std::size_t remaining = listing_size - 3;
+        Cursor listing = { directory_table + listing_block, listing_offset };
+        bool found = false;
+        while (remaining > 0 && !found)
+        {
+            // Entries are grouped under headers sharing an inode block.
+            std::uint8_t group[12];
+            if (remaining < sizeof(group))
+                throw EXCEPTION("Corrupt SquashFS directory in " + path);
+            read_metadata(listing, group, sizeof(group));
+            remaining -= sizeof(group);
+            std::uint32_t count = read32(group) + 1;
+            std::uint32_t start = read32(group + 4);
+            for (std::uint32_t i = 0; i < count && remaining > 0; ++i)
+            {
+                std::uint8_t entry[8];
+                char name[MAX_NAME];
+                if (remaining < sizeof(entry))
+                    throw EXCEPTION("Corrupt SquashFS directory in " + path);
+                read_metadata(listing, entry, sizeof(entry));
+                remaining -= sizeof(entry);
+                // Names must fit both the format's limit and the listing.
+                std::size_t name_len = read16(entry + 6) + 1;
+                if (name_len > sizeof(name) || name_len > remaining)
+                    throw EXCEPTION("Corrupt SquashFS directory in " + path);
+                read_metadata(listing, name, name_len);
+                remaining -= name_len;
+                if (name_len == len && std::memcmp(name, p, len) == 0)
+                {
+                    inode = ((std::uint64_t) start << 16) | read16(entry);
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if (!found) return false;
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+bool Image::read_inode (std::uint64_t ref, Inode& inode)
+{
+    Cursor cursor = { inode_table + (ref >> 16), (std::size_t) (ref & 0xFFFF) };
+    std::uint8_t header[INODE_HEADER_SIZE];
+    read_metadata(cursor, header, sizeof(header));
+    std::uint16_t type = read16(header);
+
+    std::uint64_t start;
+    if (type == BASIC_FILE)
+    {
+        std::uint8_t f[16];
+        read_metadata(cursor, f, sizeof(f));
+        start = read32(f);
+        inode.fragment = read32(f + 4);
+        inode.fragment_offset = read32(f + 8);
+        inode.size = read32(f + 12);
+    }
+    else if (type == EXTENDED_FILE)
+    {
+        std::uint8_t f[40];
+        read_metadata(cursor, f, sizeof(f));
+        start = read64(f);
+        inode.size = read64(f + 8);
+        inode.fragment = read32(f + 28);
+        inode.fragment_offset = read32(f + 32);
+    }
+    else return false;
+
+    // Files end in a fragment unless their size is a whole number of blocks.
+    std::uint64_t blocks = inode.fragment == NO_FRAGMENT ?
+        (inode.size + block_size - 1) / block_size : inode.size / block_size;
+    if (inode.fragment != NO_FRAGMENT && inode.fragment >= fragment_count)
+        throw EXCEPTION("Corrupt SquashFS inode in " + path);
+    // Each block takes 4 bytes of the block list.
+    if (blocks * 4 > file.size())
+        throw EXCEPTION("Corrupt SquashFS inode in " + path);
+
+    std::vector<std::uint8_t> sizes((std::size_t) blocks * 4);
+    read_metadata(cursor, sizes.data(), sizes.size());
+    inode.offsets.resize((std::size_t) blocks);
+    inode.sizes.resize((std::size_t) blocks);
+    for (std::size_t i = 0; i < blocks; ++i)
+    {
+        inode.offsets[i] = start;
+        inode.sizes[i] = read32(&sizes[i*4]);
+        start += inode.sizes[i] & ~UNCOMPRESSED_BLOCK;
+    }
+    return true;
+}
+
+/// A regular file in a SquashFS image.
+class SquashFsFile final : public FileHandler
+{
+public:
+
+    SquashFsFile (std::shared_ptr<Image> image, std::shared_ptr<const Inode> inode)
+        : image(std::move(image)), inode(std::move(inode)) {}
+
+    std::size_t read (void* buffer, std::size_t size) override;
+
+    void seek (std::ios::off_type offset, std::ios::seekdir origin) override
+    {
+        std::int64_t base = origin == std::ios::beg ? 0 :
+                            origin == std::ios::cur ? (std::int64_t) pos :
+                            (std::int64_t) inode->size;
+        pos = (std::uint64_t) std::max<std::int64_t>(0, base + offset);
+    }
+
+    std::ios::pos_type tell () const override { return (std::ios::pos_type) pos; }
+
+    std::size_t size () const override { return (std::size_t) inode->size; }
+
+    FileHandler* clone () const override
+    {
+        SquashFsFile* copy = new SquashFsFile(image, inode);
+        copy->pos = pos;
+        return copy;
+    }
+
+private:
+
+    std::shared_ptr<const Block> block (std::size_t index);
+
+    std::shared_ptr<Image> image;
+    std::shared_ptr<const Inode> inode;
+    std::uint64_t pos = 0;
+    std::size_t last_block = SIZE_MAX; // last block read, to detect sequential access
+};
+
+std::shared_ptr<const Block> SquashFsFile::block (std::size_t index)
+{
+    std::uint32_t block_size = image->block_size;
+    std::size_t capacity = (std::size_t) std::min<std::uint64_t>(block_size, inode->size - (std::uint64_t) index * block_size);
+    std::shared_ptr<const Block> cached = image->cache.get(inode->offsets[index]);
+    if (cached) return cached;
+
+    // On a sequential miss, decompress the following blocks too, in
+    // parallel, while they are read in the same request.
+    std::size_t count = 1;
+    bool sequential = index == 0 || index == last_block + 1;
+    if (sequential && image->readahead > 1)
+    {
+        std::size_t limit = std::min<std::size_t>(inode->offsets.size() - index, image->readahead);
+        while (count < limit && inode->sizes[index + count] != 0 &&
+               !image->cache.get(inode->offsets[index + count]))
+            ++count;
+    }
+    if (count > 1)
+    {
+        image->read_ahead(*inode, index, count);
+        cached = image->cache.get(inode->offsets[index]);
+        if (cached) return cached;
+    }
+    return image->data_block(inode->offsets[index], inode->sizes[index], capacity);
+}
+
+std::size_t SquashFsFile::read (void* buffer, std::size_t size)
+{
+    std::uint8_t* out = (std::uint8_t*) buffer;
+    std::uint32_t block_size = image->block_size;
+    std::size_t total = 0;
+    while (total < size && pos < inode->size)
+    {
+        std::size_t index = (std::size_t) (pos / block_size);
+        std::size_t offset = (std::size_t) (pos % block_size);
+        std::size_t n = (std::size_t) std::min<std::uint64_t>(size - total, inode->size - pos);
+
+        if (index < inode->offsets.size())
+        {
+            n = std::min(n, (std::size_t) block_size - offset);
+            if (inode->sizes[index] == 0)
+                std::memset(out + total, 0, n); // sparse block
+            else
+            {
+                std::shared_ptr<const Block> b = block(index);
+                if (offset + n > b->data.size())
+                    throw EXCEPTION("Corrupt SquashFS data block in " + image->path);
+                std::memcpy(out + total, b->data.data() + offset, n);
+            }
+            last_block = index;
+        }
+        else
+        {
+            // The tail lives in a fragment block shared with other files.
+            std::uint32_t fragment = inode->fragment;
+            std::size_t per_block = METADATA_SIZE / FRAGMENT_ENTRY_SIZE;
+            Image::Cursor cursor =
+                { image->fragment_blocks[fragment / per_block], (fragment % per_block) * FRAGMENT_ENTRY_SIZE };
+            std::uint8_t entry[FRAGMENT_ENTRY_SIZE];
+            image->read_metadata(cursor, entry, sizeof(entry));
+            std::shared_ptr<const Block> b = image->data_block(read64(entry), read32(entry + 8), block_size);
+            std::size_t start = inode->fragment_offset + offset;
+            if (start + n > b->data.size())
+                throw EXCEPTION("Corrupt SquashFS fragment in " + image->path);
+            std::memcpy(out + total, b->data.data() + start, n);
+        }
+        total += n;
+        pos += n;
+    }
+    return total;
+}
+
+} // namespace
+
+// SquashFsFileSystem
+
+struct SquashFsFileSystem::impl
+{
+    std::shared_ptr<Image> image;
+    std::size_t cache_size;
+
+    std::shared_ptr<MemoryPressureMonitor> pressure;
+    std::uint64_t subscription = UINT64_MAX;
+
+    ~impl ()
+    {
+        if (subscription != UINT64_MAX) pressure->unsubscribe(subscription);
+    }
+};
+
+SquashFsFileSystem::SquashFsFileSystem (const Path& image, std::size_t cache_size, unsigned readahead)
+    : my(new impl)
+{
+    my->image.reset(new Image(cache_size, readahead));
+    my->cache_size = cache_size;
+    my->image->path = image;
+    if (!my->image->file.open(image))
+        throw EXCEPTION("Failed opening SquashFS image " + my->image->path);
+    my->image->read_superblock();
+}
+
+SquashFsFileSystem::~SquashFsFileSystem () {}
+
+void SquashFsFileSystem::enable_verification (const Path& tree_file, const Digest* expected_root)
+{
+    Image& image = *my->image;
+    image.verifier.reset(new MerkleVerifier(tree_file, image.file.size(), expected_root));
+
+    // The superblock and fragment index were read on construction, and
+    // blocks may have been cached since: read them again through the
+    // verifier and drop what was read without it.
+    std::vector<std::uint64_t> fields = image.superblock_fields();
+    image.read_superblock();
+    image.cache.clear();
+    if (image.superblock_fields() != fields)
+        throw EXCEPTION("SquashFS superblock of " + image.path + " does not match the verified image");
+}
+
+void SquashFsFileSystem::setMemoryPressureMonitor (std::shared_ptr<MemoryPressureMonitor> monitor)
+{
+    if (my->subscription != UINT64_MAX) my->pressure->unsubscribe(my->subscription);
+    my->subscription = UINT64_MAX;
+    my->pressure = std::move(monitor);
+    if (!my->pressure) return;
+
+    // Capture the image weakly so the subscription does not keep it alive.
+    std::weak_ptr<Image> image = my->image;
+    std::size_t budget = my->cache_size;
+    my->subscription = my->pressure->subscribe([image, budget](double scale)
+    {
+        if (std::shared_ptr<Image> i = image.lock())
+            i->cache.set_budget((std::size_t) (budget * scale));
+    });
+}
+
+void SquashFsFileSystem::verify_all ()
+{
+    if (!my->image->verifier)
+        throw EXCEPTION("Verification not enabled for " + my->image->path);
+    my->image->verifier->verify_all(my->image->file);
+}
+
+FileHandler* SquashFsFileSystem::open (const FilePath& filepath)
+{
+    std::uint64_t inode;
+    if (!my->image->lookup(filepath, inode)) return nullptr;
+    return open_resolved(inode);
+}
+
+bool SquashFsFileSystem::resolve (const FilePath& filepath, std::uint64_t& entry)
+{
+    Inode inode;
+    return my->image->lookup(filepath, entry) && my->image->read_inode(entry, inode);
+}
+
+FileHandler* SquashFsFileSystem::open_resolved (std::uint64_t entry)
+{
+    std::shared_ptr<Inode> inode(new Inode);
+    if (!my->image->read_inode(entry, *inode)) return nullptr;
+    return new SquashFsFile(my->image, inode);
+}
@@ -0,0 +1,486 @@
+#include <file.h>
+#include <cpp/Exception.h>
+#include "io.h"
+#include "merkle.h"
+#include "fold.h"
+#include "pathindex.h"
+#include "perfecthash.h"
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+
+namespace
+{
+
+const std::size_t BLOCK_SIZE = 512;
+
+// Header field offsets and lengths.
+const std::size_t NAME = 0, NAME_LEN = 100;
+const std::size_t SIZE = 124, SIZE_LEN = 12;
+const std::size_t CHECKSUM = 148, CHECKSUM_LEN = 8;
+const std::size_t TYPEFLAG = 156;
+const std::size_t LINKNAME = 157, LINKNAME_LEN = 100;
+const std::size_t MAGIC = 257;
+const std::size_t PREFIX = 345, PREFIX_LEN = 155;
+
+const char INDEX_MAGIC[4] = { 'K', 'X', 'T', 'I' };
+const std::uint32_t INDEX_VERSION = 3;
+
+/// Return a NUL-terminated or full-length header field as a string.
+std::string field (const std::uint8_t* header, std::size_t offset, std::size_t len)
+{
+    const char* p = (const char*) header + offset;
+    return std::string(p, std::find(p, p + len, '\0'));
+}
+
+/// Parse a numeric field: octal text, or big-endian base-256 when the high
+/// bit of the first byte is set (GNU extension for values beyond 8G).
+std::uint64_t number (const std::uint8_t* p, std::size_t len)
+{
+    std::uint64_t n = 0;
+    if (p[0] & 0x80)
+    {
+        n = p[0] & 0x7F;
+        for (std::size_t i = 1; i < len; ++i) n = (n << 8) | p[i];
+        return n;
+    }
+    std::size_t i = 0;
+    while (i < len && (p[i] == ' ' || p[i] == '\0')) ++i;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) n = (n << 3) | (p[i] - '0');
+    return n;
+}
+
+bool valid_checksum (const std::uint8_t* header)
+{
+    // The checksum is computed with its own field read as spaces.
+    std::uint64_t sum = 0;
+    for (std::size_t i = 0; i < BLOCK_SIZE; ++i)
+        sum += (i >= CHECKSUM && i < CHECKSUM + CHECKSUM_LEN) ? ' ' : header[i];
+    return sum == number(header + CHECKSUM, CHECKSUM_LEN);
+}
+
+bool zero_block (const std::uint8_t* block)
+{
+    for (std::size_t i = 0; i < BLOCK_SIZE; ++i)
+        if (block[i]) return false;
+    return true;
+}
+
+std::string normalise (std::string path)
+{
+    while (path.compare(0, 2, "./") == 0) path.erase(0, 2);
+    while (!path.empty() && path[0] == '/') path.erase(0, 1);
+    return path;
+}
+
+std::uint64_t padded (std::uint64_t size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+} // namespace
+
+// TarFileSystem
+
+struct TarFileSystem::impl
+{
+    /// A member of the archive.
+    struct Entry
+    {
+        std::uint64_t offset; // offset of the member data
+        std::uint64_t size;
+    };
+
+    std::string path;
+    std::shared_ptr<MappedFile> tar; // shared with the files served from it
+    std::vector<Entry> entries;
+    PathIndex index;
+
+    // Loaded from an index file; looks paths up in place of the index.
+    PerfectHash hash;
+
+    // Set by enable_verification once the entries match the verified
+    // headers; members are then copied and verified when opened.
+    std::unique_ptr<MerkleVerifier> verifier;
+
+    // Set by setFoldedLookup.
+    std::unique_ptr<FoldedIndex> folded;
+
+    /// Returns 'size' bytes of the archive at 'offset', valid until the
+    /// next read.
+    using Reader = std::function<const std::uint8_t* (std::uint64_t offset, std::size_t size)>;
+
+    /// Look a path up exactly.
+    bool find_exact (const char* path, std::uint32_t& entry) const
+    {
+        if (hash.size() == 0)
+            return index.find(path, entry);
+
+        // The hash gives the only position the path can have.
+        std::size_t position = hash.find(path, std::strlen(path));
+        if (index.path(position) != path) return false;
+        entry = index.value(position);
+        return true;
+    }
+
+    /// Look a path up, exactly then folded.
+    bool find (const char* path, std::uint32_t& entry) const
+    {
+        return find_exact(path, entry) || (folded && folded->find(path, entry));
+    }
+
+    /// Add a member; 'names' maps the names seen so far to their entries.
+    static void add (std::vector<Entry>& entries, std::unordered_map<std::string, std::uint32_t>& names,
+                     const std::string& name, std::uint64_t offset, std::uint64_t size);
+
+    /// Scan the member headers read through 'read' into 'entries' and
+    /// 'index'.
+    void scan (const Reader& read, std::vector<Entry>& entries, PathIndex& index) const;
+    bool load_index (const char* index_file);
+};
+
+void TarFileSystem::impl::add (std::vector<Entry>& entries, std::unordered_map<std::string, std::uint32_t>& names,
+                               const std::string& name, std::uint64_t offset, std::uint64_t size)
+{
+    // Later members replace earlier ones with the same name, as on extraction.
+    Entry entry = { offset, size };
+    auto it = names.find(name);
+    if (it != names.end())
+        entries[it->second] = entry;
+    else
+    {
+        names.emplace(name, (std::uint32_t) entries.size());
+        entries.push_back(entry);
+    }
+}
+
+void TarFileSystem::impl::scan (const Reader& read, std::vector<Entry>& entries, PathIndex& index) const
+{
+    std::uint64_t size = tar->size();
+
+    // Names are hashed while scanning, for replaced members and hard
+    // links, then moved to the index.
+    std::unordered_map<std::string, std::uint32_t> names;
+
+    // Extended headers apply to the member that follows them.
+    std::string long_name;
+    std::string pax_path;
+    std::uint64_t pax_size = 0;
+    bool has_pax_size = false;
+
+    for (std::uint64_t pos = 0; pos + BLOCK_SIZE <= size; )
+    {
+        const std::uint8_t* header = read(pos, BLOCK_SIZE);
+        if (zero_block(header)) break;
+        if (!valid_checksum(header))
+            throw EXCEPTION("Corrupt tar header in " + path);
+
+        char type = (char) header[TYPEFLAG];
+        std::uint64_t member_size = has_pax_size ? pax_size : number(header + SIZE, SIZE_LEN);
+        std::uint64_t member = pos + BLOCK_SIZE;
+        // Sizes may come from base-256 fields or PAX records; compare
+        // them without sums that could wrap.
+        if (member_size > size - member || padded(member_size) < member_size)
+            throw EXCEPTION("Truncated tar member in " + path);
+        pos = member + padded(member_size);
+
+        if (type == 'L')
+        {
+            // GNU long name: the data is the name of the next member.
+            const char* p = (const char*) read(member, (std::size_t) member_size);
+            long_name.assign(p, std::find(p, p + member_size, '\0'));
+            continue;
+        }
+        if (type == 'x')
+        {
+            // PAX extended header: records of the form "<len> <key>=<value>\n".
+            const char* p = (const char*) read(member, (std::size_t) member_size);
+            const char* end = p + member_size;
+            while (p < end)
+            {
+                const char* space = std::find(p, end, ' ');
+                std::size_t len = (std::size_t) std::strtoull(std::string(p, space).c_str(), nullptr, 10);
+                if (space == end || len == 0 || len > (std::size_t) (end - p)) break;
+                // The length covers itself, the space and the newline.
+                if (len <= (std::size_t) (space - p) + 1 || p[len - 1] != '\n')
+                    throw EXCEPTION("Corrupt tar header in " + path);
+                const char* record_end = p + len - 1; // drop the newline
+                const char* eq = std::find(space + 1, record_end, '=');
+                std::string key(space + 1, eq);
+                if (eq != record_end)
+                {
+                    if (key == "path") pax_path.assign(eq + 1, record_end);
+                    else if (key == "size")
+                    {
+                        pax_size = std::strtoull(std::string(eq + 1, record_end).c_str(), nullptr, 10);
+                        has_pax_size = true;
+                    }
+                }
+                p += len;
+            }
+            continue;
+        }
+        if (type == 'g' || type == 'K')
+            continue; // global headers and long link names are not needed
+
+        std::string name;
+        if (!pax_path.empty()) name = pax_path;
+        else if (!long_name.empty()) name = long_name;
+        else
+        {
+            name = field(header, NAME, NAME_LEN);
+            if (std::memcmp(header + MAGIC, "ustar", 5) == 0)
+            {
+                std::string prefix = field(header, PREFIX, PREFIX_LEN);
+                if (!prefix.empty()) name = prefix + "/" + name;
+            }
+        }
+        name = normalise(name);
+        long_name.clear();
+        pax_path.clear();
+        has_pax_size = false;
+
+        if (type == '0' || type == '\0' || type == '7')
+            add(entries, names, name, member, member_size);
+        else if (type == '1')
+        {
+            // Hard links share the data of an earlier member.
+            auto target = names.find(normalise(field(header, LINKNAME, LINKNAME_LEN)));
+            if (target != names.end())
+            {
+                Entry entry = entries[target->second];
+                add(entries, names, name, entry.offset, entry.size);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, std::uint32_t>> paths(names.begin(), names.end());
+    names.clear();
+    index.build(paths);
+}
+
+// Index file layout, little-endian:
+//   "KXTI", version (u32), tar size (u64), entry count (u64),
+//   then per entry: offset (u64), size (u64),
+//   then the size of the path index image (u64), the path index image and
+//   the perfect hash image of its paths, both used straight from the
+//   mapping.
+
+static void put (std::ofstream& out, std::uint64_t value, std::size_t bytes)
+{
+    char buf[8];
+    for (std::size_t i = 0; i < bytes; ++i) buf[i] = (char) (value >> (8*i));
+    out.write(buf, bytes);
+}
+
+static bool get (const std::uint8_t*& p, const std::uint8_t* end, std::uint64_t& value, std::size_t bytes)
+{
+    if ((std::size_t) (end - p) < bytes) return false;
+    value = 0;
+    for (std::size_t i = 0; i < bytes; ++i) value |= (std::uint64_t) p[i] << (8*i);
+    p += bytes;
+    return true;
+}
+
+bool TarFileSystem::impl::load_index (const char* index_file)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    if (!file->open(index_file)) return false;
+    const std::uint8_t* p = file->data();
+    const std::uint8_t* end = p + file->size();
+
+    std::uint64_t version, tar_size, count;
+    if (file->size() < sizeof(INDEX_MAGIC) || std::memcmp(p, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        return false;
+    p += sizeof(INDEX_MAGIC);
+    if (!get(p, end, version, 4) || version != INDEX_VERSION) return false;
+    // An index of another version of the archive is ignored, not trusted.
+    if (!get(p, end, tar_size, 8) || tar_size != tar->size()) return false;
+    if (!get(p, end, count, 8)) return false;
+
+    std::vector<Entry> loaded_entries;
+    if (count > file->size() / 16) return false;
+    loaded_entries.reserve((std::size_t) count);
+    for (std::uint64_t i = 0; i < count; ++i)
+    {
+        Entry entry;
+        if (!get(p, end, entry.offset, 8) || !get(p, end, entry.size, 8))
+            return false;
+        if (entry.offset > tar_size || entry.size > tar_size - entry.offset)
+            return false;
+        loaded_entries.push_back(entry);
+    }
+
+    std::uint64_t index_size;
+    PathIndex loaded_index;
+    PerfectHash loaded_hash;
+    if (!get(p, end, index_size, 8) || index_size > (std::uint64_t) (end - p)) return false;
+    if (!loaded_index.assign(file, p, (std::size_t) index_size)) return false;
+    p += index_size;
+    if (!loaded_hash.assign(file, p, end - p) || loaded_hash.size() != loaded_index.size()) return false;
+    for (std::size_t i = 0; i < loaded_index.size(); ++i)
+        if (loaded_index.value(i) >= count) return false;
+    entries.swap(loaded_entries);
+    index.swap(loaded_index);
+    hash.swap(loaded_hash);
+    return true;
+}
+
+TarFileSystem::TarFileSystem (const Path& tar_file, const Path& index_file)
+    : my(new impl)
+{
+    my->path = tar_file;
+    my->tar.reset(new MappedFile);
+    if (!my->tar->open(tar_file))
+        throw EXCEPTION("Failed opening tar file " + my->path);
+    if (!index_file || !my->load_index(index_file))
+    {
+        const std::uint8_t* data = my->tar->data();
+        my->scan([=](std::uint64_t offset, std::size_t) { return data + offset; }, my->entries, my->index);
+    }
+}
+
+TarFileSystem::~TarFileSystem () {}
+
+void TarFileSystem::enable_verification (const Path& tree_file, const Digest* expected_root)
+{
+    std::unique_ptr<MerkleVerifier> verifier(new MerkleVerifier(tree_file, my->tar->size(), expected_root));
+
+    // The entries were scanned, or loaded from an index, before
+    // verification was enabled. Scan the headers again through the
+    // verifier, a window at a time so that each block is hashed once,
+    // and check that they give the same members.
+    const std::uint64_t WINDOW = 1 << 20;
+    const std::uint8_t* data = my->tar->data();
+    std::uint64_t size = my->tar->size();
+    std::vector<std::uint8_t> window, extended;
+    std::uint64_t window_start = UINT64_MAX;
+    auto read = [&](std::uint64_t offset, std::size_t n) -> const std::uint8_t*
+    {
+        std::uint64_t start = offset / WINDOW * WINDOW;
+        if (offset + n > start + WINDOW)
+        {
+            // Extended header data may cross windows.
+            extended.resize(n);
+            verifier->read_at(data, offset, extended.data(), n);
+            return extended.data();
+        }
+        if (start != window_start)
+        {
+            window.resize((std::size_t) std::min(WINDOW, size - start));
+            verifier->read_at(data, start, window.data(), window.size());
+            window_start = start;
+        }
+        return window.data() + (offset - start);
+    };
+    std::vector<impl::Entry> entries;
+    PathIndex index;
+    my->scan(read, entries, index);
+
+    bool match = index.size() == my->index.size();
+    index.enumerate("", [&](const std::string& path, std::uint32_t i)
+    {
+        std::uint32_t known;
+        match = match && my->find_exact(path.c_str(), known) &&
+                my->entries[known].offset == entries[i].offset && my->entries[known].size == entries[i].size;
+    });
+    if (!match)
+        throw EXCEPTION("Tar members of " + my->path + " do not match the verified archive");
+    my->verifier = std::move(verifier);
+}
+
+void TarFileSystem::verify_all ()
+{
+    if (!my->verifier)
+        throw EXCEPTION("Verification not enabled for " + my->path);
+    my->verifier->verify_all(my->tar->data());
+}
+
+void TarFileSystem::save_index (const Path& index_file) const
+{
+    std::ofstream out(index_file, std::ios::binary);
+    if (!out)
+        throw EXCEPTION("Failed writing tar index " + std::string(index_file));
+
+    // Hash the paths by their position in the index.
+    std::vector<std::string> paths;
+    paths.reserve(my->index.size());
+    my->index.enumerate("", [&](const std::string& path, std::uint32_t)
+    {
+        paths.push_back(path);
+    });
+    PerfectHash hash;
+    hash.build(paths);
+
+    out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    put(out, INDEX_VERSION, 4);
+    put(out, my->tar->size(), 8);
+    put(out, my->entries.size(), 8);
+    for (std::size_t i = 0; i < my->entries.size(); ++i)
+    {
+        put(out, my->entries[i].offset, 8);
+        put(out, my->entries[i].size, 8);
+    }
+    put(out, my->index.image_size(), 8);
+    out.write((const char*) my->index.image(), my->index.image_size());
+    out.write((const char*) hash.image(), hash.image_size());
+    if (!out)
+        throw EXCEPTION("Failed writing tar index " + std::string(index_file));
+}
+
+FileHandler* TarFileSystem::open (const FilePath& filepath)
+{
+    std::uint32_t entry;
+    if (!my->find(filepath, entry)) return nullptr;
+    return open_resolved(entry);
+}
+
+bool TarFileSystem::resolve (const FilePath& filepath, std::uint64_t& entry)
+{
+    std::uint32_t i;
+    if (!my->find(filepath, i)) return false;
+    entry = i;
+    return true;
+}
+
+void TarFileSystem::setFoldedLookup (bool enable)
+{
+    if (!enable)
+        my->folded.reset();
+    else if (!my->folded)
+    {
+        my->folded.reset(new FoldedIndex);
+        my->folded->build(my->index);
+    }
+}
+
+std::vector<std::string> TarFileSystem::folded_collisions () const
+{
+    return my->folded ? my->folded->collisions() : std::vector<std::string>();
+}
+
+FileHandler* TarFileSystem::open_resolved (std::uint64_t entry)
+{
+    if (entry >= my->entries.size()) return nullptr;
+    const impl::Entry& e = my->entries[(std::size_t) entry];
+    if (my->verifier)
+    {
+        // The entries were checked against the verified headers; the
+        // mapping may change once checked, so serve a verified copy.
+        std::size_t size = (std::size_t) e.size;
+        std::shared_ptr<std::uint8_t> copy(new std::uint8_t[std::max<std::size_t>(size, 1)],
+                                           std::default_delete<std::uint8_t[]>());
+        my->verifier->read_at(my->tar->data(), e.offset, copy.get(), size);
+        return new MemFile(copy, copy.get(), size);
+    }
+    return new MemFile(my->tar, my->tar->data() + e.offset, (std::size_t) e.size);
+}
@@ -0,0 +1,1358 @@
+#include <file.h>
+#include <cpp/Exception.h>
+#include "io.h"
+#include "parallel.h"
+#include "merkle.h"
+#include "fold.h"
+#include "pathindex.h"
+#include "pool.h"
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+#include <zlib.h>
+#endif
+#if !defined(FILESYSTEM_DISABLE_ZIP) && !defined(FILESYSTEM_DISABLE_ZSTD)
+#include <zdict.h>
+#endif
+
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <new>
+
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+
+using Clock = std::chrono::steady_clock;
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+
+namespace
+{
+
+// Record signatures.
+const std::uint32_t LOCAL_HEADER = 0x04034b50;
+const std::uint32_t CENTRAL_HEADER = 0x02014b50;
+const std::uint32_t END_OF_CENTRAL_DIR = 0x06054b50;
+const std::uint32_t ZIP64_END_OF_CENTRAL_DIR = 0x06064b50;
+const std::uint32_t ZIP64_LOCATOR = 0x07064b50;
+
+// Fixed record sizes.
+const std::size_t LOCAL_HEADER_SIZE = 30;
+const std::size_t CENTRAL_HEADER_SIZE = 46;
+const std::size_t END_OF_CENTRAL_DIR_SIZE = 22;
+const std::size_t ZIP64_LOCATOR_SIZE = 20;
+const std::size_t ZIP64_END_OF_CENTRAL_DIR_SIZE = 56;
+
+// Batched reads merge entries separated by less than BATCH_GAP bytes,
+// up to BATCH_RUN bytes per read.
+const std::uint64_t BATCH_GAP = 256 << 10;
+const std::uint64_t BATCH_RUN = 64 << 20;
+
+// Central directories of at least this many entries are parsed in parallel.
+const std::uint64_t PARALLEL_ENTRIES = 16384;
+
+// Archives of fewer entries also look paths up in a hash map; larger ones
+// only in the compact index, which decodes paths to compare them.
+const std::size_t COMPACT_ENTRIES = 1 << 18;
+
+// Progressive reads fetch compressed data in steps of this many bytes.
+const std::size_t STREAM_INPUT = 64 << 10;
+
+// Compression methods.
+const std::uint16_t STORED = 0;
+const std::uint16_t DEFLATED = 8;
+const std::uint16_t ZSTD = 93;
+
+// Private extra field of the central directory holding the SHA-256 of an
+// entry's uncompressed data, written by ZipWriter for content keys.
+const std::uint16_t SHA256_FIELD = 0x4B58;
+const std::uint32_t NO_DIGEST = 0xFFFFFFFF;
+
+bool supported (std::uint16_t method)
+{
+    bool supported = method == STORED || method == DEFLATED;
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    supported |= method == ZSTD;
+#endif
+    return supported;
+}
+
+std::uint16_t read16 (const std::uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+std::uint32_t read32 (const std::uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((std::uint32_t) p[3] << 24);
+}
+
+std::uint64_t read64 (const std::uint8_t* p)
+{
+    return read32(p) | ((std::uint64_t) read32(p+4) << 32);
+}
+
+/// Ends an inflate stream when it goes out of scope.
+struct InflateEnd
+{
+    z_stream& z;
+
+    ~InflateEnd () { inflateEnd(&z); }
+};
+
+void put (std::ofstream& out, std::uint64_t value, std::size_t bytes)
+{
+    char buf[8];
+    for (std::size_t i = 0; i < bytes; ++i) buf[i] = (char) (value >> (8*i));
+    out.write(buf, bytes);
+}
+
+/// Return the CRC-32 of 'data', continuing from the CRC 'crc' of the
+/// bytes before it.
+std::uint32_t checksum (const std::uint8_t* data, std::size_t size, std::uint32_t crc = 0)
+{
+    for (std::size_t pos = 0; pos < size; pos += 1u << 30)
+        crc = (std::uint32_t) crc32(crc, data + pos, (uInt) std::min<std::size_t>(size - pos, 1u << 30));
+    return crc;
+}
+
+// Versions needed to extract, by feature.
+const std::uint16_t VERSION_DEFLATE = 20;
+const std::uint16_t VERSION_ZIP64 = 45;
+const std::uint16_t VERSION_ZSTD = 63;
+
+// Names are UTF-8.
+const std::uint16_t FLAG_UTF8 = 0x0800;
+
+// Entries are dated 1980-01-01, so that archives of the same files are
+// identical.
+const std::uint16_t DOS_DATE = (1 << 5) | 1;
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+struct FreeDDict
+{
+    void operator() (ZSTD_DDict* ddict) const { ZSTD_freeDDict(ddict); }
+};
+
+struct FreeCDict
+{
+    void operator() (ZSTD_CDict* cdict) const { ZSTD_freeCDict(cdict); }
+};
+
+struct FreeCCtx
+{
+    void operator() (ZSTD_CCtx* cctx) const { ZSTD_freeCCtx(cctx); }
+};
+
+// Trained dictionaries start with this magic number and their ID.
+const std::uint32_t DICTIONARY_MAGIC = 0xEC30A437;
+
+// IDs below this are reserved by the zstd format.
+const std::uint32_t FIRST_DICTIONARY_ID = 32768;
+#endif
+
+} // namespace
+
+#endif // FILESYSTEM_DISABLE_ZIP
+
+// ZipFileSystem
+
+struct ZipFileSystem::impl
+{
+    /// An entry of the central directory.
+    struct Entry
+    {
+        std::uint64_t offset; // offset of the local header
+        std::uint64_t csize; // compressed size
+        std::uint64_t usize; // uncompressed size
+        std::uint32_t key; // position of the entry's path in the index
+        std::uint32_t crc;
+        std::uint32_t header; // local header size as given by the central directory
+        std::uint32_t digest; // index in 'digests', or NO_DIGEST
+        std::uint16_t method;
+        std::uint16_t flags;
+    };
+
+    std::string path;
+    RandomAccessFile file;
+    std::vector<Entry> entries;
+    std::vector<Digest> digests; // SHA-256 of the entries that record one
+    PathIndex index;
+    std::unordered_map<std::string, std::uint32_t> lookup; // empty for large archives
+    std::uint64_t cd_offset = 0;
+
+    // Set by setFoldedLookup.
+    std::unique_ptr<FoldedIndex> folded;
+
+    // Set by enable_verification; entry data is then read through it.
+    std::unique_ptr<MerkleVerifier> verifier;
+
+    // Groups are read from the manifest on first use.
+    std::once_flag groups_loaded;
+    std::unordered_map<std::string, std::vector<std::uint32_t>> groups;
+
+    // Entries under dictionary_prefix.
+    std::vector<std::uint32_t> dictionary_entries;
+
+#if !defined(FILESYSTEM_DISABLE_ZIP) && !defined(FILESYSTEM_DISABLE_ZSTD)
+    // Dictionaries are digested with the first entry needing one, by ID.
+    mutable std::once_flag dictionaries_loaded;
+    mutable std::unordered_map<std::uint32_t, std::unique_ptr<ZSTD_DDict, FreeDDict>> dictionaries;
+
+    void load_dictionaries () const;
+
+    /// Decompress a zstd entry of 'csize' bytes at 'in' into 'out'.
+    void unzstd (const Entry&, const std::uint8_t* in, std::size_t csize, std::uint8_t* out) const;
+#endif
+
+    void read_central_directory ();
+
+    /// Parse the central directory record at 'p'. 'name' is left empty
+    /// for directories; 'digest' points to the entry's SHA-256, or is null.
+    /// Return the next record, or null if the record is not valid.
+    static const std::uint8_t* parse_record (const std::uint8_t* p, const std::uint8_t* end,
+                                             Entry&, std::string& name, const std::uint8_t*& digest);
+
+    void parse_central_directory (const std::vector<std::uint8_t>& cd, std::uint64_t count);
+
+    /// Parse ranges of the central directory in parallel.
+    /// Return false if the ranges could not be split at record boundaries.
+    bool parse_central_directory_parallel (const std::vector<std::uint8_t>& cd);
+
+    /// Add a parsed entry; 'paths' collects the paths of the entries.
+    void add (const Entry&, std::string&& name, const std::uint8_t* digest,
+              std::vector<std::pair<std::string, std::uint32_t>>& paths);
+
+    /// Build the index from the paths of the entries and key the entries.
+    void build_index (std::vector<std::pair<std::string, std::uint32_t>>& paths);
+
+    /// Look a path up exactly.
+    bool find_exact (const char* path, std::uint32_t& entry) const
+    {
+        if (lookup.empty()) return index.find(path, entry);
+        auto it = lookup.find(path);
+        if (it == lookup.end()) return false;
+        entry = it->second;
+        return true;
+    }
+
+    /// Look a path up, exactly then folded.
+    bool find (const char* path, std::uint32_t& entry) const
+    {
+        return find_exact(path, entry) || (folded && folded->find(path, entry));
+    }
+
+    std::size_t read_at (std::uint64_t offset, void* buffer, std::size_t size) const
+    {
+        return verifier ? verifier->read_at(file, offset, buffer, size) : file.read_at(offset, buffer, size);
+    }
+    void load_groups ();
+
+    /// Decompress an entry whose local header starts at 'local' into a
+    /// buffer allocated from 'memory'.
+    /// 'available' is the number of bytes readable from 'local'; the entry
+    /// data is read from the file if it extends past them.
+    Buffer extract (const Entry&, const std::uint8_t* local,
+                    std::size_t available, SlowOpLog*, MemoryResource* memory) const;
+
+    /// Read and decompress an entry.
+    Buffer extract (const Entry&, SlowOpLog*, MemoryResource* memory) const;
+
+    /// Read and decompress an entry in chunks of up to 'chunk_size' bytes,
+    /// passing each to 'callback' once it is full or the entry ends.
+    /// Return false if the callback stopped early.
+    bool stream (const Entry&, std::size_t chunk_size, const ChunkCallback& callback) const;
+
+    /// Read and decompress entries in order of their offsets, merging
+    /// nearby entries into one read. 'data' receives the entries' data in
+    /// the order of 'members'.
+    void extract_batch (const std::vector<std::uint32_t>& members,
+                        std::vector<Buffer>& data, SlowOpLog*, MemoryResource* memory) const;
+};
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+
+void ZipFileSystem::impl::read_central_directory ()
+{
+    // The end of central directory record sits at the end of the file,
+    // followed by a comment of up to 64K.
+    std::uint64_t file_size = file.size();
+    std::size_t tail_size = (std::size_t) std::min<std::uint64_t>(file_size, END_OF_CENTRAL_DIR_SIZE + 0xFFFF + ZIP64_LOCATOR_SIZE);
+    std::vector<std::uint8_t> tail(tail_size);
+    std::uint64_t tail_offset = file_size - tail_size;
+    if (file.read_at(tail_offset, tail.data(), tail_size) != tail_size)
+        throw EXCEPTION("Failed reading zip file " + path);
+    if (tail_size < END_OF_CENTRAL_DIR_SIZE)
+        throw EXCEPTION("Not a zip file: " + path);
+
+    std::size_t eocd = tail_size;
+    for (std::size_t i = tail_size - END_OF_CENTRAL_DIR_SIZE + 1; i-- > 0; )
+    {
+        if (read32(&tail[i]) == END_OF_CENTRAL_DIR)
+        {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == tail_size)
+        throw EXCEPTION("Not a zip file: " + path);
+
+    std::uint64_t count = read16(&tail[eocd + 10]);
+    std::uint64_t cd_size = read32(&tail[eocd + 12]);
+    std::uint64_t cd_offset = read32(&tail[eocd + 16]);
+
+    // Zip64 archives store the real values in a second record, found
+    // through a locator that precedes the end of central directory.
+    if (eocd >= ZIP64_LOCATOR_SIZE && read32(&tail[eocd - ZIP64_LOCATOR_SIZE]) == ZIP64_LOCATOR)
+    {
+        std::uint64_t offset = read64(&tail[eocd - ZIP64_LOCATOR_SIZE + 8]);
+        std::uint8_t record[ZIP64_END_OF_CENTRAL_DIR_SIZE];
+        if (file.read_at(offset, record, sizeof(record)) != sizeof(record) ||
+            read32(record) != ZIP64_END_OF_CENTRAL_DIR)
+            throw EXCEPTION("Corrupt zip64 end of central directory in " + path);
+        count = read64(record + 32);
+        cd_size = read64(record + 40);
+        cd_offset = read64(record + 48);
+    }
+
+    if (cd_offset > file_size || cd_size > file_size - cd_offset)
+        throw EXCEPTION("Corrupt central directory in " + path);
+
+    std::vector<std::uint8_t> cd((std::size_t) cd_size);
+    if (file.read_at(cd_offset, cd.data(), cd.size()) != cd.size())
+        throw EXCEPTION("Failed reading central directory of " + path);
+    this->cd_offset = cd_offset;
+
+    count = std::min<std::uint64_t>(count, cd_size / CENTRAL_HEADER_SIZE);
+    if (count < PARALLEL_ENTRIES || !parse_central_directory_parallel(cd))
+        parse_central_directory(cd, count);
+}
+
+Buffer ZipFileSystem::impl::extract (const Entry& entry, const std::uint8_t* local,
+                                     std::size_t available, SlowOpLog* slow_ops,
+                                     MemoryResource* memory) const
+{
+    auto name = [&]() { return index.path(entry.key); };
+    if (available < LOCAL_HEADER_SIZE || read32(local) != LOCAL_HEADER)
+        throw EXCEPTION("Corrupt local header for " + name() + " in " + path);
+    if (entry.flags & 1)
+        throw EXCEPTION("Encrypted zip entries are not supported: " + name());
+    if (!supported(entry.method))
+        throw EXCEPTION("Unsupported compression method for " + name());
+
+    std::size_t header = LOCAL_HEADER_SIZE + read16(local + 26) + read16(local + 28);
+    std::size_t csize = (std::size_t) entry.csize;
+    std::size_t usize = (std::size_t) entry.usize;
+
+    // The local extra field may be longer than the central one;
+    // fall back to a separate read if the data is not in the buffer.
+    const std::uint8_t* data = local + header;
+    PooledBuffer spill;
+    if (header + csize > available)
+    {
+        spill.resize(csize);
+        if (read_at(entry.offset + header, spill.data(), csize) != csize)
+            throw EXCEPTION("Failed reading " + name() + " from " + path);
+        data = spill.data();
+    }
+
+    Buffer out = allocate_buffer(usize, memory);
+    Clock::time_point start = Clock::now();
+    if (entry.method == STORED)
+    {
+        if (csize != usize)
+            throw EXCEPTION("Corrupt zip entry " + name());
+        std::memcpy(out.get(), data, usize);
+    }
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    else if (entry.method == ZSTD)
+        unzstd(entry, data, csize, out.get());
+#endif
+    else
+    {
+        z_stream z;
+        std::memset(&z, 0, sizeof(z));
+        z.zalloc = pool_zalloc;
+        z.zfree = pool_zfree;
+        if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+            throw EXCEPTION("Failed initialising zlib");
+        // Sizes beyond 4G are fed in uInt-sized steps.
+        std::size_t in = 0, out_pos = 0;
+        int ret = Z_OK;
+        while (ret == Z_OK)
+        {
+            z.next_in = (Bytef*) data + in;
+            z.avail_in = (uInt) std::min<std::size_t>(csize - in, 1u << 30);
+            z.next_out = out.get() + out_pos;
+            z.avail_out = (uInt) std::min<std::size_t>(usize - out_pos, 1u << 30);
+            std::size_t avail_in = z.avail_in, avail_out = z.avail_out;
+            ret = inflate(&z, Z_NO_FLUSH);
+            in += avail_in - z.avail_in;
+            out_pos += avail_out - z.avail_out;
+        }
+        inflateEnd(&z);
+        if (ret != Z_STREAM_END || out_pos != usize)
+            throw EXCEPTION("Corrupt zip entry " + name());
+    }
+
+    if (checksum(out.get(), usize) != entry.crc)
+        throw EXCEPTION("CRC mismatch for zip entry " + name());
+    // The name is decoded from the index only for slow entries.
+    std::chrono::nanoseconds elapsed = Clock::now() - start;
+    if (slow_ops && elapsed >= slow_ops->thresholds().decompress)
+        slow_ops->record(SlowOp::Decompress, name().c_str(), "ZipFileSystem", usize, elapsed);
+    return out;
+}
+
+Buffer ZipFileSystem::impl::extract (const Entry& entry, SlowOpLog* slow_ops,
+                                     MemoryResource* memory) const
+{
+    PooledBuffer buffer(entry.header + (std::size_t) entry.csize);
+    std::size_t n = read_at(entry.offset, buffer.data(), buffer.size());
+    return extract(entry, buffer.data(), n, slow_ops, memory);
+}
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+
+void ZipFileSystem::impl::load_dictionaries () const
+{
+    for (std::uint32_t i : dictionary_entries)
+    {
+        const Entry& entry = entries[i];
+        // Dictionaries are not compressed with dictionaries, so that
+        // loading them cannot recurse.
+        if (entry.method == ZSTD)
+            throw EXCEPTION("Compressed zstd dictionary " + index.path(entry.key) + " in " + path);
+        Buffer data = extract(entry, nullptr, nullptr);
+        std::unique_ptr<ZSTD_DDict, FreeDDict> ddict(ZSTD_createDDict(data.get(), (std::size_t) entry.usize));
+        std::uint32_t id = ZSTD_getDictID_fromDict(data.get(), (std::size_t) entry.usize);
+        if (!ddict || !id)
+            throw EXCEPTION("Corrupt zstd dictionary " + index.path(entry.key) + " in " + path);
+        dictionaries[id] = std::move(ddict);
+    }
+}
+
+void ZipFileSystem::impl::unzstd (const Entry& entry, const std::uint8_t* in, std::size_t csize,
+                                  std::uint8_t* out) const
+{
+    auto name = [&]() { return index.path(entry.key); };
+    std::size_t usize = (std::size_t) entry.usize;
+
+    // Frames name the dictionary they were compressed with, if any.
+    std::size_t n;
+    if (std::uint32_t id = ZSTD_getDictID_fromFrame(in, csize))
+    {
+        std::call_once(dictionaries_loaded, [this]() { load_dictionaries(); });
+        auto it = dictionaries.find(id);
+        if (it == dictionaries.end())
+            throw EXCEPTION("Missing zstd dictionary " + std::to_string(id) + " for " + name() + " in " + path);
+        n = ZSTD_decompress_usingDDict(zstd_context(), out, usize, in, csize, it->second.get());
+    }
+    else
+        n = ZSTD_decompressDCtx(zstd_context(), out, usize, in, csize);
+    if (ZSTD_isError(n) || n != usize)
+        throw EXCEPTION("Corrupt zip entry " + name());
+}
+
+#endif // FILESYSTEM_DISABLE_ZSTD
+
+bool ZipFileSystem::impl::stream (const Entry& entry, std::size_t chunk_size,
+                                  const ChunkCallback& callback) const
+{
+    auto name = [&]() { return index.path(entry.key); };
+    std::uint8_t local[LOCAL_HEADER_SIZE];
+    if (read_at(entry.offset, local, LOCAL_HEADER_SIZE) != LOCAL_HEADER_SIZE || read32(local) != LOCAL_HEADER)
+        throw EXCEPTION("Corrupt local header for " + name() + " in " + path);
+    if (entry.flags & 1)
+        throw EXCEPTION("Encrypted zip entries are not supported: " + name());
+    if (!supported(entry.method))
+        throw EXCEPTION("Unsupported compression method for " + name());
+    if (entry.method == STORED && entry.csize != entry.usize)
+        throw EXCEPTION("Corrupt zip entry " + name());
+
+    // zstd entries are small files; they are decompressed whole and
+    // passed on in chunks.
+    if (entry.method == ZSTD)
+    {
+        Buffer whole = extract(entry, nullptr, nullptr);
+        for (std::uint64_t offset = 0; offset < entry.usize; offset += chunk_size)
+        {
+            std::size_t n = (std::size_t) std::min<std::uint64_t>(chunk_size, entry.usize - offset);
+            if (!callback(whole.get() + offset, n, offset)) return false;
+        }
+        return true;
+    }
+
+    std::uint64_t data = entry.offset + LOCAL_HEADER_SIZE + read16(local + 26) + read16(local + 28);
+    chunk_size = std::min<std::size_t>(chunk_size, 1u << 30); // zlib counts in uInt
+    PooledBuffer out(chunk_size);
+    std::uint32_t crc = 0;
+    std::uint64_t offset = 0; // of the next chunk in the entry
+
+    if (entry.method == STORED)
+    {
+        while (offset < entry.usize)
+        {
+            std::size_t n = (std::size_t) std::min<std::uint64_t>(chunk_size, entry.usize - offset);
+            if (read_at(data + offset, out.data(), n) != n)
+                throw EXCEPTION("Failed reading " + name() + " from " + path);
+            crc = checksum(out.data(), n, crc);
+            if (!callback(out.data(), n, offset)) return false;
+            offset += n;
+        }
+    }
+    else
+    {
+        z_stream z;
+        std::memset(&z, 0, sizeof(z));
+        z.zalloc = pool_zalloc;
+        z.zfree = pool_zfree;
+        if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+            throw EXCEPTION("Failed initialising zlib");
+        InflateEnd end = { z };
+
+        PooledBuffer in(STREAM_INPUT);
+        std::uint64_t fetched = 0;
+        std::size_t filled = 0; // bytes of the chunk inflated so far
+        int ret = Z_OK;
+        while (ret != Z_STREAM_END)
+        {
+            if (z.avail_in == 0 && fetched < entry.csize)
+            {
+                std::size_t n = (std::size_t) std::min<std::uint64_t>(in.size(), entry.csize - fetched);
+                if (read_at(data + fetched, in.data(), n) != n)
+                    throw EXCEPTION("Failed reading " + name() + " from " + path);
+                z.next_in = in.data();
+                z.avail_in = (uInt) n;
+                fetched += n;
+            }
+            z.next_out = out.data() + filled;
+            z.avail_out = (uInt) (chunk_size - filled);
+            ret = inflate(&z, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END)
+                throw EXCEPTION("Corrupt zip entry " + name());
+
+            // Chunks are passed on once full, and the last once the stream ends.
+            filled = chunk_size - z.avail_out;
+            if (filled == chunk_size || (ret == Z_STREAM_END && filled > 0))
+            {
+                if (offset + filled > entry.usize)
+                    throw EXCEPTION("Corrupt zip entry " + name());
+                crc = checksum(out.data(), filled, crc);
+                if (!callback(out.data(), filled, offset)) return false;
+                offset += filled;
+                filled = 0;
+            }
+        }
+    }
+
+    if (offset != entry.usize)
+        throw EXCEPTION("Corrupt zip entry " + name());
+    if (crc != entry.crc)
+        throw EXCEPTION("CRC mismatch for zip entry " + name());
+    return true;
+}
+
+const std::uint8_t* ZipFileSystem::impl::parse_record (const std::uint8_t* p, const std::uint8_t* end,
+                                                      Entry& entry, std::string& name,
+                                                      const std::uint8_t*& digest)
+{
+    if (p + CENTRAL_HEADER_SIZE > end || read32(p) != CENTRAL_HEADER) return nullptr;
+    std::uint16_t name_len = read16(p + 28);
+    std::uint16_t extra_len = read16(p + 30);
+    std::uint16_t comment_len = read16(p + 32);
+    const std::uint8_t* name_ = p + CENTRAL_HEADER_SIZE;
+    const std::uint8_t* extra = name_ + name_len;
+    const std::uint8_t* next = extra + extra_len + comment_len;
+    if (next > end) return nullptr;
+
+    entry.flags = read16(p + 8);
+    entry.method = read16(p + 10);
+    entry.crc = read32(p + 16);
+    entry.csize = read32(p + 20);
+    entry.usize = read32(p + 24);
+    entry.offset = read32(p + 42);
+    entry.header = LOCAL_HEADER_SIZE + name_len + extra_len;
+    entry.digest = NO_DIGEST;
+    digest = nullptr;
+
+    // Sizes and offset that do not fit 32 bits live in the zip64
+    // extra field, in this order, only if their 32-bit field is saturated.
+    for (const std::uint8_t* e = extra; e + 4 <= extra + extra_len; )
+    {
+        std::uint16_t id = read16(e);
+        std::uint16_t len = read16(e + 2);
+        const std::uint8_t* data = e + 4;
+        const std::uint8_t* data_end = std::min(data + len, extra + extra_len);
+        if (id == 0x0001)
+        {
+            if (entry.usize == 0xFFFFFFFF && data + 8 <= data_end) { entry.usize = read64(data); data += 8; }
+            if (entry.csize == 0xFFFFFFFF && data + 8 <= data_end) { entry.csize = read64(data); data += 8; }
+            if (entry.offset == 0xFFFFFFFF && data + 8 <= data_end) { entry.offset = read64(data); data += 8; }
+        }
+        else if (id == SHA256_FIELD && len == 32 && data + 32 <= data_end)
+            digest = data;
+        e = data_end;
+    }
+
+    // Directories are implied by the paths of the files they hold.
+    name.assign((const char*) name_, name_len);
+    if (name_len == 0 || name_[name_len - 1] == '/') name.clear();
+    return next;
+}
+
+void ZipFileSystem::impl::add (const Entry& entry, std::string&& name, const std::uint8_t* digest,
+                               std::vector<std::pair<std::string, std::uint32_t>>& paths)
+{
+    // Entry data precedes the central directory.
+    if (entry.offset > cd_offset || entry.csize > cd_offset - entry.offset)
+        throw EXCEPTION("Corrupt central directory entry " + name + " in " + path);
+    if (name.compare(0, std::strlen(dictionary_prefix), dictionary_prefix) == 0)
+        dictionary_entries.push_back((std::uint32_t) entries.size());
+    paths.emplace_back(std::move(name), (std::uint32_t) entries.size());
+    entries.push_back(entry);
+    if (digest)
+    {
+        entries.back().digest = (std::uint32_t) digests.size();
+        digests.emplace_back();
+        std::memcpy(digests.back().data(), digest, 32);
+    }
+}
+
+void ZipFileSystem::impl::build_index (std::vector<std::pair<std::string, std::uint32_t>>& paths)
+{
+    index.build(paths);
+    if (paths.size() < COMPACT_ENTRIES)
+    {
+        // Sorted stably, so the first entry of a path is emplaced first.
+        lookup.reserve(paths.size());
+        for (const auto& path : paths)
+            lookup.emplace(path.first, path.second);
+    }
+
+    // Entries of the same path share its key; the index resolves the path
+    // to the first of them.
+    std::uint32_t key = 0;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        if (i > 0 && paths[i].first != paths[i - 1].first) ++key;
+        entries[paths[i].second].key = key;
+    }
+}
+
+void ZipFileSystem::impl::parse_central_directory (const std::vector<std::uint8_t>& cd, std::uint64_t count)
+{
+    std::vector<std::pair<std::string, std::uint32_t>> paths;
+    entries.reserve((std::size_t) count);
+    paths.reserve((std::size_t) count);
+    const std::uint8_t* p = cd.data();
+    const std::uint8_t* end = p + cd.size();
+    while (p + CENTRAL_HEADER_SIZE <= end && read32(p) == CENTRAL_HEADER)
+    {
+        Entry entry;
+        std::string name;
+        const std::uint8_t* digest;
+        p = parse_record(p, end, entry, name, digest);
+        if (!p)
+            throw EXCEPTION("Corrupt central directory in " + path);
+        if (!name.empty()) add(entry, std::move(name), digest, paths);
+    }
+    build_index(paths);
+}
+
+bool ZipFileSystem::impl::parse_central_directory_parallel (const std::vector<std::uint8_t>& cd)
+{
+    const std::uint8_t* begin = cd.data();
+    const std::uint8_t* end = begin + cd.size();
+
+    // Split the directory into ranges starting at record signatures.
+    // A signature may also appear inside a name, extra field or comment;
+    // such false starts are caught below, when the records of each range
+    // do not chain into the next range.
+    std::size_t ranges = 4 * std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const std::uint8_t*> starts(1, begin);
+    for (std::size_t k = 1; k < ranges; ++k)
+    {
+        const std::uint8_t* q = std::max(begin + cd.size() / ranges * k, starts.back() + 1);
+        while (q + CENTRAL_HEADER_SIZE <= end && read32(q) != CENTRAL_HEADER) ++q;
+        if (q + CENTRAL_HEADER_SIZE > end) break;
+        starts.push_back(q);
+    }
+    starts.push_back(end);
+
+    struct Range
+    {
+        std::vector<Entry> entries;
+        std::vector<std::string> names;
+        std::vector<const std::uint8_t*> digests;
+        bool chained = false;
+    };
+    std::vector<Range> parsed(starts.size() - 1);
+    parallel_for(parsed.size(), [&](std::size_t k)
+    {
+        Range& range = parsed[k];
+        const std::uint8_t* p = starts[k];
+        const std::uint8_t* stop = starts[k + 1];
+        bool last = k + 1 == parsed.size();
+        while (p < stop && (!last || (p + CENTRAL_HEADER_SIZE <= end && read32(p) == CENTRAL_HEADER)))
+        {
+            Entry entry;
+            std::string name;
+            const std::uint8_t* digest;
+            p = parse_record(p, end, entry, name, digest);
+            if (!p) return;
+            range.entries.push_back(entry);
+            range.names.push_back(std::move(name));
+            range.digests.push_back(digest);
+        }
+        range.chained = last || p == stop;
+    });
+
+    for (const Range& range : parsed)
+        if (!range.chained) return false;
+
+    std::size_t count = 0;
+    for (const Range& range : parsed) count += range.entries.size();
+    std::vector<std::pair<std::string, std::uint32_t>> paths;
+    entries.reserve(count);
+    paths.reserve(count);
+    for (Range& range : parsed)
+        for (std::size_t i = 0; i < range.entries.size(); ++i)
+            if (!range.names[i].empty()) add(range.entries[i], std::move(range.names[i]), range.digests[i], paths);
+    build_index(paths);
+    return true;
+}
+
+void ZipFileSystem::impl::extract_batch (const std::vector<std::uint32_t>& members,
+                                         std::vector<Buffer>& data,
+                                         SlowOpLog* slow_ops, MemoryResource* memory) const
+{
+    std::vector<std::size_t> order(members.size());
+    for (std::size_t k = 0; k < order.size(); ++k) order[k] = k;
+    std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+    {
+        return entries[members[a]].offset < entries[members[b]].offset;
+    });
+
+    data.resize(members.size());
+    PooledBuffer run;
+    for (std::size_t first = 0; first < order.size(); )
+    {
+        // Extend the run while the next entry is close enough.
+        const Entry& start = entries[members[order[first]]];
+        std::uint64_t lo = start.offset;
+        std::uint64_t hi = start.offset + start.header + start.csize;
+        std::size_t last = first + 1;
+        for (; last < order.size(); ++last)
+        {
+            const Entry& entry = entries[members[order[last]]];
+            std::uint64_t end = std::max(hi, entry.offset + entry.header + entry.csize);
+            if (entry.offset > hi + BATCH_GAP || end - lo > BATCH_RUN) break;
+            hi = end;
+        }
+
+        run.resize((std::size_t) (hi - lo));
+        std::size_t n = read_at(lo, run.data(), run.size());
+        parallel_for(last - first, [&](std::size_t k)
+        {
+            std::size_t m = order[first + k];
+            const Entry& entry = entries[members[m]];
+            std::size_t offset = (std::size_t) (entry.offset - lo);
+            std::size_t available = offset < n ? n - offset : 0;
+            data[m] = extract(entry, run.data() + offset, available, slow_ops, memory);
+        });
+        first = last;
+    }
+}
+
+void ZipFileSystem::impl::load_groups ()
+{
+    std::uint32_t manifest;
+    if (!find_exact(manifest_name, manifest)) return;
+
+    const Entry& entry = entries[manifest];
+    Buffer data = extract(entry, nullptr, nullptr);
+    const char* p = (const char*) data.get();
+    const char* end = p + entry.usize;
+
+    // One path per line; "[name]" starts a group and '#' a comment.
+    std::vector<std::uint32_t>* group = nullptr;
+    while (p < end)
+    {
+        const char* eol = std::find(p, end, '\n');
+        const char* last = eol;
+        while (p < last && (*p == ' ' || *p == '\t')) ++p;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) --last;
+        if (p < last && *p != '#')
+        {
+            if (*p == '[' && last[-1] == ']')
+                group = &groups[std::string(p + 1, last - 1)];
+            else if (group)
+            {
+                std::uint32_t member;
+                if (!find_exact(std::string(p, last).c_str(), member))
+                    throw EXCEPTION("Group member " + std::string(p, last) + " not found in " + path);
+                group->push_back(member);
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+#endif // FILESYSTEM_DISABLE_ZIP
+
+const char* const ZipFileSystem::manifest_name = ".groups";
+const char* const ZipFileSystem::dictionary_prefix = ".zstd-dictionaries/";
+
+ZipFileSystem::ZipFileSystem (const Path& zip_file)
+    : my(new impl)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    my->path = zip_file;
+    if (!my->file.open(zip_file))
+        throw EXCEPTION("Failed opening zip file " + my->path);
+    my->read_central_directory();
+#else
+    (void) zip_file;
+    throw EXCEPTION("zip files not supported in this FileSystem build");
+#endif
+}
+
+ZipFileSystem::~ZipFileSystem () {}
+
+void ZipFileSystem::enable_verification (const Path& tree_file, const Digest* expected_root)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    my->verifier.reset(new MerkleVerifier(tree_file, my->file.size(), expected_root));
+
+    // The central directory was read before verification was enabled;
+    // verify it now, or entries could point anywhere in the file.
+    std::vector<std::uint8_t> tail((std::size_t) (my->file.size() - my->cd_offset));
+    my->read_at(my->cd_offset, tail.data(), tail.size());
+#else
+    (void) tree_file;
+    (void) expected_root;
+#endif
+}
+
+void ZipFileSystem::verify_all ()
+{
+    if (!my->verifier)
+        throw EXCEPTION("Verification not enabled for " + my->path);
+    my->verifier->verify_all(my->file);
+}
+
+FileHandler* ZipFileSystem::open (const FilePath& filepath)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::uint32_t i;
+    if (!my->find(filepath, i)) return nullptr;
+    const impl::Entry& entry = my->entries[i];
+    Buffer data = my->extract(entry, slow_ops, memory);
+    return new MemFile(std::move(data), (std::size_t) entry.usize);
+#else
+    (void) filepath;
+    return nullptr;
+#endif
+}
+
+bool ZipFileSystem::resolve (const FilePath& filepath, std::uint64_t& entry)
+{
+    std::uint32_t i;
+    if (!my->find(filepath, i)) return false;
+    entry = i;
+    return true;
+}
+
+FileHandler* ZipFileSystem::open_resolved (std::uint64_t entry)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    if (entry >= my->entries.size()) return nullptr;
+    const impl::Entry& e = my->entries[(std::size_t) entry];
+    Buffer data = my->extract(e, slow_ops, memory);
+    return new MemFile(std::move(data), (std::size_t) e.usize);
+#else
+    (void) entry;
+    return nullptr;
+#endif
+}
+
+std::function<FileHandler* ()> ZipFileSystem::fetch (const FilePath& filepath)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::uint32_t i;
+    if (!my->find(filepath, i)) return nullptr;
+    const impl::Entry* entry = &my->entries[i];
+    std::shared_ptr<PooledBuffer> raw(new PooledBuffer(entry->header + (std::size_t) entry->csize));
+    std::size_t n = my->read_at(entry->offset, raw->data(), raw->size());
+
+    impl* zip = my.get();
+    SlowOpLog* log = slow_ops;
+    MemoryResource* resource = memory;
+    return [=]() -> FileHandler*
+    {
+        Buffer data = zip->extract(*entry, raw->data(), n, log, resource);
+        return new MemFile(std::move(data), (std::size_t) entry->usize);
+    };
+#else
+    (void) filepath;
+    return nullptr;
+#endif
+}
+
+bool ZipFileSystem::read_progressive (const FilePath& filepath, std::size_t chunk_size,
+                                      const ChunkCallback& callback, bool& finished)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::uint32_t i;
+    if (!my->find(filepath, i)) return false;
+    finished = my->stream(my->entries[i], chunk_size, callback);
+    return true;
+#else
+    (void) filepath;
+    (void) chunk_size;
+    (void) callback;
+    (void) finished;
+    return false;
+#endif
+}
+
+void ZipFileSystem::setFoldedLookup (bool enable)
+{
+    if (!enable)
+        my->folded.reset();
+    else if (!my->folded)
+    {
+        my->folded.reset(new FoldedIndex);
+        my->folded->build(my->index);
+    }
+}
+
+std::vector<std::string> ZipFileSystem::folded_collisions () const
+{
+    return my->folded ? my->folded->collisions() : std::vector<std::string>();
+}
+
+bool ZipFileSystem::content_key (std::uint64_t entry, ContentKey& key)
+{
+    if (entry >= my->entries.size()) return false;
+    const impl::Entry& e = my->entries[(std::size_t) entry];
+    if (e.digest >= my->digests.size()) return false; // none recorded
+    key.size = e.usize;
+    key.sha256 = my->digests[e.digest];
+    return true;
+}
+
+bool ZipFileSystem::content_key (const FilePath& filepath, std::uint64_t& entry, ContentKey& key)
+{
+    return resolve(filepath, entry) && content_key(entry, key);
+}
+
+bool ZipFileSystem::open_group (const char* name, std::vector<std::unique_ptr<FileHandler>>& files)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::call_once(my->groups_loaded, [this]() { my->load_groups(); });
+    auto it = my->groups.find(name);
+    if (it == my->groups.end()) return false;
+    const std::vector<std::uint32_t>& members = it->second;
+    if (members.empty()) return true;
+
+    std::vector<Buffer> data;
+    my->extract_batch(members, data, slow_ops, memory);
+
+    for (std::size_t k = 0; k < members.size(); ++k)
+        files.emplace_back(new MemFile(std::move(data[k]), (std::size_t) my->entries[members[k]].usize));
+    return true;
+#else
+    (void) name;
+    (void) files;
+    return false;
+#endif
+}
+
+void ZipFileSystem::open_batch (const std::vector<FilePath>& paths,
+                                std::vector<std::unique_ptr<FileHandler>>& files)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    std::vector<std::uint32_t> members;
+    std::vector<std::size_t> slots;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        if (files[i]) continue;
+        std::uint32_t entry;
+        if (!my->find(paths[i], entry)) continue;
+        members.push_back(entry);
+        slots.push_back(i);
+    }
+    if (members.empty()) return;
+
+    std::vector<Buffer> data;
+    my->extract_batch(members, data, slow_ops, memory);
+    for (std::size_t k = 0; k < members.size(); ++k)
+        files[slots[k]].reset(new MemFile(std::move(data[k]), (std::size_t) my->entries[members[k]].usize));
+#else
+    (void) paths;
+    (void) files;
+#endif
+}
+
+// ZipWriter
+
+struct ZipWriter::impl
+{
+    /// An entry written, for the central directory.
+    struct Written
+    {
+        std::string name;
+        std::uint64_t offset;
+        std::uint64_t csize;
+        std::uint64_t usize;
+        std::uint32_t crc;
+        std::uint16_t method;
+        Digest sha256; // of the uncompressed data
+    };
+
+    ZipWriterOptions options;
+    std::string path;
+    std::ofstream out;
+    std::uint64_t offset = 0;
+    std::vector<Written> written;
+    bool finished = false;
+
+#if !defined(FILESYSTEM_DISABLE_ZIP) && !defined(FILESYSTEM_DISABLE_ZSTD)
+    /// The small files of an extension, sharing a dictionary.
+    struct Family
+    {
+        std::vector<std::pair<std::string, std::vector<std::uint8_t>>> held; // until trained
+        std::size_t held_bytes = 0;
+        bool trained = false;
+        std::unique_ptr<ZSTD_CDict, FreeCDict> cdict; // null if training failed
+    };
+
+    std::map<std::string, Family> families;
+    std::uint32_t next_id = FIRST_DICTIONARY_ID;
+    std::unique_ptr<ZSTD_CCtx, FreeCCtx> cctx;
+
+    /// Train the family's dictionary on the files held and write them.
+    void train (Family&);
+
+    /// Write a small file, compressed with its family's dictionary.
+    void add_compressed (Family&, const std::string& name, const std::uint8_t* data, std::size_t size);
+#endif
+
+    /// Write a file, deflated or stored.
+    void add_deflated (const std::string& name, const std::uint8_t* data, std::size_t size);
+
+    /// Write an entry of 'csize' bytes at 'data', compressed with 'method'.
+    /// 'crc' and 'sha256' are those of the uncompressed data.
+    void write_entry (const std::string& name, std::uint16_t method, const std::uint8_t* data,
+                      std::uint64_t csize, std::uint64_t usize, std::uint32_t crc, const Digest& sha256);
+
+    void write_central_directory ();
+
+    void check ()
+    {
+        if (!out)
+            throw EXCEPTION("Failed writing zip file " + path);
+    }
+};
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+
+void ZipWriter::impl::write_entry (const std::string& name, std::uint16_t method, const std::uint8_t* data,
+                                   std::uint64_t csize, std::uint64_t usize, std::uint32_t crc,
+                                   const Digest& sha256)
+{
+    if (name.size() > 0xFFFF)
+        throw EXCEPTION("Path too long for zip file " + path + ": " + name);
+
+    // Sizes that do not fit 32 bits move to the zip64 extra field, which
+    // the local header gives both of.
+    bool zip64 = csize >= 0xFFFFFFFF || usize >= 0xFFFFFFFF;
+    std::uint16_t version = method == ZSTD ? VERSION_ZSTD : zip64 ? VERSION_ZIP64 : VERSION_DEFLATE;
+    put(out, LOCAL_HEADER, 4);
+    put(out, version, 2);
+    put(out, FLAG_UTF8, 2);
+    put(out, method, 2);
+    put(out, 0, 2);
+    put(out, DOS_DATE, 2);
+    put(out, crc, 4);
+    put(out, zip64 ? 0xFFFFFFFF : csize, 4);
+    put(out, zip64 ? 0xFFFFFFFF : usize, 4);
+    put(out, name.size(), 2);
+    put(out, zip64 ? 20 : 0, 2);
+    out.write(name.data(), name.size());
+    if (zip64)
+    {
+        put(out, 0x0001, 2);
+        put(out, 16, 2);
+        put(out, usize, 8);
+        put(out, csize, 8);
+    }
+    out.write((const char*) data, csize);
+    check();
+
+    Written entry = { name, offset, csize, usize, crc, method, sha256 };
+    written.push_back(std::move(entry));
+    offset += LOCAL_HEADER_SIZE + name.size() + (zip64 ? 20 : 0) + csize;
+}
+
+void ZipWriter::impl::add_deflated (const std::string& name, const std::uint8_t* data, std::size_t size)
+{
+    std::uint32_t crc = checksum(data, size);
+    Digest sha256 = Sha256::hash(data, size);
+
+    // Files are stored if deflating them does not save space.
+    PooledBuffer packed(size);
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    z.zalloc = pool_zalloc;
+    z.zfree = pool_zfree;
+    if (deflateInit2(&z, options.deflate_level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw EXCEPTION("Failed initialising zlib");
+    std::size_t in = 0, out_pos = 0;
+    int ret = Z_OK;
+    while (ret == Z_OK && out_pos < size)
+    {
+        // Sizes beyond 4G are fed in uInt-sized steps.
+        z.next_in = (Bytef*) data + in;
+        z.avail_in = (uInt) std::min<std::size_t>(size - in, 1u << 30);
+        z.next_out = packed.data() + out_pos;
+        z.avail_out = (uInt) std::min<std::size_t>(size - out_pos, 1u << 30);
+        std::size_t avail_in = z.avail_in, avail_out = z.avail_out;
+        ret = deflate(&z, in + avail_in == size ? Z_FINISH : Z_NO_FLUSH);
+        in += avail_in - z.avail_in;
+        out_pos += avail_out - z.avail_out;
+    }
+    deflateEnd(&z);
+
+    if (ret == Z_STREAM_END)
+        write_entry(name, DEFLATED, packed.data(), out_pos, size, crc, sha256);
+    else
+        write_entry(name, STORED, data, size, size, crc, sha256);
+}
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+
+void ZipWriter::impl::train (Family& family)
+{
+    family.trained = true;
+    std::vector<std::uint8_t> samples;
+    std::vector<std::size_t> sizes;
+    samples.reserve(family.held_bytes);
+    for (const auto& file : family.held)
+    {
+        samples.insert(samples.end(), file.second.begin(), file.second.end());
+        sizes.push_back(file.second.size());
+    }
+
+    // Too few or too uniform samples leave the family without a
+    // dictionary; its files are then deflated.
+    std::vector<std::uint8_t> dictionary(options.dictionary_size);
+    std::size_t n = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(),
+                                          sizes.data(), (unsigned) sizes.size());
+    if (!ZDICT_isError(n) && n > 8 && read32(dictionary.data()) == DICTIONARY_MAGIC)
+    {
+        // Number the dictionaries of the archive, so that their IDs differ.
+        dictionary.resize(n);
+        std::uint32_t id = next_id++;
+        for (std::size_t i = 0; i < 4; ++i) dictionary[4 + i] = (std::uint8_t) (id >> (8*i));
+        family.cdict.reset(ZSTD_createCDict(dictionary.data(), n, options.zstd_level));
+        if (!family.cdict)
+            throw EXCEPTION("Failed creating zstd dictionary for " + path);
+        write_entry(ZipFileSystem::dictionary_prefix + std::to_string(id), STORED, dictionary.data(),
+                    n, n, checksum(dictionary.data(), n), Sha256::hash(dictionary.data(), n));
+    }
+
+    for (const auto& file : family.held)
+        add_compressed(family, file.first, file.second.data(), file.second.size());
+    family.held.clear();
+    family.held.shrink_to_fit();
+    family.held_bytes = 0;
+}
+
+void ZipWriter::impl::add_compressed (Family& family, const std::string& name,
+                                      const std::uint8_t* data, std::size_t size)
+{
+    if (!family.cdict)
+    {
+        add_deflated(name, data, size);
+        return;
+    }
+    if (!cctx)
+    {
+        cctx.reset(ZSTD_createCCtx());
+        if (!cctx) throw std::bad_alloc();
+    }
+
+    PooledBuffer packed(ZSTD_compressBound(size));
+    std::size_t n = ZSTD_compress_usingCDict(cctx.get(), packed.data(), packed.size(), data, size,
+                                             family.cdict.get());
+    if (ZSTD_isError(n))
+        throw EXCEPTION("Failed compressing " + name + " for " + path);
+    std::uint32_t crc = checksum(data, size);
+    Digest sha256 = Sha256::hash(data, size);
+    if (n < size)
+        write_entry(name, ZSTD, packed.data(), n, size, crc, sha256);
+    else
+        write_entry(name, STORED, data, size, size, crc, sha256);
+}
+
+#endif // FILESYSTEM_DISABLE_ZSTD
+
+void ZipWriter::impl::write_central_directory ()
+{
+    std::uint64_t cd_offset = offset;
+    for (const Written& entry : written)
+    {
+        // The zip64 extra field gives the saturated fields, in this order.
+        std::uint64_t fields[3];
+        std::size_t count = 0;
+        if (entry.usize >= 0xFFFFFFFF) fields[count++] = entry.usize;
+        if (entry.csize >= 0xFFFFFFFF) fields[count++] = entry.csize;
+        if (entry.offset >= 0xFFFFFFFF) fields[count++] = entry.offset;
+        std::uint16_t version = entry.method == ZSTD ? VERSION_ZSTD : count ? VERSION_ZIP64 : VERSION_DEFLATE;
+        std::size_t extra = (count ? 4 + 8 * count : 0) + 4 + entry.sha256.size();
+
+        put(out, CENTRAL_HEADER, 4);
+        put(out, version, 2);
+        put(out, version, 2);
+        put(out, FLAG_UTF8, 2);
+        put(out, entry.method, 2);
+        put(out, 0, 2);
+        put(out, DOS_DATE, 2);
+        put(out, entry.crc, 4);
+        put(out, std::min<std::uint64_t>(entry.csize, 0xFFFFFFFF), 4);
+        put(out, std::min<std::uint64_t>(entry.usize, 0xFFFFFFFF), 4);
+        put(out, entry.name.size(), 2);
+        put(out, extra, 2);
+        put(out, 0, 2); // comment
+        put(out, 0, 2); // disk
+        put(out, 0, 2); // internal attributes
+        put(out, 0, 4); // external attributes
+        put(out, std::min<std::uint64_t>(entry.offset, 0xFFFFFFFF), 4);
+        out.write(entry.name.data(), entry.name.size());
+        if (count)
+        {
+            put(out, 0x0001, 2);
+            put(out, 8 * count, 2);
+            for (std::size_t i = 0; i < count; ++i) put(out, fields[i], 8);
+        }
+        put(out, SHA256_FIELD, 2);
+        put(out, entry.sha256.size(), 2);
+        out.write((const char*) entry.sha256.data(), entry.sha256.size());
+        offset += CENTRAL_HEADER_SIZE + entry.name.size() + extra;
+    }
+    std::uint64_t cd_size = offset - cd_offset;
+    std::uint64_t count = written.size();
+
+    // Archives beyond the limits of the end of central directory record
+    // give the real values in a zip64 record, found through a locator.
+    bool zip64 = count >= 0xFFFF || cd_size >= 0xFFFFFFFF || cd_offset >= 0xFFFFFFFF;
+    if (zip64)
+    {
+        put(out, ZIP64_END_OF_CENTRAL_DIR, 4);
+        put(out, ZIP64_END_OF_CENTRAL_DIR_SIZE - 12, 8);
+        put(out, VERSION_ZIP64, 2);
+        put(out, VERSION_ZIP64, 2);
+        put(out, 0, 4); // disk
+        put(out, 0, 4); // disk of the central directory
+        put(out, count, 8);
+        put(out, count, 8);
+        put(out, cd_size, 8);
+        put(out, cd_offset, 8);
+
+        put(out, ZIP64_LOCATOR, 4);
+        put(out, 0, 4);
+        put(out, offset, 8);
+        put(out, 1, 4); // disks
+    }
+    put(out, END_OF_CENTRAL_DIR, 4);
+    put(out, 0, 2);
+    put(out, 0, 2);
+    put(out, zip64 ? 0xFFFF : count, 2);
+    put(out, zip64 ? 0xFFFF : count, 2);
+    put(out, zip64 ? 0xFFFFFFFF : cd_size, 4);
+    put(out, zip64 ? 0xFFFFFFFF : cd_offset, 4);
+    put(out, 0, 2); // comment
+    out.flush();
+    check();
+}
+
+#endif // FILESYSTEM_DISABLE_ZIP
+
+ZipWriter::ZipWriter (const Path& zip_file, const ZipWriterOptions& options)
+    : my(new impl)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    my->options = options;
+    my->path = zip_file;
+    my->out.open(zip_file, std::ios::binary);
+    if (!my->out)
+        throw EXCEPTION("Failed creating zip file " + my->path);
+#else
+    (void) zip_file;
+    (void) options;
+    throw EXCEPTION("zip files not supported in this FileSystem build");
+#endif
+}
+
+ZipWriter::~ZipWriter () {}
+
+void ZipWriter::add (const FilePath& filepath, const void* data, std::size_t size)
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    if (my->finished)
+        throw EXCEPTION("Zip file " + my->path + " already finished");
+    std::string name = filepath;
+    const std::uint8_t* bytes = (const std::uint8_t*) data;
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    if (size > 0 && size <= my->options.small_file && my->options.dictionary_size > 0)
+    {
+        // Files are grouped by the extension of their name.
+        std::size_t slash = name.rfind('/');
+        std::size_t dot = name.rfind('.');
+        bool extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        impl::Family& family = my->families[extension ? name.substr(dot + 1) : std::string()];
+        if (family.trained)
+            my->add_compressed(family, name, bytes, size);
+        else
+        {
+            family.held.emplace_back(name, std::vector<std::uint8_t>(bytes, bytes + size));
+            family.held_bytes += size;
+            if (family.held_bytes >= my->options.training_bytes) my->train(family);
+        }
+        return;
+    }
+#endif
+    my->add_deflated(name, bytes, size);
+#else
+    (void) filepath;
+    (void) data;
+    (void) size;
+#endif
+}
+
+void ZipWriter::finish ()
+{
+#ifndef FILESYSTEM_DISABLE_ZIP
+    if (my->finished)
+        throw EXCEPTION("Zip file " + my->path + " already finished");
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    for (auto& family : my->families)
+        if (!family.second.trained) my->train(family.second);
+#endif
+    my->write_central_directory();
+    my->out.close();
+    my->finished = true;
+#endif
+}
@@ -0,0 +1,389 @@
+#include <file.h>
+#include <cpp/Exception.h>
+#include "pool.h"
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+
+namespace
+{
+
+const std::uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+const std::uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+const std::size_t FOOTER_SIZE = 9;
+const std::size_t SKIPPABLE_HEADER_SIZE = 8;
+
+std::uint32_t read32 (const std::uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((std::uint32_t) p[3] << 24);
+}
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+
+std::uint64_t read64 (const std::uint8_t* p)
+{
+    return read32(p) | ((std::uint64_t) read32(p+4) << 32);
+}
+
+std::uint64_t rotl (std::uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/// Return the XXH64 hash of the data with seed 0; seek tables give the
+/// low 32 bits of it for each frame.
+std::uint64_t xxh64 (const std::uint8_t* p, std::size_t size)
+{
+    const std::uint64_t P1 = 0x9E3779B185EBCA87ull;
+    const std::uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    const std::uint64_t P3 = 0x165667B19E3779F9ull;
+    const std::uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+    const std::uint64_t P5 = 0x27D4EB2F165667C5ull;
+    auto round = [&](std::uint64_t acc, std::uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](std::uint64_t acc, std::uint64_t v) { return (acc ^ round(0, v)) * P1 + P4; };
+
+    const std::uint8_t* end = p + size;
+    std::uint64_t h;
+    if (size >= 32)
+    {
+        std::uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    }
+    else
+        h = P5;
+    h += size;
+    for (; end - p >= 8; p += 8)
+        h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (end - p >= 4)
+    {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif
+
+/// Read exactly 'size' bytes at 'offset' of the file.
+bool read_at (FileHandler& file, std::uint64_t offset, void* buffer, std::size_t size)
+{
+    file.seek((std::ios::off_type) offset, std::ios::beg);
+    return file.read(buffer, size) == size;
+}
+
+} // namespace
+
+// SeekableZstdFile
+
+struct SeekableZstdFile::impl
+{
+    /// Start offsets of the frames, compressed and decompressed, followed
+    /// by the total sizes, and the frames' checksums if the table has
+    /// them. Shared between clones.
+    struct Table
+    {
+        std::vector<std::uint64_t> compressed;
+        std::vector<std::uint64_t> decompressed;
+        std::vector<std::uint32_t> checksums;
+    };
+
+    std::unique_ptr<FileHandler> file;
+    std::shared_ptr<const Table> table;
+    std::uint64_t pos = 0;
+    MemoryResource* memory = nullptr; // allocates the frame buffer; may be null
+
+    // The last decompressed frame, kept for small sequential reads.
+    // Without a memory resource it comes from the scratch pools.
+    std::size_t frame = SIZE_MAX;
+    Buffer data;
+    std::size_t data_capacity = 0;
+
+    /// Decompress a frame into 'out', which holds its decompressed size.
+    void decompress (std::size_t frame, std::uint8_t* out);
+};
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+
+void SeekableZstdFile::impl::decompress (std::size_t frame, std::uint8_t* out)
+{
+    std::size_t csize = (std::size_t) (table->compressed[frame+1] - table->compressed[frame]);
+    std::size_t dsize = (std::size_t) (table->decompressed[frame+1] - table->decompressed[frame]);
+    PooledBuffer compressed(csize);
+    if (!read_at(*file, table->compressed[frame], compressed.data(), csize))
+        throw EXCEPTION("Failed reading zstd frame");
+    std::size_t n = ZSTD_decompressDCtx(zstd_context(), out, dsize, compressed.data(), csize);
+    if (ZSTD_isError(n))
+        throw EXCEPTION(std::string("Failed decompressing zstd frame: ") + ZSTD_getErrorName(n));
+    if (n != dsize)
+        throw EXCEPTION("zstd frame size does not match its seek table entry");
+    if (!table->checksums.empty() && (std::uint32_t) xxh64(out, dsize) != table->checksums[frame])
+        throw EXCEPTION("zstd frame checksum does not match its seek table entry");
+}
+
+#endif
+
+bool SeekableZstdFile::is_seekable (FileHandler& file)
+{
+    std::uint8_t footer[FOOTER_SIZE];
+    std::size_t size = file.size();
+    if (size < SKIPPABLE_HEADER_SIZE + FOOTER_SIZE) return false;
+    std::ios::pos_type pos = file.tell();
+    bool seekable = read_at(file, size - FOOTER_SIZE, footer, FOOTER_SIZE) &&
+                    read32(footer + 5) == SEEKABLE_MAGIC;
+    file.seek(pos, std::ios::beg);
+    return seekable;
+}
+
+SeekableZstdFile::SeekableZstdFile (std::unique_ptr<FileHandler> file_, MemoryResource* memory)
+{
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    my.reset(new impl);
+    my->file = std::move(file_);
+    my->memory = memory;
+    FileHandler& file = *my->file;
+
+    // The seek table is a skippable frame at the end of the file,
+    // closed by a footer giving the number of frames.
+    std::uint64_t size = file.size();
+    std::uint8_t footer[FOOTER_SIZE];
+    if (size < SKIPPABLE_HEADER_SIZE + FOOTER_SIZE ||
+        !read_at(file, size - FOOTER_SIZE, footer, FOOTER_SIZE) ||
+        read32(footer + 5) != SEEKABLE_MAGIC)
+        throw EXCEPTION("Not a seekable zstd file");
+
+    // Widened first, so that the table sizes below cannot wrap.
+    std::size_t frames = read32(footer);
+    std::uint8_t descriptor = footer[4];
+    if (descriptor & 0x7C)
+        throw EXCEPTION("Unsupported seekable zstd descriptor");
+    bool checksums = (descriptor & 0x80) != 0;
+    std::size_t entry_size = checksums ? 12 : 8;
+    std::uint64_t table_size = SKIPPABLE_HEADER_SIZE + (std::uint64_t) frames * entry_size + FOOTER_SIZE;
+    if (table_size > size)
+        throw EXCEPTION("Corrupt seekable zstd seek table");
+
+    std::vector<std::uint8_t> entries((std::size_t) table_size);
+    if (!read_at(file, size - table_size, entries.data(), entries.size()) ||
+        read32(&entries[0]) != SKIPPABLE_MAGIC ||
+        read32(&entries[4]) != table_size - SKIPPABLE_HEADER_SIZE)
+        throw EXCEPTION("Corrupt seekable zstd seek table");
+
+    std::shared_ptr<impl::Table> table(new impl::Table);
+    table->compressed.resize(frames + 1);
+    table->decompressed.resize(frames + 1);
+    if (checksums) table->checksums.resize(frames);
+    table->compressed[0] = table->decompressed[0] = 0;
+    for (std::size_t i = 0; i < frames; ++i)
+    {
+        const std::uint8_t* entry = &entries[SKIPPABLE_HEADER_SIZE + i * entry_size];
+        table->compressed[i+1] = table->compressed[i] + read32(entry);
+        table->decompressed[i+1] = table->decompressed[i] + read32(entry + 4);
+        if (checksums) table->checksums[i] = read32(entry + 8);
+    }
+    if (table->compressed[frames] != size - table_size)
+        throw EXCEPTION("Corrupt seekable zstd seek table");
+    my->table = table;
+#else
+    (void) file_;
+    (void) memory;
+    throw EXCEPTION("zstd files not supported in this FileSystem build");
+#endif
+}
+
+SeekableZstdFile::SeekableZstdFile () {}
+
+SeekableZstdFile::~SeekableZstdFile () {}
+
+std::size_t SeekableZstdFile::read (void* buffer, std::size_t size)
+{
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    const std::vector<std::uint64_t>& offsets = my->table->decompressed;
+    std::uint8_t* out = (std::uint8_t*) buffer;
+    std::size_t total = 0;
+    while (total < size && my->pos < offsets.back())
+    {
+        std::size_t frame = std::upper_bound(offsets.begin(), offsets.end(), my->pos) - offsets.begin() - 1;
+        std::size_t start = (std::size_t) (my->pos - offsets[frame]);
+        std::size_t frame_size = (std::size_t) (offsets[frame+1] - offsets[frame]);
+        std::size_t n = std::min(size - total, frame_size - start);
+
+        if (start == 0 && n == frame_size && frame != my->frame)
+        {
+            // The whole frame is wanted: decompress straight into the buffer.
+            my->decompress(frame, out + total);
+        }
+        else
+        {
+            if (frame != my->frame)
+            {
+                my->frame = SIZE_MAX; // in case decompression throws
+                if (my->data_capacity < frame_size)
+                {
+                    my->data = allocate_buffer(frame_size, my->memory ? my->memory : pool_resource());
+                    my->data_capacity = frame_size;
+                }
+                my->decompress(frame, my->data.get());
+                my->frame = frame;
+            }
+            std::memcpy(out + total, my->data.get() + start, n);
+        }
+        total += n;
+        my->pos += n;
+    }
+    return total;
+#else
+    (void) buffer;
+    (void) size;
+    return 0;
+#endif
+}
+
+void SeekableZstdFile::seek (std::ios::off_type offset, std::ios::seekdir origin)
+{
+    std::int64_t base = origin == std::ios::beg ? 0 :
+                        origin == std::ios::cur ? (std::int64_t) my->pos :
+                        (std::int64_t) size();
+    my->pos = (std::uint64_t) std::max<std::int64_t>(0, base + offset);
+}
+
+std::ios::pos_type SeekableZstdFile::tell () const
+{
+    return (std::ios::pos_type) my->pos;
+}
+
+std::size_t SeekableZstdFile::size () const
+{
+    return (std::size_t) my->table->decompressed.back();
+}
+
+FileHandler* SeekableZstdFile::clone () const
+{
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    std::unique_ptr<FileHandler> file(my->file->clone());
+    if (!file) return nullptr;
+    SeekableZstdFile* copy = new SeekableZstdFile;
+    copy->my.reset(new impl);
+    copy->my->file = std::move(file);
+    copy->my->table = my->table;
+    copy->my->pos = my->pos;
+    copy->my->memory = my->memory;
+    return copy;
+#else
+    return nullptr;
+#endif
+}
+
+// SeekableZstdFileSystem
+
+namespace
+{
+
+// Resolved entries of files served decompressed are tagged with this bit.
+const std::uint64_t ZSTD_ENTRY = 1ull << 63;
+
+bool zst_extension (const char* path)
+{
+    std::size_t len = std::strlen(path);
+    return len > 4 && std::strcmp(path + len - 4, ".zst") == 0;
+}
+
+FileHandler* decompressed (FileHandler* file, MemoryResource* memory)
+{
+    std::unique_ptr<FileHandler> f(file);
+    if (f && SeekableZstdFile::is_seekable(*f))
+        return new SeekableZstdFile(std::move(f), memory);
+    return f.release();
+}
+
+} // namespace
+
+SeekableZstdFileSystem::SeekableZstdFileSystem (std::unique_ptr<FileSystemHandler> inner)
+    : inner(std::move(inner)) {}
+
+FileHandler* SeekableZstdFileSystem::open (const FilePath& filepath)
+{
+    FileHandler* file = inner->open(filepath);
+    return zst_extension(filepath) ? decompressed(file, memory) : file;
+}
+
+bool SeekableZstdFileSystem::resolve (const FilePath& filepath, std::uint64_t& entry)
+{
+    if (!inner->resolve(filepath, entry) || (entry & ZSTD_ENTRY)) return false;
+    if (zst_extension(filepath)) entry |= ZSTD_ENTRY;
+    return true;
+}
+
+FileHandler* SeekableZstdFileSystem::open_resolved (std::uint64_t entry)
+{
+    FileHandler* file = inner->open_resolved(entry & ~ZSTD_ENTRY);
+    return (entry & ZSTD_ENTRY) ? decompressed(file, memory) : file;
+}
+
+bool SeekableZstdFileSystem::content_key (std::uint64_t entry, ContentKey& key)
+{
+    return !(entry & ZSTD_ENTRY) && inner->content_key(entry, key);
+}
+
+bool SeekableZstdFileSystem::content_key (const FilePath& filepath, std::uint64_t& entry, ContentKey& key)
+{
+    return !zst_extension(filepath) && inner->content_key(filepath, entry, key) && !(entry & ZSTD_ENTRY);
+}
+
+bool SeekableZstdFileSystem::read_progressive (const FilePath& filepath, std::size_t chunk_size,
+                                               const ChunkCallback& callback, bool& finished)
+{
+    // Files served as they are keep the inner handler's progressive read.
+    if (!zst_extension(filepath))
+        return inner->read_progressive(filepath, chunk_size, callback, finished);
+    return FileSystemHandler::read_progressive(filepath, chunk_size, callback, finished);
+}
+
+std::function<FileHandler* ()> SeekableZstdFileSystem::fetch (const FilePath& filepath)
+{
+    std::function<FileHandler* ()> decode = inner->fetch(filepath);
+    if (!decode || !zst_extension(filepath)) return decode;
+    MemoryResource* resource = memory;
+    return [=]() { return decompressed(decode(), resource); };
+}
+
+bool SeekableZstdFileSystem::open_group (const char* name, std::vector<std::unique_ptr<FileHandler>>& files)
+{
+    return inner->open_group(name, files);
+}
+
+void SeekableZstdFileSystem::open_batch (const std::vector<FilePath>& paths,
+                                         std::vector<std::unique_ptr<FileHandler>>& files)
+{
+    std::vector<bool> opened(files.size());
+    for (std::size_t i = 0; i < files.size(); ++i)
+        opened[i] = files[i] != nullptr;
+    inner->open_batch(paths, files);
+    for (std::size_t i = 0; i < files.size(); ++i)
+        if (!opened[i] && files[i] && zst_extension(paths[i]))
+            files[i].reset(decompressed(files[i].release(), memory));
+}
@@ -0,0 +1,132 @@
+#include "test.h"
+#include "../src/content.h"
+
+#include <cstring>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// Return the key of 'data', with 'tag' standing in for its digest.
+ContentKey key (const std::string& data, std::uint8_t tag)
+{
+    ContentKey k;
+    k.size = data.size();
+    k.sha256.fill(tag);
+    return k;
+}
+
+std::shared_ptr<const Content> content (const std::string& data)
+{
+    std::shared_ptr<Content> c(new Content);
+    c->size = data.size();
+    c->data = allocate_buffer(data.size());
+    std::memcpy(c->data.get(), data.data(), data.size());
+    return c;
+}
+
+bool holds (const std::shared_ptr<const Content>& c, const std::string& data)
+{
+    return c && c->size == data.size() && std::memcmp(c->data.get(), data.data(), data.size()) == 0;
+}
+
+} // namespace
+
+TEST(content_cache_round_trip_and_eviction)
+{
+    // Without a cold tier, files evicted from the budget are gone.
+    ContentCache cache(100, SIZE_MAX);
+    std::string a(60, 'a'), b(60, 'b');
+    std::shared_ptr<const Content> stored = content(a);
+    cache.put(key(a, 1), stored, a.size());
+    CHECK(cache.get(key(a, 1)) == stored);
+    CHECK(!cache.get(key(a, 2))); // same size, other digest
+    CHECK(!cache.get(key(std::string(61, 'a'), 1))); // same digest, other size
+
+    cache.put(key(b, 2), content(b), b.size());
+    CHECK(!cache.get(key(a, 1)));
+    CHECK(holds(cache.get(key(b, 2)), b));
+
+    cache.set_budget(0);
+    CHECK(!cache.get(key(b, 2)));
+}
+
+#ifndef FILESYSTEM_DISABLE_LZ4
+
+TEST(content_cache_cold_tier)
+{
+    // 100 hot bytes hold one file; the rest of the budget holds files
+    // evicted from them, LZ4-compressed or, if that does not shrink
+    // them, as they are.
+    ContentCache cache(1000, 100);
+    std::string a(100, 'a'), b(100, 'b'), noise(100, '\0');
+    for (std::size_t i = 0; i < noise.size(); ++i) noise[i] = (char) (i * 167 + (i >> 3) * 91);
+    cache.put(key(a, 1), content(a), a.size());
+    cache.put(key(noise, 3), content(noise), noise.size());
+    cache.put(key(b, 2), content(b), b.size());
+
+    // Cold reads decompress a copy each time until the file is read
+    // often enough to move back to the hot tier.
+    std::shared_ptr<const Content> first = cache.get(key(a, 1));
+    CHECK(holds(first, a));
+    std::shared_ptr<const Content> second = cache.get(key(a, 1));
+    CHECK(holds(second, a) && second != first);
+    CHECK(cache.get(key(a, 1)) == cache.get(key(a, 1)));
+    CHECK(holds(cache.get(key(noise, 3)), noise));
+
+    // The promoted file pushed the hot one to the cold tier.
+    CHECK(holds(cache.get(key(b, 2)), b));
+
+    // Putting a file again replaces its cold copy.
+    cache.put(key(noise, 3), content(noise), noise.size());
+    CHECK(cache.get(key(noise, 3)) == cache.get(key(noise, 3)));
+
+    // Shrinking the budget shrinks both tiers.
+    cache.set_budget(0);
+    CHECK(!cache.get(key(a, 1)) && !cache.get(key(b, 2)) && !cache.get(key(noise, 3)));
+}
+
+#endif
+
+TEST(content_cache_file_system)
+{
+    // The same contents in two archives, under different paths.
+    std::string data(10000, 'c');
+    std::string a = scratch("content_a.zip"), b = scratch("content_b.zip");
+    {
+        ZipWriter writer(a.c_str());
+        writer.add("one.bin", data.data(), data.size());
+        writer.finish();
+        ZipWriter other(b.c_str());
+        other.add("two.bin", data.data(), data.size());
+        other.add("other.bin", "other", 5);
+        other.finish();
+    }
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(a.c_str())));
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(b.c_str())));
+    fs.setContentCache(1 << 20, 16 << 10);
+    SlowOpThresholds thresholds;
+    thresholds.decompress = std::chrono::nanoseconds(0);
+    std::shared_ptr<SlowOpLog> log(new SlowOpLog(thresholds));
+    fs.setSlowOpLog(log);
+    for (int i = 0; i < 3; ++i)
+    {
+        CHECK(fs.open("one.bin").read_all() == data);
+        CHECK(fs.open("two.bin").read_all() == data);
+        CHECK(fs.open("other.bin").read_all() == "other");
+        FileId id = fs.resolve("two.bin");
+        CHECK(fs.open(id).read_all() == data);
+    }
+
+    // Each of the two contents was decompressed once.
+    std::vector<std::string> decompressed;
+    log->drain([&](const SlowOp& op) { decompressed.push_back(op.path); });
+    CHECK(decompressed == std::vector<std::string>({ "one.bin", "other.bin" }));
+    CHECK(fs.read_progressive("one.bin", 4096, [](const std::uint8_t* p, std::size_t n, std::uint64_t)
+    {
+        return std::string((const char*) p, n) == std::string(n, 'c');
+    }));
+}
@@ -0,0 +1,407 @@
+#include "test.h"
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// Return a buffer holding 'data'.
+Buffer buffer (const std::string& data)
+{
+    Buffer b = allocate_buffer(data.size());
+    std::memcpy(b.get(), data.data(), data.size());
+    return b;
+}
+
+/// Read 'size' bytes from a file handler into a string.
+std::string read (FileHandler& file, std::size_t size)
+{
+    std::string data(size, '\0');
+    data.resize(file.read(&data[0], size));
+    return data;
+}
+
+/// Drain a log into a vector.
+std::vector<SlowOp> drain (SlowOpLog& log)
+{
+    std::vector<SlowOp> ops;
+    log.drain([&](const SlowOp& op) { ops.push_back(op); });
+    return ops;
+}
+
+/// Thresholds logging every operation.
+SlowOpThresholds log_all ()
+{
+    SlowOpThresholds thresholds;
+    thresholds.open = thresholds.read = thresholds.decompress = std::chrono::nanoseconds(0);
+    return thresholds;
+}
+
+/// A memory resource recording the size of each allocation.
+class CountingResource final : public MemoryResource
+{
+public:
+
+    void* allocate (std::size_t size, std::size_t) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sizes.push_back(size);
+        return ::operator new(size);
+    }
+
+    void deallocate (void* data, std::size_t, std::size_t) override
+    {
+        ::operator delete(data);
+    }
+
+    std::vector<std::size_t> allocations ()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sizes;
+    }
+
+private:
+
+    std::mutex mutex;
+    std::vector<std::size_t> sizes;
+};
+
+/// Return 'size' bytes that differ at every offset of a small period.
+std::string numbered (std::size_t size)
+{
+    std::string data(size, '\0');
+    for (std::size_t i = 0; i < size; ++i) data[i] = (char) (i % 251);
+    return data;
+}
+
+} // namespace
+
+TEST(memfile_clone)
+{
+    MemFile file(buffer("0123456789"), 10);
+    CHECK(read(file, 3) == "012");
+
+    // Clones start at the file's position and move independently.
+    std::unique_ptr<FileHandler> copy(file.clone());
+    CHECK(read(*copy, 3) == "345");
+    CHECK(read(file, 2) == "34");
+    copy->seek(0, std::ios::beg);
+    CHECK(read(*copy, 10) == "0123456789");
+    CHECK(file.tell() == 5);
+
+    // The data is shared, so it stays with the file while a clone
+    // lives, and outlives the file.
+    CHECK(!file.take_buffer());
+    std::unique_ptr<FileHandler> orphan(copy->clone());
+    copy.reset();
+    orphan->seek(-4, std::ios::end);
+    CHECK(read(*orphan, 10) == "6789");
+    orphan.reset();
+    Buffer data = file.take_buffer();
+    CHECK(data && std::memcmp(data.get(), "0123456789", 10) == 0);
+    CHECK(file.size() == 0);
+}
+
+TEST(memfile_clone_concurrent)
+{
+    // Clones are taken from several threads at once, each reading the
+    // whole file through its own cursor.
+    std::string contents(1 << 16, '\0');
+    for (std::size_t i = 0; i < contents.size(); ++i) contents[i] = (char) (i * 31);
+    MemFile file(buffer(contents), contents.size());
+
+    std::vector<std::thread> threads;
+    std::vector<int> matched(4, 0);
+    for (std::size_t t = 0; t < matched.size(); ++t)
+        threads.emplace_back([&, t]()
+        {
+            for (int i = 0; i < 100; ++i)
+            {
+                std::unique_ptr<FileHandler> copy(file.clone());
+                copy->seek(0, std::ios::beg);
+                matched[t] += read(*copy, contents.size()) == contents;
+            }
+        });
+    for (std::thread& thread : threads) thread.join();
+    for (int m : matched) CHECK(m == 100);
+}
+
+TEST(slow_op_log_thresholds)
+{
+    SlowOpThresholds thresholds;
+    thresholds.open = std::chrono::milliseconds(5);
+    thresholds.read = std::chrono::nanoseconds::max();
+    thresholds.decompress = std::chrono::nanoseconds(0);
+    SlowOpLog log(thresholds);
+
+    log.record(SlowOp::Open, "fast", "h", 1, std::chrono::milliseconds(4));
+    log.record(SlowOp::Open, "slow", "h", 2, std::chrono::milliseconds(5));
+    log.record(SlowOp::Read, "never", "h", 3, std::chrono::hours(1));
+    log.record(SlowOp::Decompress, "always", "h", 4, std::chrono::nanoseconds(0));
+
+    std::vector<SlowOp> ops = drain(log);
+    CHECK(ops.size() == 2);
+    CHECK(ops[0].kind == SlowOp::Open && std::strcmp(ops[0].path, "slow") == 0 && ops[0].size == 2);
+    CHECK(ops[0].duration == std::chrono::milliseconds(5));
+    CHECK(ops[0].thread == std::this_thread::get_id());
+    CHECK(ops[1].kind == SlowOp::Decompress && std::strcmp(ops[1].path, "always") == 0);
+    CHECK(log.dropped() == 0);
+}
+
+TEST(slow_op_log_wrap_and_drop)
+{
+    // A capacity of 3 is rounded up to 4.
+    SlowOpLog log(log_all(), 3);
+    for (int i = 0; i < 3; ++i)
+        log.record(SlowOp::Read, "", "h", i, std::chrono::nanoseconds(0));
+    CHECK(drain(log).size() == 3);
+
+    // Records wrap around the ring, oldest first, and those past the
+    // capacity are dropped.
+    for (int i = 0; i < 6; ++i)
+        log.record(SlowOp::Read, "", "h", 10 + i, std::chrono::nanoseconds(0));
+    std::vector<SlowOp> ops = drain(log);
+    CHECK(ops.size() == 4);
+    for (std::size_t i = 0; i < ops.size(); ++i) CHECK(ops[i].size == 10 + i);
+    CHECK(log.dropped() == 2);
+    CHECK(drain(log).empty());
+
+    // Long paths are truncated.
+    std::string path(1000, 'p');
+    log.record(SlowOp::Open, path.c_str(), "h", 0, std::chrono::nanoseconds(0));
+    ops = drain(log);
+    CHECK(ops.size() == 1 && std::string(ops[0].path) == path.substr(0, sizeof(ops[0].path) - 1));
+}
+
+TEST(slow_op_log_concurrent)
+{
+    // Every record from concurrent threads is either drained or counted
+    // as dropped, while one thread drains.
+    SlowOpLog log(log_all(), 64);
+    const int threads = 4, records = 2000;
+    std::atomic<int> running(threads);
+    std::vector<int> seen(threads, 0);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t)
+        writers.emplace_back([&, t]()
+        {
+            for (int i = 0; i < records; ++i)
+                log.record(SlowOp::Read, "", "h", t, std::chrono::nanoseconds(0));
+            --running;
+        });
+    auto count = [&](const SlowOp& op) { seen[op.size]++; };
+    while (running > 0) log.drain(count);
+    for (std::thread& writer : writers) writer.join();
+    log.drain(count);
+
+    int total = 0;
+    for (int n : seen) total += n;
+    CHECK(total + (int) log.dropped() == threads * records);
+}
+
+TEST(slow_op_log_file_system)
+{
+    write_file(scratch("slow.txt"), "slow op data");
+    std::shared_ptr<SlowOpLog> log(new SlowOpLog(log_all()));
+    std::string root = scratch("");
+    FileSystem fs(root.c_str());
+    fs.setSlowOpLog(log);
+
+    File file = fs.open("slow.txt");
+    char data[4];
+    CHECK(file.read(data, sizeof(data)) == 4);
+    CHECK_THROWS(fs.open("missing.txt"));
+
+    std::vector<SlowOp> ops = drain(*log);
+    CHECK(ops.size() == 3);
+    CHECK(ops[0].kind == SlowOp::Open && std::strcmp(ops[0].path, "slow.txt") == 0 && ops[0].size == 12);
+    CHECK(std::strcmp(ops[0].handler, "RegularFileSystem") == 0);
+    CHECK(ops[1].kind == SlowOp::Read && ops[1].size == 4);
+    CHECK(ops[2].kind == SlowOp::Open && std::strcmp(ops[2].path, "missing.txt") == 0);
+
+    // Without the log nothing is recorded.
+    fs.setSlowOpLog(nullptr);
+    fs.open("slow.txt").read(data, sizeof(data));
+    CHECK(drain(*log).empty());
+}
+
+TEST(file_id_reopen_and_stale)
+{
+    write_file(scratch("id.txt"), "resolved");
+    std::string root = scratch("");
+    FileSystem fs(root.c_str());
+
+    FileId id = fs.resolve("id.txt");
+    CHECK(id.valid());
+    CHECK(fs.open(id).read_all() == "resolved");
+    CHECK(fs.open(id).read_all() == "resolved");
+    CHECK_THROWS(fs.resolve("missing.txt"));
+    CHECK_THROWS(fs.open(FileId()));
+
+    // Adding a handler can change which file a path finds, so ids
+    // resolved before are stale.
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new RegularFileSystem(root.c_str())));
+    CHECK_THROWS(fs.open(id));
+    FileId fresh = fs.resolve("id.txt");
+    CHECK(fresh.generation != id.generation);
+    CHECK(fs.open(fresh).read_all() == "resolved");
+
+    // An id naming a handler the file system does not have is rejected.
+    FileId forged = fresh;
+    forged.handler = 5;
+    CHECK_THROWS(fs.open(forged));
+}
+
+TEST(regular_file_access_patterns)
+{
+    std::string data = numbered(4 << 20);
+    write_file(scratch("patterns.bin"), data);
+    std::string root = scratch("");
+
+    // Sequential reads grow the read buffer up to 1 MB.
+    {
+        CountingResource memory;
+        FileSystem fs(root.c_str());
+        fs.setMemoryResource(&memory);
+        File file = fs.open("patterns.bin");
+        std::string chunk(1000, '\0');
+        for (std::size_t pos = 0; pos < data.size(); pos += chunk.size())
+        {
+            std::size_t n = file.read(&chunk[0], chunk.size());
+            CHECK(n == std::min(chunk.size(), data.size() - pos));
+            CHECK(data.compare(pos, n, chunk, 0, n) == 0);
+        }
+        std::vector<std::size_t> sizes = memory.allocations();
+        CHECK(*std::max_element(sizes.begin(), sizes.end()) == 1 << 20);
+    }
+
+    // Random and strided probes bypass the buffer once detected, so it
+    // does not grow.
+    for (bool strided : { false, true })
+    {
+        CountingResource memory;
+        FileSystem fs(root.c_str());
+        fs.setMemoryResource(&memory);
+        File file = fs.open("patterns.bin");
+        std::string probe(100, '\0');
+        for (std::size_t i = 0; i < 200; ++i)
+        {
+            std::size_t pos = strided ? i * 20000 : (i * 7919 * 4099) % (data.size() - probe.size());
+            file.seek(pos, std::ios::beg);
+            CHECK(file.read(&probe[0], probe.size()) == probe.size());
+            CHECK(data.compare(pos, probe.size(), probe) == 0);
+        }
+        std::vector<std::size_t> sizes = memory.allocations();
+        CHECK(sizes.size() <= 2 && *std::max_element(sizes.begin(), sizes.end()) == 4096);
+    }
+}
+
+TEST(regular_file_clone_patterns)
+{
+    // A file and its clone read the shared descriptor with different
+    // patterns, each through its own buffer.
+    std::string data = numbered(1 << 20);
+    write_file(scratch("clones.bin"), data);
+    std::string root = scratch("");
+    FileSystem fs(root.c_str());
+    File stream = fs.open("clones.bin");
+    File probe = stream.clone();
+
+    std::string chunk(3000, '\0'), small(10, '\0');
+    for (std::size_t i = 0; i < 300; ++i)
+    {
+        std::size_t pos = i * chunk.size();
+        CHECK(stream.read(&chunk[0], chunk.size()) == chunk.size());
+        CHECK(data.compare(pos, chunk.size(), chunk) == 0);
+
+        std::size_t at = (i * 104729) % (data.size() - small.size());
+        probe.seek(at, std::ios::beg);
+        CHECK(probe.read(&small[0], small.size()) == small.size());
+        CHECK(data.compare(at, small.size(), small) == 0);
+    }
+}
+
+TEST(read_progressive)
+{
+    std::string data = numbered(10000);
+    write_file(scratch("progressive.bin"), data);
+    std::string root = scratch("");
+    FileSystem fs(root.c_str());
+    File file = fs.open("progressive.bin");
+
+    // Chunks start at the position and carry their offset in the file.
+    char skipped[100];
+    CHECK(file.read(skipped, sizeof(skipped)) == sizeof(skipped));
+    std::string read;
+    std::vector<std::uint64_t> offsets;
+    CHECK(file.read_progressive(4096, [&](const std::uint8_t* p, std::size_t n, std::uint64_t offset)
+    {
+        offsets.push_back(offset);
+        read.append((const char*) p, n);
+        return true;
+    }));
+    CHECK(read == data.substr(100));
+    CHECK(offsets == std::vector<std::uint64_t>({ 100, 4196, 8292 }));
+
+    // Stopping early leaves the position after the last chunk delivered.
+    file.seek(0, std::ios::beg);
+    CHECK(!file.read_progressive(4096, [](const std::uint8_t*, std::size_t, std::uint64_t) { return false; }));
+    CHECK(file.tell() == 4096);
+    CHECK(file.read(skipped, sizeof(skipped)) == sizeof(skipped));
+    CHECK(data.compare(4096, sizeof(skipped), skipped, sizeof(skipped)) == 0);
+    CHECK_THROWS(file.read_progressive(0, [](const std::uint8_t*, std::size_t, std::uint64_t) { return true; }));
+}
+
+TEST(read_progressive_timed)
+{
+    std::string data = numbered(5000);
+    std::string path = scratch("progressive.zip");
+    {
+        ZipWriter writer(path.c_str());
+        writer.add("data.bin", data.data(), data.size());
+        writer.finish();
+    }
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+    SlowOpThresholds thresholds;
+    thresholds.read = std::chrono::milliseconds(10);
+    std::shared_ptr<SlowOpLog> log(new SlowOpLog(thresholds));
+    fs.setSlowOpLog(log);
+
+    // Files opened with a log pass on the inflated entry's own chunks,
+    // without copying them, and time spent in the callback does not
+    // count towards the read.
+    File file = fs.open("data.bin");
+    const std::uint8_t* first = nullptr;
+    bool contiguous = true;
+    std::string read;
+    CHECK(file.read_progressive(1000, [&](const std::uint8_t* p, std::size_t n, std::uint64_t offset)
+    {
+        if (!first) first = p;
+        contiguous = contiguous && p == first + offset;
+        read.append((const char*) p, n);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return true;
+    }));
+    CHECK(read == data && contiguous);
+    CHECK(drain(*log).empty());
+
+    // Reads past the threshold are logged with the bytes delivered.
+    thresholds.read = std::chrono::nanoseconds(0);
+    log.reset(new SlowOpLog(thresholds));
+    fs.setSlowOpLog(log);
+    file = fs.open("data.bin");
+    file.seek(1000, std::ios::beg);
+    CHECK(file.read_progressive(1000, [](const std::uint8_t*, std::size_t, std::uint64_t) { return true; }));
+    std::vector<SlowOp> ops = drain(*log);
+    CHECK(ops.size() == 1 && ops[0].kind == SlowOp::Read && ops[0].size == data.size() - 1000);
+    CHECK(std::strcmp(ops[0].path, "data.bin") == 0);
+}
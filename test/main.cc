@@ -0,0 +1,102 @@
+#include "test.h"
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace test;
+
+namespace
+{
+
+struct Registered
+{
+    const char* name;
+    void (*run) ();
+};
+
+std::vector<Registered>& cases ()
+{
+    static std::vector<Registered> all;
+    return all;
+}
+
+const char* const SCRATCH_DIR = "test_files";
+
+} // namespace
+
+Case::Case (const char* name, void (*run) ())
+{
+    cases().push_back({ name, run });
+}
+
+void test::fail (const char* file, int line, const char* what)
+{
+    std::ostringstream message;
+    message << file << ":" << line << ": CHECK(" << what << ") failed";
+    throw Failure(message.str());
+}
+
+std::string test::scratch (const std::string& name)
+{
+    return std::string(SCRATCH_DIR) + "/" + name;
+}
+
+std::string test::write_file (const std::string& path, const std::string& data)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out)
+        throw std::runtime_error("Failed writing " + path);
+    return path;
+}
+
+std::string test::read_file (const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Failed reading " + path);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void test::put (std::string& data, std::size_t offset, std::uint64_t value, std::size_t bytes)
+{
+    if (data.size() < offset + bytes) data.resize(offset + bytes);
+    for (std::size_t i = 0; i < bytes; ++i) data[offset + i] = (char) (value >> (8*i));
+}
+
+int main (int argc, char** argv)
+{
+    // Run the cases whose name contains the argument, or all of them.
+    const char* filter = argc > 1 ? argv[1] : "";
+#ifdef _WIN32
+    _mkdir(SCRATCH_DIR);
+#else
+    mkdir(SCRATCH_DIR, 0755);
+#endif
+
+    int run = 0, failed = 0;
+    for (const Registered& c : cases())
+    {
+        if (!std::strstr(c.name, filter)) continue;
+        ++run;
+        try
+        {
+            c.run();
+        }
+        catch (const std::exception& e)
+        {
+            ++failed;
+            std::cerr << "FAIL " << c.name << ": " << e.what() << "\n";
+        }
+    }
+    std::cout << run - failed << "/" << run << " passed\n";
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+#include "test.h"
+
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// A memory resource counting the blocks it has handed out.
+class CountingResource final : public MemoryResource
+{
+public:
+
+    void* allocate (std::size_t size, std::size_t) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++blocks;
+        return ::operator new(size);
+    }
+
+    void deallocate (void* data, std::size_t, std::size_t) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --blocks;
+        ::operator delete(data);
+    }
+
+    int live ()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return blocks;
+    }
+
+private:
+
+    std::mutex mutex;
+    int blocks = 0;
+};
+
+bool aligned (const void* p, std::size_t alignment)
+{
+    return (std::uintptr_t) p % alignment == 0;
+}
+
+} // namespace
+
+TEST(arena_allocate_and_release)
+{
+    CountingResource upstream;
+    {
+        ArenaResource arena(4096, &upstream);
+        CHECK(arena.allocated() == 0 && upstream.live() == 0);
+
+        void* a = arena.allocate(100, 8);
+        void* b = arena.allocate(10, 64);
+        CHECK(aligned(a, 8) && aligned(b, 64) && (char*) b >= (char*) a + 100);
+        CHECK(arena.allocated() == 110 && upstream.live() == 1);
+        CHECK_THROWS(arena.allocate(10, 3));
+
+        // Allocations larger than a block take a block of their own.
+        void* big = arena.allocate(10000, 256);
+        CHECK(aligned(big, 256) && upstream.live() == 2);
+        std::memset(big, 1, 10000);
+        arena.deallocate(big, 10000, 256);
+        CHECK(arena.allocated() == 10110);
+
+        arena.release();
+        CHECK(arena.allocated() == 0 && upstream.live() == 0);
+        arena.allocate(1, 1);
+        CHECK(upstream.live() == 1);
+    }
+    // Destruction releases what is left.
+    CHECK(upstream.live() == 0);
+}
+
+TEST(arena_concurrent)
+{
+    ArenaResource arena(1 << 12);
+    const int threads = 4, count = 1000;
+    std::vector<std::vector<std::uint32_t*>> blocks(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]()
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                std::uint32_t* p = (std::uint32_t*) arena.allocate(4 * sizeof(std::uint32_t), 16);
+                for (int k = 0; k < 4; ++k) p[k] = t * count + i;
+                blocks[t].push_back(p);
+            }
+        });
+    for (std::thread& worker : workers) worker.join();
+
+    // No two allocations overlap.
+    CHECK(arena.allocated() == threads * count * 4 * sizeof(std::uint32_t));
+    for (int t = 0; t < threads; ++t)
+        for (int i = 0; i < count; ++i)
+            for (int k = 0; k < 4; ++k) CHECK(blocks[t][i][k] == (std::uint32_t) (t * count + i));
+}
+
+TEST(memory_resource_file_system)
+{
+    std::string data(5000, 'm');
+    std::string path = scratch("memory.zip");
+    {
+        ZipWriter writer(path.c_str());
+        writer.add("data.bin", data.data(), data.size());
+        writer.finish();
+    }
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+    ArenaResource arena;
+    fs.setMemoryResource(&arena);
+
+    // Inflated entries come from the resource.
+    File file = fs.open("data.bin");
+    CHECK(arena.allocated() >= data.size());
+    std::size_t size = 0;
+    Buffer owned = file.read_all_owned(size);
+    CHECK(size == data.size() && owned.get_deleter().resource == &arena);
+    owned.reset();
+
+    // The content cache keeps its own copy of files loaded from the
+    // resource, which outlives the arena's release; served from the
+    // cache, the file takes nothing from the arena.
+    fs.setContentCache(1 << 20);
+    CHECK(fs.open("data.bin").read_all() == data);
+    arena.release();
+    CHECK(fs.open("data.bin").read_all() == data);
+    CHECK(arena.allocated() == 0);
+}
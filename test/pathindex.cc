@@ -0,0 +1,106 @@
+#include "test.h"
+#include "../src/pathindex.h"
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// Return the image of an index of 'count' paths, the value of each its
+/// position.
+std::vector<std::uint8_t> image (std::size_t count)
+{
+    std::vector<std::pair<std::string, std::uint32_t>> paths;
+    for (std::size_t i = 0; i < count; ++i)
+        paths.emplace_back("dir/file" + std::to_string(1000 + i), (std::uint32_t) i);
+    PathIndex index;
+    index.build(paths);
+    return std::vector<std::uint8_t>(index.image(), index.image() + index.image_size());
+}
+
+/// Use an image held in a buffer of exactly its size.
+bool assign (PathIndex& index, const std::vector<std::uint8_t>& data)
+{
+    std::shared_ptr<std::vector<std::uint8_t>> copy(new std::vector<std::uint8_t>(data));
+    return index.assign(copy, copy->data(), copy->size());
+}
+
+/// Look every path up and list them all; corrupt images may throw.
+void use (const PathIndex& index, std::size_t count)
+{
+    std::uint32_t value;
+    for (std::size_t i = 0; i < count; ++i)
+        index.find(("dir/file" + std::to_string(1000 + i)).c_str(), value);
+    index.enumerate("dir/", [](const std::string&, std::uint32_t) {});
+}
+
+} // namespace
+
+TEST(pathindex_round_trip)
+{
+    PathIndex index;
+    CHECK(assign(index, image(40)));
+    CHECK(index.size() == 40);
+    std::uint32_t value;
+    CHECK(index.find("dir/file1017", value) && value == 17);
+    CHECK(index.find("dir/file1039", value) && value == 39);
+    CHECK(!index.find("dir/file1040", value));
+    CHECK(!index.find("", value));
+    std::size_t listed = 0;
+    index.enumerate("dir/file102", [&](const std::string&, std::uint32_t) { ++listed; });
+    CHECK(listed == 10);
+    CHECK(index.path(33) == "dir/file1033");
+
+    PathIndex empty;
+    CHECK(assign(empty, image(0)));
+    CHECK(!empty.find("dir/file1000", value));
+}
+
+TEST(pathindex_empty_and_truncated)
+{
+    PathIndex index;
+    CHECK(!assign(index, std::vector<std::uint8_t>()));
+
+    // Every truncation is either rejected or fails its lookups cleanly;
+    // those ending within a block used to read past the image.
+    std::vector<std::uint8_t> whole = image(40);
+    for (std::size_t size = 0; size < whole.size(); ++size)
+    {
+        std::vector<std::uint8_t> data(whole.begin(), whole.begin() + size);
+        PathIndex truncated;
+        if (!assign(truncated, data)) continue;
+        try { use(truncated, 40); } catch (const std::exception&) {}
+    }
+    std::vector<std::uint8_t> data(whole.begin(), whole.end() - 1);
+    CHECK(assign(index, data));
+    CHECK_THROWS(use(index, 40));
+}
+
+TEST(pathindex_oversized_fields)
+{
+    std::vector<std::uint8_t> whole = image(40);
+    PathIndex index;
+
+    // Path and block counts beyond the image.
+    std::vector<std::uint8_t> data = whole;
+    data[15] = 0x7F;
+    CHECK(!assign(index, data));
+    data = whole;
+    data[16] = 0xFF;
+    CHECK(!assign(index, data));
+
+    // A block offset past the data.
+    data = whole;
+    data[24 + 8 + 7] = 0x7F;
+    CHECK(!assign(index, data));
+
+    // A path length past the end of the image, as a varint continuing
+    // to the end.
+    data = whole;
+    std::size_t blocks = 3, data_start = 24 + blocks * 8 + 40 * 4;
+    std::size_t last_block = data_start + (data[24 + 16] | data[24 + 17] << 8);
+    for (std::size_t i = last_block; i < data.size(); ++i) data[i] = 0xFF;
+    CHECK(assign(index, data));
+    CHECK_THROWS(use(index, 40));
+}
@@ -0,0 +1,78 @@
+#include "test.h"
+#include "../src/pool.h"
+
+#include <thread>
+#include <new>
+#include <cstring>
+#include <cstdint>
+
+using namespace kx;
+using namespace test;
+
+TEST(pool_reuse_on_one_thread)
+{
+    // A freed buffer is handed out again for any size of its class.
+    void* a = pool_allocate(5000);
+    std::memset(a, 1, 8192);
+    pool_free(a);
+    void* b = pool_allocate(8192);
+    CHECK(b == a);
+    void* c = pool_allocate(8193);
+    CHECK(c != a);
+    pool_free(c);
+    pool_free(b);
+    pool_free(nullptr);
+
+    // Requests beyond the largest class bypass the pools.
+    void* big = pool_allocate(32 << 20);
+    std::memset(big, 1, 32 << 20);
+    pool_free(big);
+
+    // Buffers are aligned for any type; stricter alignments are refused.
+    MemoryResource* resource = pool_resource();
+    void* p = resource->allocate(100, alignof(std::max_align_t));
+    CHECK((std::uintptr_t) p % alignof(std::max_align_t) == 0);
+    resource->deallocate(p, 100, alignof(std::max_align_t));
+    CHECK_THROWS(resource->allocate(100, 4096));
+}
+
+TEST(pool_reuse_across_threads)
+{
+    // A buffer freed on another thread reaches the shared pool when
+    // that thread exits, and a thread with an empty pool of its own
+    // takes it from there.
+    const std::size_t size = 3 << 20;
+    void* data = pool_allocate(size);
+    std::thread([&]() { pool_free(data); }).join();
+
+    void* reused = nullptr;
+    std::thread([&]() { reused = pool_allocate(size); }).join();
+    CHECK(reused == data);
+    pool_free(reused);
+
+    // Buffers kept by an exiting thread reach it too.
+    void* kept = nullptr;
+    std::thread([&]()
+    {
+        kept = pool_allocate(size);
+        pool_free(kept);
+    }).join();
+    std::thread([&]() { reused = pool_allocate(size); }).join();
+    CHECK(reused == kept);
+    pool_free(reused);
+}
+
+TEST(pooled_buffer)
+{
+    PooledBuffer buffer(100);
+    std::uint8_t* first = buffer.data();
+    CHECK(first && buffer.size() == 100);
+    buffer.resize(100);
+    CHECK(buffer.data() == first);
+
+    // Resizing within the class returns the buffer and takes it back.
+    buffer.resize(4000);
+    CHECK(buffer.data() == first && buffer.size() == 4000);
+    buffer.resize(0);
+    CHECK(!buffer.data() && buffer.size() == 0);
+}
@@ -0,0 +1,29 @@
+#include "test.h"
+
+#include <vector>
+
+using namespace kx;
+using namespace test;
+
+TEST(pressure_reentrant_callbacks)
+{
+    // Callbacks that call back into the monitor, including one that
+    // unsubscribes itself, used to deadlock on its mutex.
+    // A long window, so that the scale does not grow back meanwhile.
+    MemoryPressureMonitor monitor(std::chrono::milliseconds(150), std::chrono::hours(1));
+    std::vector<double> seen;
+    std::uint64_t self = 0;
+    self = monitor.subscribe([&](double scale)
+    {
+        seen.push_back(monitor.scale());
+        if (scale < 1) monitor.unsubscribe(self);
+    });
+    std::uint64_t other = monitor.subscribe([&](double) { monitor.scale(); });
+
+    monitor.pressure();
+    monitor.pressure();
+    monitor.unsubscribe(other);
+    CHECK(seen.size() == 2);
+    CHECK(seen[0] == 1 && seen[1] == 0.5);
+    CHECK(monitor.scale() == 0.25);
+}
@@ -0,0 +1,333 @@
+#include "test.h"
+
+#ifndef FILESYSTEM_DISABLE_ZIP
+
+#include <zlib.h>
+#include <fstream>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+const std::size_t BLOCK_SIZE = 4096;
+
+/// Where image() put the fields the tests corrupt.
+struct Fields
+{
+    std::size_t listing_size; // in the root directory inode
+    std::size_t name_size; // in the first directory entry
+};
+
+/// A file of an image. Blocks of zeros are stored sparse, and a tail
+/// shorter than a block goes to the fragment block shared by all files.
+struct Entry
+{
+    std::string name;
+    std::string data;
+};
+
+/// Return 'data' zlib-compressed, or an empty string if that does not
+/// make it smaller.
+std::string deflate (const std::string& data)
+{
+    uLongf size = compressBound((uLong) data.size());
+    std::string out(size, '\0');
+    compress2((Bytef*) &out[0], &size, (const Bytef*) data.data(), (uLong) data.size(), 9);
+    out.resize(size);
+    return out.size() < data.size() ? out : std::string();
+}
+
+void metadata_block (std::string& image, const std::string& data, bool compress)
+{
+    std::string packed = compress ? deflate(data) : std::string();
+    if (packed.empty())
+    {
+        put(image, image.size(), data.size() | 0x8000, 2);
+        image += data;
+    }
+    else
+    {
+        put(image, image.size(), packed.size(), 2);
+        image += packed;
+    }
+}
+
+/// Append a data block and return its size field.
+std::uint32_t data_block (std::string& image, const std::string& data, bool compress)
+{
+    std::string packed = compress ? deflate(data) : std::string();
+    if (packed.empty())
+    {
+        image += data;
+        return (std::uint32_t) data.size() | (1 << 24);
+    }
+    image += packed;
+    return (std::uint32_t) packed.size();
+}
+
+/// Return a SquashFS image holding 'files' in the root directory, with
+/// data and metadata blocks compressed with gzip if 'compress' is set.
+/// Uncompressed metadata can be patched in place at 'fields'.
+std::string image (const std::vector<Entry>& files, bool compress, Fields& fields)
+{
+    std::string image(96, '\0');
+
+    // Data blocks of each file, then the tails of all files.
+    struct Layout
+    {
+        std::size_t start;
+        std::vector<std::uint32_t> sizes;
+        bool tail;
+        std::size_t fragment_offset;
+    };
+    std::vector<Layout> layouts;
+    std::string tails;
+    for (const Entry& file : files)
+    {
+        Layout layout = { image.size(), {}, false, tails.size() };
+        std::size_t blocks = file.data.size() / BLOCK_SIZE;
+        for (std::size_t b = 0; b < blocks; ++b)
+        {
+            std::string block = file.data.substr(b * BLOCK_SIZE, BLOCK_SIZE);
+            bool sparse = block.find_first_not_of('\0') == std::string::npos;
+            layout.sizes.push_back(sparse ? 0 : data_block(image, block, compress));
+        }
+        layout.tail = file.data.size() % BLOCK_SIZE != 0;
+        tails += file.data.substr(blocks * BLOCK_SIZE);
+        layouts.push_back(layout);
+    }
+    std::size_t fragment_start = image.size();
+    std::uint32_t fragment_size = tails.empty() ? 0 : data_block(image, tails, compress);
+
+    // Inode table: the files, then the root directory.
+    std::size_t inode_table = image.size();
+    std::string inodes;
+    std::vector<std::size_t> refs;
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+        const Layout& layout = layouts[i];
+        std::size_t at = inodes.size();
+        refs.push_back(at);
+        put(inodes, at, 2, 2); // basic file
+        put(inodes, at + 14, i + 1, 2); // inode number
+        put(inodes, at + 16, layout.start, 4);
+        put(inodes, at + 20, layout.tail ? 0 : 0xFFFFFFFF, 4); // fragment
+        put(inodes, at + 24, layout.tail ? layout.fragment_offset : 0, 4);
+        put(inodes, at + 28, files[i].data.size(), 4);
+        for (std::size_t b = 0; b < layout.sizes.size(); ++b)
+            put(inodes, at + 32 + 4*b, layout.sizes[b], 4);
+    }
+    std::size_t root = inodes.size();
+    std::size_t listing = 12;
+    for (const Entry& file : files) listing += 8 + file.name.size();
+    put(inodes, root, 1, 2); // basic directory
+    put(inodes, root + 14, files.size() + 1, 2);
+    put(inodes, root + 20, 2, 4); // link count
+    put(inodes, root + 24, listing + 3, 2);
+    put(inodes, root + 28, files.size() + 2, 4); // parent
+    fields.listing_size = inode_table + 2 + root + 24;
+    metadata_block(image, inodes, compress);
+
+    // Directory table: one group holding the files.
+    std::size_t directory_table = image.size();
+    std::string dir;
+    put(dir, 0, files.size() - 1, 4); // entries
+    put(dir, 4, 0, 4); // inode block
+    put(dir, 8, 1, 4); // base inode number
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+        std::size_t at = dir.size();
+        put(dir, at, refs[i], 2); // inode offset
+        put(dir, at + 2, i, 2);
+        put(dir, at + 4, 2, 2); // type
+        put(dir, at + 6, files[i].name.size() - 1, 2);
+        dir += files[i].name;
+    }
+    dir += std::string(1024, '\0'); // slack, so an oversized name reads in bounds
+    fields.name_size = directory_table + 2 + 12 + 6;
+    metadata_block(image, dir, compress);
+
+    // Fragment table: one entry, indexed by the offset of its block.
+    std::size_t fragment_table = image.size();
+    if (!tails.empty())
+    {
+        std::string entries;
+        put(entries, 0, fragment_start, 8);
+        put(entries, 8, fragment_size, 4);
+        put(entries, 12, 0, 4);
+        std::size_t entries_block = image.size();
+        metadata_block(image, entries, compress);
+        fragment_table = image.size();
+        put(image, image.size(), entries_block, 8);
+    }
+
+    std::string sb;
+    put(sb, 0, 0x73717368, 4);
+    put(sb, 4, files.size() + 1, 4); // inode count
+    put(sb, 12, BLOCK_SIZE, 4);
+    put(sb, 16, tails.empty() ? 0 : 1, 4); // fragments
+    put(sb, 20, 1, 2); // gzip
+    put(sb, 22, 12, 2);
+    put(sb, 28, 4, 2); // version 4.0
+    put(sb, 32, root, 8);
+    put(sb, 40, image.size(), 8);
+    put(sb, 64, inode_table, 8);
+    put(sb, 72, directory_table, 8);
+    put(sb, 80, fragment_table, 8);
+    image.replace(0, sb.size(), sb);
+    return image;
+}
+
+/// Return an image of one file with uncompressed metadata.
+std::string image (const std::string& name, const std::string& data, Fields& fields)
+{
+    return image({ { name, data } }, false, fields);
+}
+
+std::string image (const std::string& name, const std::string& data)
+{
+    Fields fields;
+    return image(name, data, fields);
+}
+
+/// Return 'blocks' blocks of compressible data differing per block, with
+/// block 'sparse' left as zeros, followed by 'tail' bytes.
+std::string pattern (std::size_t blocks, std::size_t sparse, std::size_t tail)
+{
+    std::string data(blocks * BLOCK_SIZE + tail, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i)
+        if (i / BLOCK_SIZE != sparse) data[i] = (char) ('a' + (i / BLOCK_SIZE + i / 7) % 26);
+    return data;
+}
+
+void open_file (const std::string& path, const char* file)
+{
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new SquashFsFileSystem(path.c_str())));
+    fs.open(file);
+}
+
+} // namespace
+
+TEST(squashfs_lookup)
+{
+    std::string data(BLOCK_SIZE, 'q');
+    std::string path = write_file(scratch("lookup.sqfs"), image("file.txt", data));
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new SquashFsFileSystem(path.c_str())));
+    CHECK(fs.open("file.txt").read_all() == data);
+    CHECK(fs.open("./file.txt").read_all() == data);
+    CHECK_THROWS(fs.open("missing.txt"));
+    CHECK_THROWS(fs.open("file.txt/below"));
+}
+
+TEST(squashfs_empty_and_truncated)
+{
+    CHECK_THROWS(SquashFsFileSystem(write_file(scratch("empty.sqfs"), "").c_str()));
+    CHECK_THROWS(SquashFsFileSystem(write_file(scratch("short.sqfs"), std::string(95, '\0')).c_str()));
+
+    // Cut the image inside the data, inode and directory tables.
+    std::string full = image("file.txt", std::string(BLOCK_SIZE, 'q'));
+    for (std::size_t size : { (std::size_t) 96, (std::size_t) 2000, BLOCK_SIZE + 120, full.size() - 1030 })
+        CHECK_THROWS(open_file(write_file(scratch("truncated.sqfs"), full.substr(0, size)), "file.txt"));
+}
+
+TEST(squashfs_name_too_long)
+{
+    // Name sizes past the format's 256 byte limit used to overflow a
+    // stack buffer.
+    Fields fields;
+    std::string sqfs = image("file.txt", std::string(BLOCK_SIZE, 'q'), fields);
+    put(sqfs, fields.name_size, 0xFFFF, 2);
+    CHECK_THROWS(open_file(write_file(scratch("long_name.sqfs"), sqfs), "file.txt"));
+}
+
+TEST(squashfs_name_past_listing)
+{
+    // A listing that ends inside the entry's name.
+    Fields fields;
+    std::string sqfs = image("file.txt", std::string(BLOCK_SIZE, 'q'), fields);
+    put(sqfs, fields.listing_size, 3 + 12 + 8 + 4, 2);
+    CHECK_THROWS(open_file(write_file(scratch("past_listing.sqfs"), sqfs), "file.txt"));
+}
+
+TEST(squashfs_multi_block)
+{
+    // A file of whole blocks with a sparse one, a file with a tail
+    // fragment after its blocks and a file held in the fragment alone.
+    std::string big = pattern(20, 5, 0);
+    std::string tailed = pattern(3, SIZE_MAX, 100);
+    std::string small = "in the fragment";
+    for (bool compress : { false, true })
+    {
+        Fields fields;
+        std::string sqfs = image({ { "big.bin", big }, { "tailed.bin", tailed }, { "small.txt", small } },
+                                 compress, fields);
+        CHECK(compress == (sqfs.size() < big.size()));
+        std::string path = write_file(scratch("multi_block.sqfs"), sqfs);
+
+        // Read ahead into a cache that holds it all, and into one too
+        // small to keep the blocks read ahead.
+        for (std::size_t cache_size : { (std::size_t) 1 << 20, 2 * BLOCK_SIZE })
+        {
+            FileSystem fs;
+            fs.addHandler(std::unique_ptr<FileSystemHandler>(new SquashFsFileSystem(path.c_str(), cache_size, 8)));
+            CHECK(fs.open("big.bin").read_all() == big);
+            CHECK(fs.open("tailed.bin").read_all() == tailed);
+            CHECK(fs.open("small.txt").read_all() == small);
+
+            // Out of order reads, across blocks and into the tail.
+            File file = fs.open("tailed.bin");
+            std::string part(BLOCK_SIZE + 200, '\0');
+            file.seek(2 * BLOCK_SIZE - 50, std::ios::beg);
+            CHECK(file.read(&part[0], part.size()) == tailed.size() - (2 * BLOCK_SIZE - 50));
+            CHECK(part.compare(0, tailed.size() - (2 * BLOCK_SIZE - 50), tailed, 2 * BLOCK_SIZE - 50,
+                               std::string::npos) == 0);
+            file.seek(BLOCK_SIZE / 2, std::ios::beg);
+            CHECK(file.read(&part[0], 10) == 10);
+            CHECK(part.compare(0, 10, tailed, BLOCK_SIZE / 2, 10) == 0);
+        }
+    }
+}
+
+TEST(squashfs_verification_drops_cache)
+{
+    std::string data = pattern(4, SIZE_MAX, 0);
+    std::string path = write_file(scratch("verified.sqfs"), image("file.bin", data));
+    std::string tree = scratch("verified.sqfs.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+
+    // Cache the blocks, then change one: verification must not serve
+    // the cached blocks read without it.
+    SquashFsFileSystem sqfs(path.c_str());
+    std::unique_ptr<FileHandler> file(sqfs.open("file.bin"));
+    std::string read(data.size(), '\0');
+    CHECK(file->read(&read[0], read.size()) == data.size() && read == data);
+    {
+        std::fstream out(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(96 + 2 * BLOCK_SIZE + 100);
+        out.put('x');
+    }
+    sqfs.enable_verification(tree.c_str());
+    file.reset(sqfs.open("file.bin"));
+    CHECK_THROWS(file->read(&read[0], read.size()));
+}
+
+TEST(squashfs_verification_superblock_changed)
+{
+    // A superblock changed after construction, with a tree written for
+    // the changed image: the fields read before do not match.
+    std::string sqfs = image("file.bin", pattern(2, SIZE_MAX, 0));
+    std::string path = write_file(scratch("superblock.sqfs"), sqfs);
+    SquashFsFileSystem fs(path.c_str());
+
+    put(sqfs, 32, 0, 8); // root inode
+    write_file(path, sqfs);
+    std::string tree = scratch("superblock.sqfs.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+    CHECK_THROWS(fs.enable_verification(tree.c_str()));
+}
+
+#endif
@@ -0,0 +1,261 @@
+#include "test.h"
+
+#include <fstream>
+#include <cstring>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// Return a ustar header block; 'size' is written as octal unless
+/// 'size_field' gives the raw field.
+std::string header (const std::string& name, std::uint64_t size, char type = '0',
+                    const std::string& size_field = std::string())
+{
+    std::string block(512, '\0');
+    block.replace(0, name.size(), name);
+    block.replace(100, 7, "0000644");
+    if (size_field.empty())
+    {
+        char octal[12];
+        std::snprintf(octal, sizeof(octal), "%011llo", (unsigned long long) size);
+        block.replace(124, 11, octal);
+    }
+    else
+        block.replace(124, size_field.size(), size_field);
+    block[156] = type;
+    block.replace(257, 6, std::string("ustar\0", 6));
+    block.replace(263, 2, "00");
+
+    std::uint64_t sum = 0;
+    for (std::size_t i = 0; i < block.size(); ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) block[i];
+    char checksum[8];
+    std::snprintf(checksum, sizeof(checksum), "%06llo", (unsigned long long) sum);
+    block.replace(148, 7, checksum, 7);
+    return block;
+}
+
+std::string member (const std::string& name, const std::string& data)
+{
+    std::string padding((512 - data.size() % 512) % 512, '\0');
+    return header(name, data.size()) + data + padding;
+}
+
+std::string end_blocks ()
+{
+    return std::string(1024, '\0');
+}
+
+void open_tar (const std::string& path)
+{
+    TarFileSystem tar(path.c_str());
+}
+
+/// Return the message of the exception opening a tar file throws, or an
+/// empty string if it opens.
+std::string open_error (const std::string& path)
+{
+    try
+    {
+        open_tar(path);
+    }
+    catch (const std::exception& e)
+    {
+        return e.what();
+    }
+    return std::string();
+}
+
+} // namespace
+
+TEST(tar_round_trip)
+{
+    std::string path = write_file(scratch("round_trip.tar"),
+                                  member("a.txt", "first") + member("dir/b.txt", std::string(700, 'b')) + end_blocks());
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new TarFileSystem(path.c_str())));
+    CHECK(fs.open("a.txt").read_all() == "first");
+    CHECK(fs.open("dir/b.txt").read_all() == std::string(700, 'b'));
+}
+
+TEST(tar_empty_file)
+{
+    std::string path = write_file(scratch("empty.tar"), "");
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new TarFileSystem(path.c_str())));
+    CHECK_THROWS(fs.open("a.txt"));
+}
+
+TEST(tar_truncated_member)
+{
+    std::string tar = member("a.txt", std::string(2000, 'a'));
+    CHECK_THROWS(open_tar(write_file(scratch("truncated.tar"), tar.substr(0, 1024))));
+}
+
+TEST(tar_base256_size_overflow)
+{
+    // A base-256 size just below 2^63, which wraps when added to the
+    // member offset.
+    std::string size("\x80\0\0\0\x7F\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 12);
+    std::string tar = header("huge", 0, '0', size) + end_blocks();
+    CHECK_THROWS(open_tar(write_file(scratch("base256.tar"), tar)));
+
+    size = std::string("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 12);
+    tar = header("huge", 0, '0', size) + end_blocks();
+    CHECK_THROWS(open_tar(write_file(scratch("base256.tar"), tar)));
+}
+
+TEST(tar_pax_size_overflow)
+{
+    std::string record = "29 size=18446744073709551615\n";
+    std::string tar = header("pax", record.size(), 'x') + record + std::string(512 - record.size(), '\0') +
+                      header("huge", 0) + end_blocks();
+    CHECK_THROWS(open_tar(write_file(scratch("pax.tar"), tar)));
+}
+
+TEST(tar_pax_record_too_short)
+{
+    // Record lengths that do not cover their own prefix, or that do not
+    // end at a newline.
+    const char* records[] = { "1 ", "2 path=a\n", "9 path=ab\n" };
+    for (const char* record : records)
+    {
+        std::string data = record;
+        std::string tar = header("pax", data.size(), 'x') + data + std::string(512 - data.size(), '\0') +
+                          member("a.txt", "first") + end_blocks();
+        CHECK(open_error(write_file(scratch("pax_short.tar"), tar)).find("Corrupt tar header") != std::string::npos);
+    }
+}
+
+TEST(tar_index_entry_overflow)
+{
+    std::string path = write_file(scratch("indexed.tar"), member("a.txt", "first") + end_blocks());
+    std::string index_path = scratch("indexed.tar.index");
+    TarFileSystem(path.c_str()).save_index(index_path.c_str());
+
+    // Point the entry near 2^64 so that offset + size wraps; the index
+    // must be ignored and the tar scanned instead.
+    std::string index = read_file(index_path);
+    put(index, 24, 0xFFFFFFFFFFFFFF00ull, 8);
+    put(index, 32, 0x200, 8);
+    write_file(index_path, index);
+
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new TarFileSystem(path.c_str(), index_path.c_str())));
+    CHECK(fs.open("a.txt").read_all() == "first");
+}
+
+TEST(tar_verified_member_changed)
+{
+    std::string path = write_file(scratch("verified.tar"), member("a.txt", std::string(3000, 'a')) + end_blocks());
+    std::string tree = scratch("verified.tar.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+
+    TarFileSystem tar(path.c_str());
+    tar.enable_verification(tree.c_str());
+    std::uint64_t entry;
+    CHECK(tar.resolve("a.txt", entry));
+    std::unique_ptr<FileHandler> file(tar.open_resolved(entry));
+
+    // Change the member in place once it was verified: the open file
+    // keeps the verified bytes and opening it again fails.
+    {
+        std::fstream out(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(512 + 2000);
+        out.put('x');
+    }
+    std::string data(3000, '\0');
+    CHECK(file->read(&data[0], data.size()) == data.size());
+    CHECK(data == std::string(3000, 'a'));
+    CHECK_THROWS(std::unique_ptr<FileHandler>(tar.open_resolved(entry)));
+}
+
+TEST(tar_verified_forged_index)
+{
+    std::string path = write_file(scratch("forged.tar"),
+                                  member("a.txt", "first") + member("b.txt", "second") + end_blocks());
+    std::string index_path = scratch("forged.tar.index");
+    TarFileSystem(path.c_str()).save_index(index_path.c_str());
+    std::string tree = scratch("forged.tar.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+
+    // Point a.txt at the data of b.txt, which verifies on its own.
+    std::string index = read_file(index_path);
+    index.replace(24, 16, index.substr(40, 16));
+    write_file(index_path, index);
+
+    TarFileSystem tar(path.c_str(), index_path.c_str());
+    CHECK_THROWS(tar.enable_verification(tree.c_str()));
+}
+
+TEST(tar_verified_extended_headers)
+{
+    // Members named by a GNU long name and a PAX record, each in the
+    // blocks before their own header.
+    std::string long_name(150, 'l');
+    std::string record = "16 path=pax.txt\n";
+    std::string path = write_file(scratch("extended.tar"),
+                                  header("././@LongLink", long_name.size() + 1, 'L') +
+                                  long_name + std::string(512 - long_name.size(), '\0') +
+                                  member("ignored", "long") +
+                                  header("pax", record.size(), 'x') + record + std::string(512 - record.size(), '\0') +
+                                  member("ignored.txt", "pax") + end_blocks());
+    std::string tree = scratch("extended.tar.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+
+    FileSystem fs;
+    std::unique_ptr<TarFileSystem> tar(new TarFileSystem(path.c_str()));
+    tar->enable_verification(tree.c_str());
+    fs.addHandler(std::move(tar));
+    CHECK(fs.open(long_name.c_str()).read_all() == "long");
+    CHECK(fs.open("pax.txt").read_all() == "pax");
+}
+
+TEST(tar_verified_tree_changed)
+{
+    std::string path = write_file(scratch("retree.tar"), member("a.txt", std::string(3000, 'a')) + end_blocks());
+    std::string tree = scratch("retree.tar.tree");
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+
+    TarFileSystem tar(path.c_str());
+    tar.enable_verification(tree.c_str());
+    std::uint64_t entry;
+    CHECK(tar.resolve("a.txt", entry));
+    std::unique_ptr<FileHandler>(tar.open_resolved(entry));
+
+    // Change the member and write a matching tree over the loaded one:
+    // the verifier keeps the tree it loaded.
+    {
+        std::fstream out(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(512 + 2000);
+        out.put('x');
+    }
+    write_merkle_tree(path.c_str(), tree.c_str(), 1024);
+    CHECK_THROWS(std::unique_ptr<FileHandler>(tar.open_resolved(entry)));
+}
+
+TEST(tar_pipeline)
+{
+    // Tar has no fetch of its own; the default reads the members in the
+    // read stage.
+    std::string path = write_file(scratch("pipeline.tar"),
+                                  member("a.txt", "first") + member("b.txt", std::string(700, 'b')) + end_blocks());
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new TarFileSystem(path.c_str())));
+
+    std::vector<FilePath> paths = { "a.txt", "missing", "b.txt" };
+    std::vector<std::string> loaded(paths.size());
+    std::vector<bool> failed(paths.size());
+    fs.load_pipeline(paths, PipelineOptions(), [&](LoadResult&& result)
+    {
+        failed[result.index] = bool(result.error);
+        if (!result.error)
+            loaded[result.index].assign((const char*) result.data.get(), result.size);
+    });
+    CHECK(!failed[0] && loaded[0] == "first");
+    CHECK(failed[1]);
+    CHECK(!failed[2] && loaded[2] == std::string(700, 'b'));
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <file.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+
+namespace test
+{
+
+/// A test case, registered on construction.
+struct Case
+{
+    Case (const char* name, void (*run) ());
+};
+
+/// Thrown by CHECK on failure.
+struct Failure : std::runtime_error
+{
+    explicit Failure (const std::string& what) : std::runtime_error(what) {}
+};
+
+/// Define a test case.
+#define TEST(name) \
+    static void name (); \
+    static test::Case name##_case(#name, name); \
+    static void name ()
+
+/// Fail the test case unless 'condition' holds.
+#define CHECK(condition) \
+    do { if (!(condition)) test::fail(__FILE__, __LINE__, #condition); } while (0)
+
+/// Fail the test case unless 'expression' throws a std::exception.
+#define CHECK_THROWS(expression) \
+    do \
+    { \
+        bool thrown = false; \
+        try { expression; } catch (const std::exception&) { thrown = true; } \
+        if (!thrown) test::fail(__FILE__, __LINE__, "throws " #expression); \
+    } while (0)
+
+[[noreturn]] void fail (const char* file, int line, const char* what);
+
+/// Return the path of a scratch file of the given name; scratch files
+/// live under a directory created by the test runner.
+std::string scratch (const std::string& name);
+
+/// Write 'data' to a file and return its path.
+std::string write_file (const std::string& path, const std::string& data);
+
+/// Return the contents of a file.
+std::string read_file (const std::string& path);
+
+/// Store a little-endian value of 'bytes' bytes at 'offset' in 'data',
+/// growing it as needed.
+void put (std::string& data, std::size_t offset, std::uint64_t value, std::size_t bytes);
+
+} // namespace test
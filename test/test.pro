@@ -0,0 +1,48 @@
+TEMPLATE = app
+TARGET = test
+CONFIG += console
+CONFIG -= qt app_bundle
+
+CONFIG(release, debug|release) {
+    DESTDIR=$$(SRC)/build/release
+    OBJECTS_DIR=$$(SRC)/.obj/release/$$TARGET
+}
+else {
+    DESTDIR=$$(SRC)/build/debug
+    OBJECTS_DIR=$$(SRC)/.obj/debug/$$TARGET
+}
+
+QMAKE_CXXFLAGS_DEBUG += -D_DEBUG
+unix: {
+    QMAKE_CXXFLAGS += --std=c++11
+    LIBS += -lpthread
+}
+LIBS += -L$$DESTDIR -lfile
+!contains(DEFINES, FILESYSTEM_DISABLE_ZIP) {
+    LIBS += -lz
+}
+!contains(DEFINES, FILESYSTEM_DISABLE_ZSTD) {
+    LIBS += -lzstd
+}
+win32: {
+    QMAKE_CXXFLAGS += -DNOMINMAX
+    QMAKE_CXXFLAGS_DEBUG += /Zi
+    QMAKE_LFLAGS_DEBUG += /_DEBUG
+}
+
+INCLUDEPATH = ../include $$(SRC)/cpp/include
+DEPENDPATH = ../include $$(SRC)/cpp/include
+
+HEADERS += test.h
+
+SOURCES += main.cc \
+           content.cc \
+           file.cc \
+           memory.cc \
+           pathindex.cc \
+           pool.cc \
+           pressure.cc \
+           squashfs.cc \
+           tar.cc \
+           zip.cc \
+           zstd.cc
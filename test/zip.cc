@@ -0,0 +1,416 @@
+#include "test.h"
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+std::string make_zip (const std::string& name)
+{
+    std::string path = scratch(name);
+    ZipWriter writer(path.c_str());
+    std::string a = "first file", b(5000, 'b');
+    writer.add("a.txt", a.data(), a.size());
+    writer.add("dir/b.txt", b.data(), b.size());
+    writer.finish();
+    return path;
+}
+
+void open_zip (const std::string& path)
+{
+    ZipFileSystem zip(path.c_str());
+}
+
+/// Return 'count' small JSON documents and a few XML ones, named by
+/// index, and files too large for a dictionary or that do not compress.
+std::vector<std::pair<std::string, std::string>> writer_files (std::size_t count)
+{
+    std::vector<std::pair<std::string, std::string>> files;
+    for (std::size_t i = 0; i < count; ++i)
+        files.emplace_back("docs/" + std::to_string(i) + ".json",
+                           "{\"id\": " + std::to_string(i) + ", \"name\": \"item " + std::to_string(i * 7919 % 1000) +
+                           "\", \"tags\": [\"red\", \"round\"], \"value\": " + std::to_string(i * 37 % 1000) + "}");
+    for (std::size_t i = 0; i < count / 8; ++i)
+        files.emplace_back("docs/" + std::to_string(i) + ".xml",
+                           "<item id=\"" + std::to_string(i) + "\"><value>" + std::to_string(i * 53 % 1000) + "</value></item>");
+    std::string noise(20000, '\0');
+    std::uint32_t state = 7;
+    for (char& c : noise) c = (char) ((state = state * 1103515245 + 12345) >> 16);
+    files.emplace_back("noise.bin", noise);
+    files.emplace_back("large.txt", std::string(100000, 'l'));
+    files.emplace_back("empty.json", "");
+    return files;
+}
+
+} // namespace
+
+TEST(zip_round_trip)
+{
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(make_zip("round_trip.zip").c_str())));
+    CHECK(fs.open("a.txt").read_all() == "first file");
+    CHECK(fs.open("dir/b.txt").read_all() == std::string(5000, 'b'));
+    CHECK_THROWS(fs.open("missing"));
+}
+
+TEST(zip_empty_and_tiny_files)
+{
+    // Files shorter than an end of central directory record, some
+    // starting with its signature.
+    for (std::size_t size = 0; size < 22; ++size)
+    {
+        std::string data(size, 0);
+        if (size >= 4) data.replace(0, 4, "PK\x05\x06");
+        CHECK_THROWS(open_zip(write_file(scratch("tiny.zip"), data)));
+    }
+}
+
+TEST(zip_truncated)
+{
+    std::string zip = read_file(make_zip("whole.zip"));
+    for (std::size_t size = 0; size < zip.size(); size += 7)
+        CHECK_THROWS(open_zip(write_file(scratch("truncated.zip"), zip.substr(0, size))));
+}
+
+TEST(zip_central_directory_past_end)
+{
+    std::string zip = read_file(make_zip("whole.zip"));
+    std::size_t eocd = zip.rfind("PK\x05\x06");
+    CHECK(eocd != std::string::npos);
+    put(zip, eocd + 16, 0xFFFFFFF0, 4);
+    CHECK_THROWS(open_zip(write_file(scratch("bad_offset.zip"), zip)));
+}
+
+TEST(zip64_central_directory_overflow)
+{
+    // A zip64 record whose offset and size sum past 2^64.
+    std::string zip;
+    put(zip, 0, 0x06064b50, 4);
+    put(zip, 4, 44, 8);
+    put(zip, 24, 1, 8);
+    put(zip, 32, 1, 8);
+    put(zip, 40, 0x20, 8);
+    put(zip, 48, 0xFFFFFFFFFFFFFFF0ull, 8);
+    put(zip, 56, 0x07064b50, 4);
+    put(zip, 64, 0, 8);
+    put(zip, 72, 1, 4);
+    put(zip, 76, 0x06054b50, 4);
+    put(zip, 84, 0xFFFF, 2);
+    put(zip, 86, 0xFFFF, 2);
+    put(zip, 88, 0xFFFFFFFF, 4);
+    put(zip, 92, 0xFFFFFFFF, 4);
+    put(zip, 96, 0, 2);
+    CHECK_THROWS(open_zip(write_file(scratch("zip64.zip"), zip)));
+}
+
+TEST(zip_entry_past_central_directory)
+{
+    std::string zip = read_file(make_zip("whole.zip"));
+    std::size_t central = zip.find("PK\x01\x02");
+    CHECK(central != std::string::npos);
+    put(zip, central + 20, 0xFFFFFFF0, 4); // compressed size
+    CHECK_THROWS(open_zip(write_file(scratch("bad_entry.zip"), zip)));
+}
+
+TEST(zip_content_key_forged)
+{
+    // Two archives with files of the same size; the second records the
+    // SHA-256 of the first's file for its own.
+    std::string genuine = "genuine contents", forged = "tampered content";
+    std::string a = scratch("genuine.zip"), b = scratch("forged.zip");
+    {
+        ZipWriter writer(a.c_str());
+        writer.add("a.txt", genuine.data(), genuine.size());
+        writer.finish();
+        ZipWriter other(b.c_str());
+        other.add("b.txt", forged.data(), forged.size());
+        other.finish();
+    }
+    const std::string field("\x58\x4B\x20\x00", 4);
+    std::string zip_a = read_file(a), zip_b = read_file(b);
+    std::size_t digest_a = zip_a.find(field), digest_b = zip_b.find(field);
+    CHECK(digest_a != std::string::npos && digest_b != std::string::npos);
+    zip_b.replace(digest_b + 4, 32, zip_a, digest_a + 4, 32);
+    write_file(b, zip_b);
+
+    // The forged file must not enter the cache, where it would be served
+    // for the genuine one.
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(a.c_str())));
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(b.c_str())));
+    fs.setContentCache(1 << 20);
+    CHECK_THROWS(fs.open("b.txt"));
+    CHECK(fs.open("a.txt").read_all() == genuine);
+}
+
+TEST(zip_folded_lookup)
+{
+    std::string path = scratch("folded.zip");
+    {
+        ZipWriter writer(path.c_str());
+        writer.add("Models/Tree.obj", "first", 5);
+        writer.add("models/TREE.obj", "second", 6);
+        writer.add("readme", "readme", 6);
+        writer.finish();
+    }
+    ZipFileSystem* zip = new ZipFileSystem(path.c_str());
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(zip));
+    fs.setFoldedLookup(true);
+
+    // Keys shared by several entries resolve to the first of them.
+    CHECK(fs.open(".\\MODELS\\\\tree.obj").read_all() == "first");
+    CHECK(fs.open("models/TREE.obj").read_all() == "second");
+    CHECK(fs.open("/README").read_all() == "readme");
+    CHECK_THROWS(fs.open("models/tree"));
+    CHECK(zip->folded_collisions() == std::vector<std::string>(1, "models/tree.obj"));
+}
+
+TEST(zip_groups)
+{
+    std::string manifest =
+        "a.txt\r\n"                    // before any group: ignored
+        "# comment\r\n"
+        "[textures]\r\n"
+        "  dir/b.txt \t\r\n"
+        "\r\n"
+        "a.txt\r\n"
+        "[empty]\n"
+        "# dir/b.txt\n"
+        "[models]\n"
+        "dir/b.txt";                   // no final newline
+    std::string path = scratch("groups.zip");
+    {
+        ZipWriter writer(path.c_str());
+        writer.add("a.txt", "first", 5);
+        writer.add("dir/b.txt", "second", 6);
+        writer.add(ZipFileSystem::manifest_name, manifest.data(), manifest.size());
+        writer.finish();
+    }
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+
+    std::vector<File> textures = fs.load_group("textures");
+    CHECK(textures.size() == 2);
+    CHECK(textures[0].read_all() == "second");
+    CHECK(textures[1].read_all() == "first");
+    CHECK(fs.load_group("empty").empty());
+    std::vector<File> models = fs.load_group("models");
+    CHECK(models.size() == 1 && models[0].read_all() == "second");
+    CHECK_THROWS(fs.load_group("comment"));
+    CHECK_THROWS(fs.load_group("missing"));
+}
+
+TEST(zip_groups_missing)
+{
+    // Without a manifest no group is known.
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(make_zip("no_groups.zip").c_str())));
+    CHECK_THROWS(fs.load_group("textures"));
+
+    // A member missing from the archive fails the load.
+    std::string path = scratch("bad_group.zip");
+    {
+        ZipWriter writer(path.c_str());
+        std::string manifest = "[textures]\nmissing.txt\n";
+        writer.add("a.txt", "first", 5);
+        writer.add(ZipFileSystem::manifest_name, manifest.data(), manifest.size());
+        writer.finish();
+    }
+    FileSystem bad;
+    bad.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+    CHECK_THROWS(bad.load_group("textures"));
+    CHECK(bad.open("a.txt").read_all() == "first");
+}
+
+TEST(zip_batch_order)
+{
+    // Entries of 300 KB that do not compress, so the gaps between some
+    // of them split the batch into several reads.
+    std::vector<std::string> names, contents;
+    std::string path = scratch("batch.zip");
+    {
+        ZipWriter writer(path.c_str());
+        std::uint32_t state = 1;
+        for (int i = 0; i < 6; ++i)
+        {
+            std::string data(i % 2 ? 300 << 10 : 100 + i, '\0');
+            for (char& c : data) c = (char) ((state = state * 1103515245 + 12345) >> 16);
+            names.push_back("batch" + std::to_string(i) + ".bin");
+            contents.push_back(data);
+            writer.add(names.back().c_str(), data.data(), data.size());
+        }
+        writer.finish();
+    }
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+
+    // Results follow the order of the request, not of the archive. The
+    // large entries 1 and 3, which are skipped, split the request into
+    // three reads.
+    std::vector<std::size_t> order = { 4, 0, 5, 2, 0 };
+    std::vector<FilePath> paths;
+    for (std::size_t i : order) paths.push_back(names[i].c_str());
+    std::vector<File> files = fs.open_batch(paths);
+    CHECK(files.size() == order.size());
+    for (std::size_t k = 0; k < files.size(); ++k)
+        CHECK(files[k].read_all() == contents[order[k]]);
+}
+
+TEST(zip_parallel_central_directory)
+{
+    // 16384 entries are parsed in parallel, one fewer serially. Names
+    // of varying length make records straddle the parsed ranges.
+    const std::size_t count = 16384;
+    ZipWriterOptions options;
+    options.small_file = 0;
+    std::string parallel = scratch("parallel.zip"), serial = scratch("serial.zip");
+    {
+        ZipWriter big(parallel.c_str(), options), small(serial.c_str(), options);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::string name = "dir" + std::to_string(i % 13) + "/" + std::string(i % 7, 'x') + std::to_string(i);
+            std::string data = "entry " + std::to_string(i);
+            big.add(name.c_str(), data.data(), data.size());
+            if (i + 1 < count) small.add(name.c_str(), data.data(), data.size());
+        }
+        big.finish();
+        small.finish();
+    }
+    ZipFileSystem big(parallel.c_str()), small(serial.c_str());
+
+    // Every path resolves to the same entry and contents in both.
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::string name = "dir" + std::to_string(i % 13) + "/" + std::string(i % 7, 'x') + std::to_string(i);
+        std::uint64_t a = 0, b = 0;
+        ContentKey ka, kb;
+        CHECK(big.resolve(name.c_str(), a) && big.content_key(a, ka));
+        CHECK((i + 1 < count) == small.resolve(name.c_str(), b));
+        if (i + 1 < count) CHECK(small.content_key(b, kb) && a == b && ka == kb);
+        if (i % 997 == 0)
+        {
+            std::unique_ptr<FileHandler> file(big.open_resolved(a));
+            std::string data(ka.size, '\0');
+            CHECK(file->read(&data[0], data.size()) == data.size() && data == "entry " + std::to_string(i));
+        }
+    }
+    std::uint64_t entry;
+    CHECK(!big.resolve("dir0/missing", entry));
+}
+
+TEST(zip_read_all_owned)
+{
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(make_zip("owned.zip").c_str())));
+    std::string b(5000, 'b');
+
+    // An inflated entry owned by its file alone is moved out, leaving
+    // the file empty.
+    File file = fs.open("dir/b.txt");
+    std::size_t size = 0;
+    Buffer data = file.read_all_owned(size);
+    CHECK(size == b.size() && std::string((const char*) data.get(), size) == b);
+    CHECK(file.size() == 0 && file.read_all().empty());
+
+    // While a clone shares the data, the whole file is copied, whatever
+    // the position, and both keep their data.
+    File shared = fs.open("dir/b.txt");
+    File clone = shared.clone();
+    char skipped[10];
+    shared.read(skipped, sizeof(skipped));
+    data = shared.read_all_owned(size);
+    CHECK(size == b.size() && std::string((const char*) data.get(), size) == b);
+    CHECK(shared.size() == b.size() && clone.read_all() == b);
+
+    // The clone, now alone, gives its data up.
+    shared = fs.open("a.txt");
+    data = clone.read_all_owned(size);
+    CHECK(size == b.size() && clone.size() == 0);
+}
+
+TEST(zip_writer_round_trip)
+{
+    // The JSON dictionary is trained once 20000 bytes of documents are
+    // held, part way through, and later documents are compressed as
+    // they are added. The XML documents stay below the training size and
+    // are held until finish().
+    std::vector<std::pair<std::string, std::string>> files = writer_files(400);
+    ZipWriterOptions plain, trained;
+    plain.dictionary_size = 0;
+    trained.dictionary_size = 8 << 10;
+    trained.training_bytes = 20000;
+    std::vector<std::string> paths = { scratch("plain.zip"), scratch("trained.zip") };
+    {
+        ZipWriter a(paths[0].c_str(), plain), b(paths[1].c_str(), trained);
+        for (const auto& file : files)
+        {
+            a.add(file.first.c_str(), file.second.data(), file.second.size());
+            b.add(file.first.c_str(), file.second.data(), file.second.size());
+        }
+        a.finish();
+        b.finish();
+        CHECK_THROWS(a.add("late.txt", "late", 4));
+    }
+
+    for (const std::string& path : paths)
+    {
+        FileSystem fs;
+        fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+        for (const auto& file : files)
+        {
+            CHECK(fs.open(file.first.c_str()).read_all() == file.second);
+            std::string read;
+            CHECK(fs.read_progressive(file.first.c_str(), 100, [&](const std::uint8_t* p, std::size_t n, std::uint64_t)
+            {
+                read.append((const char*) p, n);
+                return true;
+            }));
+            CHECK(read == file.second);
+        }
+    }
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+    // The dictionary is stored in the archive and shrinks the documents.
+    std::string zip = read_file(paths[1]);
+    CHECK(zip.find(ZipFileSystem::dictionary_prefix) != std::string::npos);
+    CHECK(read_file(paths[0]).find(ZipFileSystem::dictionary_prefix) == std::string::npos);
+    CHECK(zip.size() < read_file(paths[0]).size());
+#endif
+}
+
+TEST(zip_writer_wrong_digest)
+{
+    // Every SHA-256 recorded in the central directory is corrupted.
+    std::vector<std::pair<std::string, std::string>> files = writer_files(400);
+    ZipWriterOptions options;
+    options.dictionary_size = 8 << 10;
+    options.training_bytes = 20000;
+    std::string path = scratch("wrong_digest.zip");
+    {
+        ZipWriter writer(path.c_str(), options);
+        for (const auto& file : files) writer.add(file.first.c_str(), file.second.data(), file.second.size());
+        writer.finish();
+    }
+    const std::string field("\x58\x4B\x20\x00", 4);
+    std::string zip = read_file(path);
+    std::size_t corrupted = 0;
+    for (std::size_t at = zip.find(field, zip.find("PK\x01\x02")); at != std::string::npos; at = zip.find(field, at + 4))
+    {
+        zip[at + 4 + corrupted % 32] ^= 1;
+        ++corrupted;
+    }
+    CHECK(corrupted >= files.size());
+    write_file(path, zip);
+
+    // Digests only matter to the content cache, which rejects the files,
+    // compressed with a dictionary or not, rather than cache them.
+    FileSystem fs;
+    fs.addHandler(std::unique_ptr<FileSystemHandler>(new ZipFileSystem(path.c_str())));
+    CHECK(fs.open("docs/1.json").read_all() == files[1].second);
+    fs.setContentCache(1 << 20);
+    CHECK_THROWS(fs.open("docs/1.json"));
+    CHECK_THROWS(fs.open("docs/399.json"));
+    CHECK_THROWS(fs.open("large.txt"));
+}
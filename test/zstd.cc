@@ -0,0 +1,124 @@
+#include "test.h"
+
+#ifndef FILESYSTEM_DISABLE_ZSTD
+
+#include <zstd.h>
+#include <algorithm>
+
+using namespace kx;
+using namespace test;
+
+namespace
+{
+
+/// Return 'data' in the seekable format, in frames of 'frame' bytes.
+/// With 'checksums' the seek table gives each frame's checksum, taken
+/// from the frame's own content checksum.
+std::string seekable (const std::string& data, std::size_t frame, bool checksums)
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, checksums ? 1 : 0);
+    std::string out, table;
+    std::size_t frames = 0;
+    for (std::size_t pos = 0; pos < data.size(); pos += frame, ++frames)
+    {
+        std::size_t size = std::min(frame, data.size() - pos);
+        std::string packed(ZSTD_compressBound(size), '\0');
+        std::size_t n = ZSTD_compress2(cctx, &packed[0], packed.size(), data.data() + pos, size);
+        packed.resize(n);
+        out += packed;
+        std::size_t entry = table.size();
+        put(table, entry, n, 4);
+        put(table, entry + 4, size, 4);
+        if (checksums) table += packed.substr(n - 4);
+    }
+    ZSTD_freeCCtx(cctx);
+
+    std::string footer;
+    put(footer, 0, 0x184D2A5E, 4);
+    put(footer, 4, table.size() + 9, 4);
+    footer += table;
+    std::size_t end = footer.size();
+    put(footer, end, frames, 4);
+    footer.push_back(checksums ? (char) 0x80 : 0);
+    put(footer, end + 5, 0x8F92EAB1, 4);
+    return out + footer;
+}
+
+std::unique_ptr<FileHandler> memory_file (const std::string& data)
+{
+    Buffer buffer = allocate_buffer(data.size());
+    std::copy(data.begin(), data.end(), buffer.get());
+    return std::unique_ptr<FileHandler>(new MemFile(std::move(buffer), data.size()));
+}
+
+std::string read_seekable (const std::string& data)
+{
+    SeekableZstdFile file(memory_file(data));
+    std::string out(file.size(), '\0');
+    out.resize(file.read(&out[0], out.size()));
+    return out;
+}
+
+std::string sample (std::size_t size)
+{
+    std::string data(size, '\0');
+    for (std::size_t i = 0; i < size; ++i) data[i] = (char) ("seekable zstd "[i % 14] + i / 997 % 3);
+    return data;
+}
+
+} // namespace
+
+TEST(zstd_round_trip)
+{
+    std::string data = sample(100000);
+    CHECK(read_seekable(seekable(data, 4096, false)) == data);
+    CHECK(read_seekable(seekable(data, 4096, true)) == data);
+
+    // A read in the middle of a frame.
+    SeekableZstdFile file(memory_file(seekable(data, 4096, true)));
+    file.seek(5000, std::ios::beg);
+    char buffer[100];
+    CHECK(file.read(buffer, sizeof(buffer)) == sizeof(buffer));
+    CHECK(std::string(buffer, sizeof(buffer)) == data.substr(5000, 100));
+}
+
+TEST(zstd_checksum_mismatch)
+{
+    std::string data = sample(10000);
+    std::string file = seekable(data, 4096, true);
+    // Flip a bit of the last frame's checksum in the seek table.
+    std::size_t checksum = file.size() - 9 - 4;
+    file[checksum] ^= 1;
+    CHECK_THROWS(read_seekable(file));
+}
+
+TEST(zstd_empty_and_truncated)
+{
+    std::string file = seekable(sample(10000), 4096, false);
+    for (std::size_t size = 0; size < file.size(); size += 5)
+        CHECK_THROWS(read_seekable(file.substr(0, size)));
+}
+
+TEST(zstd_frame_count_overflow)
+{
+    // 0xFFFFFFFF frames, which wraps a 32-bit frame count plus one.
+    std::string file = seekable(sample(10000), 4096, false);
+    put(file, file.size() - 9, 0xFFFFFFFF, 4);
+    CHECK_THROWS(read_seekable(file));
+
+    // A count whose table would be larger than the file.
+    put(file, file.size() - 9, 1 << 20, 4);
+    CHECK_THROWS(read_seekable(file));
+}
+
+TEST(zstd_frame_sizes_past_end)
+{
+    std::string file = seekable(sample(10000), 4096, false);
+    // The first entry's compressed size no longer sums to the data size.
+    std::size_t table = file.size() - 9 - 3 * 8;
+    put(file, table, 0xFFFFFFFF, 4);
+    CHECK_THROWS(read_seekable(file));
+}
+
+#endif // FILESYSTEM_DISABLE_ZSTD